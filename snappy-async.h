@@ -0,0 +1,254 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Compression and decompression as C++20 coroutines, for programs that run
+// on an event loop and cannot block it for the length of a large message:
+//
+//   snappy::AsyncStatus status =
+//       co_await snappy::CompressAsync(&source, &sink, loop_executor);
+//
+// The work is done a few blocks at a time, on "*executor" between yields,
+// so other work on the same executor gets its turn in between. Give it an
+// executor that posts to the event loop to interleave the work with it, or
+// a thread pool to take the work off the loop altogether (the awaiting
+// coroutine then also resumes on the pool). Everything here is in this
+// header, so the library itself does not need to be built as C++20; it is
+// empty for compilers without coroutines.
+
+#ifndef UTIL_SNAPPY_SNAPPY_ASYNC_H__
+#define UTIL_SNAPPY_SNAPPY_ASYNC_H__
+
+#include "snappy.h"
+#include "snappy-sinksource.h"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+namespace snappy {
+
+  // How many 64 KiB blocks CompressAsync() and UncompressAsync() process
+  // between yields; a few hundred microseconds of work.
+  static const int kAsyncBlocksPerSlice = 4;
+
+  enum class AsyncStatus {
+    kOk,
+    kCancelled,     // The CancellationFlag was set; the output is partial.
+    kCorrupted,     // UncompressAsync() got invalid data; output is partial.
+    kTruncated,     // CompressAsync()'s source ended early; output is partial.
+  };
+
+  // Tells a running CompressAsync() or UncompressAsync() to stop at its
+  // next yield. May be set from any thread.
+  class CancellationFlag {
+   public:
+    CancellationFlag() : cancelled_(false) { }
+
+    void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+    bool cancelled() const {
+      return cancelled_.load(std::memory_order_relaxed);
+    }
+
+   private:
+    std::atomic<bool> cancelled_;
+
+    CancellationFlag(const CancellationFlag&);
+    void operator=(const CancellationFlag&);
+  };
+
+  // The result of a coroutine below: it starts running when awaited, and
+  // resumes the awaiting coroutine with its value when done.
+  template <typename T>
+  class [[nodiscard]] Async {
+   public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct FinalAwaiter {
+      bool await_ready() const noexcept { return false; }
+      std::coroutine_handle<> await_suspend(Handle handle) noexcept {
+        std::coroutine_handle<> continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+      }
+      void await_resume() const noexcept { }
+    };
+
+    struct promise_type {
+      T value;
+      std::exception_ptr exception;
+      std::coroutine_handle<> continuation;
+
+      Async get_return_object() { return Async(Handle::from_promise(*this)); }
+      std::suspend_always initial_suspend() const noexcept { return {}; }
+      FinalAwaiter final_suspend() const noexcept { return {}; }
+      void return_value(T v) { value = std::move(v); }
+      void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    Async(Async&& other) noexcept : handle_(other.handle_) {
+      other.handle_ = Handle();
+    }
+    ~Async() {
+      if (handle_) {
+        handle_.destroy();
+      }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+      handle_.promise().continuation = awaiter;
+      return handle_;
+    }
+    T await_resume() {
+      if (handle_.promise().exception) {
+        std::rethrow_exception(handle_.promise().exception);
+      }
+      return std::move(handle_.promise().value);
+    }
+
+   private:
+    explicit Async(Handle handle) : handle_(handle) { }
+
+    Handle handle_;
+
+    Async(const Async&);
+    void operator=(const Async&);
+  };
+
+  namespace internal {
+
+  // Awaiting this continues the coroutine in a task on "*executor".
+  class ResumeOn {
+   public:
+    explicit ResumeOn(Executor* executor)
+        : executor_(executor), state_(kSubmitting) { }
+
+    bool await_ready() const noexcept { return false; }
+    void await_resume() const noexcept { }
+
+    // Returns false, to continue right away, if the executor ran the task
+    // inside Submit(); resuming from there would nest a stack frame per
+    // yield.
+    bool await_suspend(std::coroutine_handle<> handle) {
+      executor_->Submit(new ResumeTask(handle, &state_));
+      return state_.exchange(kSuspended) == kSubmitting;
+    }
+
+   private:
+    enum State { kSubmitting, kSuspended, kRan };
+
+    class ResumeTask : public Executor::Task {
+     public:
+      ResumeTask(std::coroutine_handle<> handle, std::atomic<int>* state)
+          : handle_(handle), state_(state) { }
+
+      virtual void Run() {
+        // "*state_" lives in the coroutine, which may be gone once it
+        // knows the task ran; do not touch it afterwards.
+        const bool suspended = state_->exchange(kRan) == kSuspended;
+        const std::coroutine_handle<> handle = handle_;
+        delete this;
+        if (suspended) {
+          handle.resume();
+        }
+      }
+
+     private:
+      std::coroutine_handle<> handle_;
+      std::atomic<int>* state_;
+    };
+
+    Executor* executor_;
+    std::atomic<int> state_;
+  };
+
+  }  // end namespace internal
+
+  // Compresses "*source" into "*sink" like Compress(), yielding to
+  // "*executor" every kAsyncBlocksPerSlice blocks and stopping early if
+  // "*cancel" is set. With a NULL executor it runs to completion on the
+  // awaiting thread. Internal buffers come from the allocator of the
+  // awaiting thread.
+  inline Async<AsyncStatus> CompressAsync(Source* source, Sink* sink,
+                                          Executor* executor,
+                                          CancellationFlag* cancel = NULL) {
+    CompressingSource compressed(source);
+    for (int blocks = 0; ; ++blocks) {
+      if (executor != NULL && blocks % kAsyncBlocksPerSlice == 0) {
+        co_await internal::ResumeOn(executor);
+      }
+      if (cancel != NULL && cancel->cancelled()) {
+        co_return AsyncStatus::kCancelled;
+      }
+      // Each read past the end of the ready output compresses a block.
+      size_t n;
+      const char* fragment = compressed.Peek(&n);
+      if (n == 0) {
+        break;
+      }
+      sink->Append(fragment, n);
+      compressed.Skip(n);
+    }
+    co_return compressed.ok() ? AsyncStatus::kOk : AsyncStatus::kTruncated;
+  }
+
+  // Likewise, decompresses "*source" into "*sink" like Uncompress(). As
+  // there, compressed data that is corrupted, ends early or is followed by
+  // more bytes in "*source" is kCorrupted.
+  inline Async<AsyncStatus> UncompressAsync(Source* source, Sink* sink,
+                                            Executor* executor,
+                                            CancellationFlag* cancel = NULL) {
+    UncompressingSource uncompressed(source);
+    for (int blocks = 0; ; ++blocks) {
+      if (executor != NULL && blocks % kAsyncBlocksPerSlice == 0) {
+        co_await internal::ResumeOn(executor);
+      }
+      if (cancel != NULL && cancel->cancelled()) {
+        co_return AsyncStatus::kCancelled;
+      }
+      size_t n;
+      const char* fragment = uncompressed.Peek(&n);
+      if (n == 0) {
+        break;
+      }
+      sink->Append(fragment, n);
+      uncompressed.Skip(n);
+    }
+    // UncompressingSource stops at the end of the compressed data.
+    co_return uncompressed.ok() && source->Available() == 0 ?
+        AsyncStatus::kOk : AsyncStatus::kCorrupted;
+  }
+
+}  // end namespace snappy
+
+#endif  // __cpp_impl_coroutine
+
+#endif  // UTIL_SNAPPY_SNAPPY_ASYNC_H__
@@ -26,8 +26,37 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <new>
+
 #include "snappy.h"
 #include "snappy-c.h"
+#include "snappy-stubs-internal.h"
+
+namespace {
+
+// The allocator set through snappy_set_allocator() on this thread.
+SNAPPY_THREAD_LOCAL snappy_allocator thread_c_allocator;
+
+// Forwards to thread_c_allocator of the calling thread. A NULL from it
+// becomes std::bad_alloc, which the functions below turn back into
+// SNAPPY_OUT_OF_MEMORY before it can reach C code.
+class CAllocator : public snappy::Allocator {
+ public:
+  virtual void* Allocate(size_t size) {
+    void* ptr = thread_c_allocator.allocate(thread_c_allocator.opaque, size);
+    if (ptr == NULL) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+  virtual void Deallocate(void* ptr, size_t size) {
+    thread_c_allocator.deallocate(thread_c_allocator.opaque, ptr, size);
+  }
+};
+
+CAllocator c_allocator;
+
+}  // namespace
 
 extern "C" {
 
@@ -38,7 +67,11 @@ snappy_status snappy_compress(const char* input,
   if (*compressed_length < snappy_max_compressed_length(input_length)) {
     return SNAPPY_BUFFER_TOO_SMALL;
   }
-  snappy::RawCompress(input, input_length, compressed, compressed_length);
+  try {
+    snappy::RawCompress(input, input_length, compressed, compressed_length);
+  } catch (const std::bad_alloc&) {
+    return SNAPPY_OUT_OF_MEMORY;
+  }
   return SNAPPY_OK;
 }
 
@@ -55,8 +88,12 @@ snappy_status snappy_uncompress(const char* compressed,
   if (*uncompressed_length < real_uncompressed_length) {
     return SNAPPY_BUFFER_TOO_SMALL;
   }
-  if (!snappy::RawUncompress(compressed, compressed_length, uncompressed)) {
-    return SNAPPY_INVALID_INPUT;
+  try {
+    if (!snappy::RawUncompress(compressed, compressed_length, uncompressed)) {
+      return SNAPPY_INVALID_INPUT;
+    }
+  } catch (const std::bad_alloc&) {
+    return SNAPPY_OUT_OF_MEMORY;
   }
   *uncompressed_length = real_uncompressed_length;
   return SNAPPY_OK;
@@ -87,4 +124,13 @@ snappy_status snappy_validate_compressed_buffer(const char *compressed,
   }
 }
 
+void snappy_set_allocator(const snappy_allocator* allocator) {
+  if (allocator == NULL) {
+    snappy::SetAllocator(NULL);
+  } else {
+    thread_c_allocator = *allocator;
+    snappy::SetAllocator(&c_allocator);
+  }
+}
+
 }  // extern "C"
@@ -46,7 +46,8 @@ extern "C" {
 typedef enum {
   SNAPPY_OK = 0,
   SNAPPY_INVALID_INPUT = 1,
-  SNAPPY_BUFFER_TOO_SMALL = 2
+  SNAPPY_BUFFER_TOO_SMALL = 2,
+  SNAPPY_OUT_OF_MEMORY = 3
 } snappy_status;
 
 /*
@@ -57,7 +58,8 @@ typedef enum {
  * If it is not at least equal to "snappy_max_compressed_length(input_length)",
  * SNAPPY_BUFFER_TOO_SMALL is returned. After successful compression,
  * <compressed_length> contains the true length of the compressed output,
- * and SNAPPY_OK is returned.
+ * and SNAPPY_OK is returned. If the allocator set with
+ * snappy_set_allocator() returns NULL, SNAPPY_OUT_OF_MEMORY is returned.
  *
  * Example:
  *   size_t output_length = snappy_max_compressed_length(input_length);
@@ -86,6 +88,8 @@ snappy_status snappy_compress(const char* input,
  * snappy_uncompressed_length for this stream, SNAPPY_BUFFER_TOO_SMALL
  * is returned. After successful decompression, <uncompressed_length>
  * contains the true length of the decompressed output.
+ * SNAPPY_OUT_OF_MEMORY is returned if the allocator set with
+ * snappy_set_allocator() returns NULL.
  *
  * Example:
  *   size_t output_length;
@@ -131,6 +135,36 @@ snappy_status snappy_uncompressed_length(const char* compressed,
 snappy_status snappy_validate_compressed_buffer(const char* compressed,
                                                 size_t compressed_length);
 
+/*
+ * An allocator for the memory snappy uses internally (hash tables and
+ * scratch buffers). "allocate" returns "size" bytes suitably aligned for
+ * any type; "deallocate" frees "ptr", which "allocate" returned for the
+ * same "size", and is never called with NULL. Both get "opaque" as their
+ * first argument.
+ *
+ * "allocate" may return NULL, e.g. when an arena is full; the function
+ * that needed the memory then frees what it allocated and returns
+ * SNAPPY_OUT_OF_MEMORY.
+ */
+typedef struct {
+  void* (*allocate)(void* opaque, size_t size);
+  void (*deallocate)(void* opaque, void* ptr, size_t size);
+  void* opaque;
+} snappy_allocator;
+
+/*
+ * Makes the snappy functions called on the calling thread allocate through
+ * "*allocator", which is copied, or through the default allocator (operator
+ * new) if it is NULL.
+ *
+ * Example, with a per-request arena:
+ *   snappy_allocator allocator = { ArenaAlloc, ArenaFree, request_arena };
+ *   snappy_set_allocator(&allocator);
+ *   ... snappy_compress(...) ...
+ *   snappy_set_allocator(NULL);
+ */
+void snappy_set_allocator(const snappy_allocator* allocator);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
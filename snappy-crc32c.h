@@ -0,0 +1,74 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// CRC-32C (Castagnoli), the checksum used by the framing format (see
+// framing_format.txt) and by the checksumming compression and
+// decompression routines.
+
+#ifndef UTIL_SNAPPY_SNAPPY_CRC32C_H_
+#define UTIL_SNAPPY_SNAPPY_CRC32C_H_
+
+#include "snappy-stubs-internal.h"
+
+namespace snappy {
+namespace crc32c {
+
+// Returns the CRC-32C of the concatenation of A and "data[0..n-1]", where
+// "init_crc" is the CRC-32C of some string A. Extend() is often used to
+// maintain the CRC-32C of a stream of data.
+uint32 Extend(uint32 init_crc, const char* data, size_t n);
+
+// Returns the CRC-32C of "data[0..n-1]".
+inline uint32 Value(const char* data, size_t n) {
+  return Extend(0, data, n);
+}
+
+// Returns the CRC-32C of the concatenation of A and B, where "crc1" is the
+// CRC-32C of A, and "crc2" is the CRC-32C of B, which is "len2" bytes long.
+// Takes time logarithmic in "len2", without looking at the data.
+uint32 Combine(uint32 crc1, uint32 crc2, size_t len2);
+
+static const uint32 kMaskDelta = 0xa282ead8;
+
+// Returns a masked representation of "crc", as stored in the framing
+// format. Computing the CRC of a string that contains embedded CRCs is
+// problematic, so the stored values are rotated and offset.
+inline uint32 Mask(uint32 crc) {
+  return ((crc >> 15) | (crc << 17)) + kMaskDelta;
+}
+
+// Returns the CRC whose masked representation is "masked_crc".
+inline uint32 Unmask(uint32 masked_crc) {
+  uint32 rot = masked_crc - kMaskDelta;
+  return ((rot >> 17) | (rot << 15));
+}
+
+}  // end namespace crc32c
+}  // end namespace snappy
+
+#endif  // UTIL_SNAPPY_SNAPPY_CRC32C_H_
@@ -0,0 +1,393 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "snappy.h"
+#include "snappy-stubs-internal.h"
+
+namespace snappy {
+
+namespace {
+
+#ifdef HAVE_PTHREAD_H
+
+class Mutex {
+ public:
+  Mutex() { pthread_mutex_init(&mu_, NULL); }
+  ~Mutex() { pthread_mutex_destroy(&mu_); }
+  void Lock() { pthread_mutex_lock(&mu_); }
+  void Unlock() { pthread_mutex_unlock(&mu_); }
+
+ private:
+  friend class CondVar;
+  pthread_mutex_t mu_;
+
+  DISALLOW_COPY_AND_ASSIGN(Mutex);
+};
+
+class CondVar {
+ public:
+  CondVar() { pthread_cond_init(&cv_, NULL); }
+  ~CondVar() { pthread_cond_destroy(&cv_); }
+  void Wait(Mutex* mu) { pthread_cond_wait(&cv_, &mu->mu_); }
+  void Signal() { pthread_cond_signal(&cv_); }
+  void SignalAll() { pthread_cond_broadcast(&cv_); }
+
+ private:
+  pthread_cond_t cv_;
+
+  DISALLOW_COPY_AND_ASSIGN(CondVar);
+};
+
+#else  // !HAVE_PTHREAD_H
+
+// Without threads everything runs on the calling thread, so there is
+// nothing to lock and nothing is ever waited for.
+class Mutex {
+ public:
+  Mutex() { }
+  void Lock() { }
+  void Unlock() { }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(Mutex);
+};
+
+class CondVar {
+ public:
+  CondVar() { }
+  void Wait(Mutex*) { }
+  void Signal() { }
+  void SignalAll() { }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(CondVar);
+};
+
+#endif  // HAVE_PTHREAD_H
+
+class MutexLock {
+ public:
+  explicit MutexLock(Mutex* mu) : mu_(mu) { mu_->Lock(); }
+  ~MutexLock() { mu_->Unlock(); }
+
+ private:
+  Mutex* mu_;
+
+  DISALLOW_COPY_AND_ASSIGN(MutexLock);
+};
+
+// The state of one Executor::ParallelFor() call, shared by the caller and
+// the helper tasks it submits. Helpers may start after the loop is over
+// (or never, until the executor is destroyed), so it lives on the heap and
+// the last of them to let go of it deletes it.
+struct ParallelForState {
+  Mutex mu;
+  CondVar all_done;
+  Executor::Loop* loop;
+  size_t n;
+  size_t next;     // The next iteration to hand out.
+  size_t done;     // The number of iterations that have returned.
+  int refs;
+};
+
+// Runs iterations of "state->loop" until none are left to hand out.
+void RunIterations(ParallelForState* state) {
+  for (;;) {
+    size_t i;
+    {
+      MutexLock l(&state->mu);
+      if (state->next == state->n) {
+        return;
+      }
+      i = state->next++;
+    }
+    state->loop->Run(i);
+    MutexLock l(&state->mu);
+    if (++state->done == state->n) {
+      state->all_done.SignalAll();
+    }
+  }
+}
+
+void Unref(ParallelForState* state) {
+  bool last;
+  {
+    MutexLock l(&state->mu);
+    last = --state->refs == 0;
+  }
+  if (last) {
+    delete state;
+  }
+}
+
+class ParallelForHelper : public Executor::Task {
+ public:
+  explicit ParallelForHelper(ParallelForState* state) : state_(state) { }
+
+  virtual void Run() {
+    RunIterations(state_);
+    Unref(state_);
+    delete this;
+  }
+
+ private:
+  ParallelForState* state_;
+};
+
+// Helpers beyond the number of threads of the executor only find that
+// there is nothing left to do; this bounds how many are submitted for
+// long loops.
+static const size_t kMaxParallelForHelpers = 64;
+
+}  // namespace
+
+Executor::Task::~Task() { }
+
+Executor::Loop::~Loop() { }
+
+Executor::~Executor() { }
+
+void Executor::ParallelFor(size_t n, Loop* loop) {
+  if (n <= 1) {
+    if (n == 1) {
+      loop->Run(0);
+    }
+    return;
+  }
+  const size_t helpers = std::min(n - 1, kMaxParallelForHelpers);
+  ParallelForState* state = new ParallelForState;
+  state->loop = loop;
+  state->n = n;
+  state->next = 0;
+  state->done = 0;
+  state->refs = static_cast<int>(helpers) + 1;
+  for (size_t i = 0; i < helpers; ++i) {
+    Submit(new ParallelForHelper(state));
+  }
+  RunIterations(state);
+  {
+    MutexLock l(&state->mu);
+    while (state->done < state->n) {
+      state->all_done.Wait(&state->mu);
+    }
+  }
+  Unref(state);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+namespace {
+
+// The worker of a WorkStealingExecutor that is running on this thread, if
+// any, so that tasks submitted from within a task stay on the same thread.
+SNAPPY_THREAD_LOCAL void* current_worker = NULL;
+
+}  // namespace
+
+struct WorkStealingExecutor::Impl {
+  struct Worker {
+    Impl* impl;
+    size_t index;
+    pthread_t thread;
+    Mutex mu;                  // Guards "tasks".
+    std::deque<Task*> tasks;
+  };
+
+  std::vector<Worker*> workers;
+
+  Mutex mu;                    // Guards the members below.
+  CondVar work_available;
+  size_t pending;              // Tasks queued but not yet taken.
+  size_t next_worker;          // Where to queue tasks from other threads.
+  bool stopping;
+
+  static void* ThreadMain(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    worker->impl->Work(worker);
+    return NULL;
+  }
+
+  // Takes the newest task of "self", or else the oldest one of another
+  // worker. Returns NULL if all queues are empty.
+  Task* Take(Worker* self) {
+    {
+      MutexLock l(&self->mu);
+      if (!self->tasks.empty()) {
+        Task* task = self->tasks.back();
+        self->tasks.pop_back();
+        return task;
+      }
+    }
+    for (size_t i = 1; i < workers.size(); ++i) {
+      Worker* victim = workers[(self->index + i) % workers.size()];
+      MutexLock l(&victim->mu);
+      if (!victim->tasks.empty()) {
+        Task* task = victim->tasks.front();
+        victim->tasks.pop_front();
+        return task;
+      }
+    }
+    return NULL;
+  }
+
+  void Work(Worker* self) {
+    current_worker = self;
+    for (;;) {
+      Task* task = Take(self);
+      if (task != NULL) {
+        {
+          MutexLock l(&mu);
+          --pending;
+        }
+        task->Run();
+        continue;
+      }
+      // "pending" is counted before a task is queued and uncounted after
+      // it is taken, so a nonzero count with empty queues is a transient
+      // state that resolves without waiting.
+      MutexLock l(&mu);
+      while (pending == 0 && !stopping) {
+        work_available.Wait(&mu);
+      }
+      if (pending == 0) {
+        return;
+      }
+    }
+  }
+
+  void Submit(Task* task) {
+    Worker* target = static_cast<Worker*>(current_worker);
+    {
+      MutexLock l(&mu);
+      if (target == NULL || target->impl != this) {
+        target = workers[next_worker];
+        next_worker = (next_worker + 1) % workers.size();
+      }
+      ++pending;
+    }
+    {
+      MutexLock l(&target->mu);
+      target->tasks.push_back(task);
+    }
+    MutexLock l(&mu);
+    work_available.Signal();
+  }
+};
+
+WorkStealingExecutor::WorkStealingExecutor(int num_threads)
+    : impl_(new Impl) {
+  if (num_threads <= 0) {
+    const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = processors > 0 ? static_cast<int>(processors) : 1;
+  }
+  impl_->pending = 0;
+  impl_->next_worker = 0;
+  impl_->stopping = false;
+  for (int i = 0; i < num_threads; ++i) {
+    Impl::Worker* worker = new Impl::Worker;
+    worker->impl = impl_;
+    worker->index = i;
+    impl_->workers.push_back(worker);
+  }
+  // Start the threads only once "workers" is complete, since they read it.
+  for (int i = 0; i < num_threads; ++i) {
+    Impl::Worker* worker = impl_->workers[i];
+    if (pthread_create(&worker->thread, NULL, &Impl::ThreadMain,
+                       worker) != 0) {
+      // Should not happen; fail loudly rather than queueing tasks that
+      // would never run.
+      abort();
+    }
+  }
+}
+
+WorkStealingExecutor::~WorkStealingExecutor() {
+  {
+    MutexLock l(&impl_->mu);
+    impl_->stopping = true;
+    impl_->work_available.SignalAll();
+  }
+  // Threads that are still running may look into the queues of any
+  // worker, so none is freed before all have stopped.
+  for (size_t i = 0; i < impl_->workers.size(); ++i) {
+    pthread_join(impl_->workers[i]->thread, NULL);
+  }
+  for (size_t i = 0; i < impl_->workers.size(); ++i) {
+    delete impl_->workers[i];
+  }
+  delete impl_;
+}
+
+void WorkStealingExecutor::Submit(Task* task) {
+  impl_->Submit(task);
+}
+
+int WorkStealingExecutor::num_threads() const {
+  return static_cast<int>(impl_->workers.size());
+}
+
+#else  // !HAVE_PTHREAD_H
+
+struct WorkStealingExecutor::Impl {
+};
+
+WorkStealingExecutor::WorkStealingExecutor(int) : impl_(NULL) { }
+
+WorkStealingExecutor::~WorkStealingExecutor() { }
+
+void WorkStealingExecutor::Submit(Task* task) {
+  task->Run();
+}
+
+int WorkStealingExecutor::num_threads() const {
+  return 1;
+}
+
+#endif  // HAVE_PTHREAD_H
+
+Executor* DefaultExecutor() {
+  // Never deleted, so that it can be used until the very end of the
+  // program.
+  static Executor* executor = new WorkStealingExecutor(0);
+  return executor;
+}
+
+}  // namespace snappy
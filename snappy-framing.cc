@@ -0,0 +1,830 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+
+#include "snappy-framing.h"
+#include "snappy.h"
+#include "snappy-crc32c.h"
+#include "snappy-stubs-internal.h"
+
+namespace snappy {
+
+namespace {
+
+// Chunk types; see framing_format.txt.
+enum {
+  kCompressedChunk = 0x00,
+  kUncompressedChunk = 0x01,
+  kFirstUnskippableChunk = 0x02,
+  kFirstSkippableChunk = 0x80,
+  kReferenceChunk = 0x80,
+  kStreamIdentifierChunk = 0xff
+};
+
+// Each chunk starts with its type and the 24-bit length of what follows.
+static const size_t kChunkHeaderLength = 4;
+
+// Data chunks follow that with the masked CRC-32C of their data.
+static const size_t kChunkChecksumLength = 4;
+
+// A reference chunk holds the masked CRC-32C of its data, and how many
+// bytes before it the data chunk it repeats starts, as a varint.
+static const size_t kMaxReferenceLength =
+    kChunkChecksumLength + Varint::kMax32;
+
+// The distance of a reference is 32 bits, so the window is at most this.
+static const uint64 kMaxDedupWindow = kuint32max;
+
+// Content-defined chunks are at least this long. The rolling hash covers
+// the last kRollingHashWindow bytes, so it starts that much earlier.
+static const size_t kMinContentDefinedChunk = 16 << 10;
+static const size_t kRollingHashWindow = 32;
+
+// A chunk ends where the top bits of the rolling hash (which depend on the
+// whole window) are zero: after 32 KiB more on average, 64 KiB at most.
+static const uint32 kChunkEndMask = ~0u << (32 - 15);
+
+// A data chunk holds at most kBlockSize bytes of data.
+static size_t MaxDataChunkLength() {
+  return kChunkChecksumLength + MaxCompressedLength(kBlockSize);
+}
+
+inline size_t ChunkLength(const char* header) {
+  const uint8* p = reinterpret_cast<const uint8*>(header);
+  return p[1] | (p[2] << 8) | (p[3] << 16);
+}
+
+inline void EncodeChunkHeader(char* header, uint8 type, size_t length) {
+  header[0] = type;
+  header[1] = length & 0xff;
+  header[2] = (length >> 8) & 0xff;
+  header[3] = (length >> 16) & 0xff;
+}
+
+inline bool IsStreamIdentifier(const char* chunk) {
+  return memcmp(chunk, kFramedStreamIdentifier,
+                kFramedStreamIdentifierLength) == 0;
+}
+
+// The value the rolling (gear) hash adds for byte "c": its bits scrambled
+// by a few multiplications, so that every bit depends on all of "c".
+inline uint32 GearValue(uint8 c) {
+  uint32 x = (c + 1) * 0x9e3779b1u;
+  x ^= x >> 15;
+  x *= 0x85ebca77u;
+  x ^= x >> 13;
+  return x;
+}
+
+// Decodes the data "data[0,length-1]" of a data chunk of type "type",
+// which has the checksum "masked_crc", into "output" (which has room for
+// kBlockSize bytes). Returns false if the chunk is corrupted.
+static bool DecodeData(uint8 type, uint32 masked_crc,
+                       const char* data, size_t length,
+                       char* output, size_t* output_length) {
+  size_t n;
+  if (type == kCompressedChunk) {
+    if (!GetUncompressedLength(data, length, &n) || n > kBlockSize ||
+        !RawUncompress(data, length, output)) {
+      return false;
+    }
+  } else {
+    assert(type == kUncompressedChunk);
+    if (length > kBlockSize) {
+      return false;
+    }
+    n = length;
+    memcpy(output, data, n);
+  }
+  *output_length = n;
+  return crc32c::Unmask(masked_crc) == crc32c::Value(output, n);
+}
+
+// Same as DecodeData(), for the contents of a data chunk: the checksum
+// followed by the data.
+static bool DecodeDataChunk(uint8 type, const char* contents, size_t length,
+                            char* output, size_t* output_length) {
+  if (length < kChunkChecksumLength) {
+    return false;
+  }
+  return DecodeData(type, LittleEndian::Load32(contents),
+                    contents + kChunkChecksumLength,
+                    length - kChunkChecksumLength, output, output_length);
+}
+
+// Parses the contents of a reference chunk.
+static bool ParseReference(const char* contents, size_t length,
+                           uint32* masked_crc, uint32* distance) {
+  if (length <= kChunkChecksumLength || length > kMaxReferenceLength) {
+    return false;
+  }
+  *masked_crc = LittleEndian::Load32(contents);
+  return Varint::Parse32WithLimit(contents + kChunkChecksumLength,
+                                  contents + length, distance) ==
+      contents + length;
+}
+
+// Decodes the reference chunk at "framed + pos" with the contents
+// "contents[0,length-1]" into "output", from the data chunk it refers to.
+static bool DecodeReference(const char* framed, size_t pos,
+                            const char* contents, size_t length,
+                            char* output, size_t* output_length) {
+  uint32 masked_crc, distance;
+  if (!ParseReference(contents, length, &masked_crc, &distance) ||
+      distance < kChunkHeaderLength || distance > pos) {
+    return false;
+  }
+  const char* chunk = framed + pos - distance;
+  const uint8 type = chunk[0];
+  const size_t chunk_length = ChunkLength(chunk);
+  if (type >= kFirstUnskippableChunk ||
+      chunk_length > distance - kChunkHeaderLength ||
+      chunk_length < kChunkChecksumLength ||
+      LittleEndian::Load32(chunk + kChunkHeaderLength) != masked_crc) {
+    return false;
+  }
+  return DecodeDataChunk(type, chunk + kChunkHeaderLength, chunk_length,
+                         output, output_length);
+}
+
+// IsInsideDataChunk() checks at most this much data in full. A real stream
+// rarely has even one position before an identifier that passes the cheap
+// tests, but crafted data can make most of them pass.
+static const size_t kMaxInsideDataChunkWork = 4 * kBlockSize;
+
+// Returns true if "framed + offset" is inside the data of a valid data
+// chunk that starts before it, decoding into "scratch". Past
+// kMaxInsideDataChunkWork it gives up and returns true, which only costs
+// a sync point.
+static bool IsInsideDataChunk(const char* framed, size_t n, size_t offset,
+                              char* scratch) {
+  const size_t max_length = MaxDataChunkLength();
+  const size_t first = offset > kChunkHeaderLength + max_length ?
+      offset - kChunkHeaderLength - max_length : 0;
+  size_t work = 0;
+  for (size_t pos = first; pos < offset; ++pos) {
+    const uint8 type = framed[pos];
+    if (type >= kFirstUnskippableChunk || n - pos < kChunkHeaderLength) {
+      continue;
+    }
+    const size_t length = ChunkLength(framed + pos);
+    const size_t chunk_end = pos + kChunkHeaderLength + length;
+    if (length < kChunkChecksumLength || length > max_length ||
+        chunk_end <= offset || chunk_end > n) {
+      continue;
+    }
+    const char* contents = framed + pos + kChunkHeaderLength;
+    const uint32 masked_crc = LittleEndian::Load32(contents);
+    const char* data = contents + kChunkChecksumLength;
+    const size_t data_length = length - kChunkChecksumLength;
+    size_t uncompressed_length;
+    if (type == kUncompressedChunk) {
+      if (data_length > kBlockSize) {
+        continue;
+      }
+    } else if (!GetUncompressedLength(data, data_length,
+                                      &uncompressed_length) ||
+               uncompressed_length > kBlockSize) {
+      continue;
+    }
+    work += data_length;
+    if (work > kMaxInsideDataChunkWork) {
+      return true;
+    }
+    // Uncompressed data is checked where it is, without a copy.
+    if (type == kUncompressedChunk ?
+        crc32c::Unmask(masked_crc) == crc32c::Value(data, data_length) :
+        DecodeData(type, masked_crc, data, data_length, scratch,
+                   &uncompressed_length)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns true if the stream identifier at "framed + offset" starts a
+// sync point (see NextFramedSyncPoint()), decoding into "scratch".
+//
+// A framed stream may hold another one as data, with identifiers and
+// chunks that are valid in themselves. So the chunks after the identifier
+// must stay valid for longer than any data chunk, which takes the walk
+// past the end of a chunk the identifier might be stored in, and the
+// identifier must not be inside a valid data chunk that starts before it.
+static bool IsSyncPoint(const char* framed, size_t n, size_t offset,
+                        char* scratch) {
+  const size_t horizon = offset + kFramedStreamIdentifierLength +
+                         kChunkHeaderLength + MaxDataChunkLength();
+  size_t pos = offset + kFramedStreamIdentifierLength;
+  while (pos < n && pos < horizon) {
+    if (n - pos < kChunkHeaderLength) {
+      return false;
+    }
+    const uint8 type = framed[pos];
+    const size_t length = ChunkLength(framed + pos);
+    const char* contents = framed + pos + kChunkHeaderLength;
+    if (n - pos - kChunkHeaderLength < length) {
+      return false;
+    }
+    size_t unused;
+    if (type == kStreamIdentifierChunk) {
+      if (length != kFramedStreamIdentifierLength - kChunkHeaderLength ||
+          !IsStreamIdentifier(framed + pos)) {
+        return false;
+      }
+    } else if (type < kFirstUnskippableChunk) {
+      if (!DecodeDataChunk(type, contents, length, scratch, &unused)) {
+        return false;
+      }
+    } else if (type < kFirstSkippableChunk) {
+      return false;
+    } else if (type == kReferenceChunk) {
+      if (!DecodeReference(framed, pos, contents, length, scratch,
+                           &unused)) {
+        return false;
+      }
+    }
+    pos += kChunkHeaderLength + length;
+  }
+  return !IsInsideDataChunk(framed, n, offset, scratch);
+}
+
+}  // namespace
+
+namespace internal {
+
+// The data chunks of the last "window" bytes of a framed stream, kept to
+// resolve references to them, and for the writer, an index of their data.
+class ChunkHistory {
+ public:
+  struct Chunk {
+    uint64 offset;
+    uint8 type;
+    uint32 masked_crc;
+    char* data;               // Compressed or not, as in the chunk
+    size_t length;
+    size_t uncompressed_length;
+  };
+
+  ChunkHistory(Allocator* allocator, size_t window)
+      : allocator_(allocator), window_(window) { }
+
+  ~ChunkHistory() {
+    while (!chunks_.empty()) {
+      Drop();
+    }
+  }
+
+  // Forgets the chunks that start more than the window before "position".
+  void Evict(uint64 position) {
+    while (!chunks_.empty() && position - chunks_.front().offset > window_) {
+      Drop();
+    }
+  }
+
+  // Keeps the data chunk at "offset".
+  void Add(uint64 offset, uint8 type, uint32 masked_crc,
+           const char* data, size_t length, size_t uncompressed_length) {
+    assert(chunks_.empty() || offset > chunks_.back().offset);
+    Chunk chunk;
+    chunk.offset = offset;
+    chunk.type = type;
+    chunk.masked_crc = masked_crc;
+    chunk.data = static_cast<char*>(allocator_->Allocate(length + 1));
+    memcpy(chunk.data, data, length);
+    chunk.length = length;
+    chunk.uncompressed_length = uncompressed_length;
+    chunks_.push_back(chunk);
+  }
+
+  // Returns the chunk at "offset", or NULL if there is none.
+  const Chunk* Find(uint64 offset) const {
+    size_t low = 0;
+    size_t high = chunks_.size();
+    while (low < high) {
+      const size_t mid = low + (high - low) / 2;
+      if (chunks_[mid].offset < offset) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    return low < chunks_.size() && chunks_[low].offset == offset ?
+        &chunks_[low] : NULL;
+  }
+
+  // Indexes the last chunk added by its data, which has checksum "crc".
+  void Index(uint32 crc) {
+    const Chunk& chunk = chunks_.back();
+    index_[IndexKey(chunk.uncompressed_length, crc)] = chunk.offset;
+  }
+
+  // Returns a chunk that may have the "n" bytes of data with checksum
+  // "crc", or NULL.
+  const Chunk* Lookup(size_t n, uint32 crc) const {
+    std::map<uint64, uint64>::const_iterator it =
+        index_.find(IndexKey(n, crc));
+    return it == index_.end() ? NULL : Find(it->second);
+  }
+
+ private:
+  static uint64 IndexKey(size_t n, uint32 crc) {
+    return static_cast<uint64>(n) << 32 | crc;
+  }
+
+  void Drop() {
+    const Chunk& chunk = chunks_.front();
+    if (!index_.empty()) {
+      const uint32 crc = crc32c::Unmask(chunk.masked_crc);
+      std::map<uint64, uint64>::iterator it =
+          index_.find(IndexKey(chunk.uncompressed_length, crc));
+      if (it != index_.end() && it->second == chunk.offset) {
+        index_.erase(it);
+      }
+    }
+    allocator_->Deallocate(chunk.data, chunk.length + 1);
+    chunks_.pop_front();
+  }
+
+  Allocator* allocator_;
+  const uint64 window_;
+  std::deque<Chunk> chunks_;              // By offset
+  std::map<uint64, uint64> index_;        // Data length and CRC to offset
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkHistory);
+};
+
+}  // namespace internal
+
+FramingOptions::FramingOptions()
+    : sync_interval(0),
+      content_defined_chunks(false),
+      dedup_window(0) {
+}
+
+FramingSink::FramingSink(Sink* framed, size_t sync_interval)
+    : allocator_(GetAllocator()),
+      framed_(framed) {
+  options_.sync_interval = sync_interval;
+  Init();
+}
+
+FramingSink::FramingSink(Sink* framed, const FramingOptions& options)
+    : allocator_(GetAllocator()),
+      framed_(framed),
+      options_(options) {
+  Init();
+}
+
+void FramingSink::Init() {
+  options_.dedup_window = static_cast<size_t>(
+      std::min<uint64>(options_.dedup_window, kMaxDedupWindow));
+  position_ = kFramedStreamIdentifierLength;
+  last_sync_ = 0;
+  hash_ = 0;
+  buffer_ = static_cast<char*>(allocator_->Allocate(kBlockSize));
+  used_ = 0;
+  output_ = static_cast<char*>(allocator_->Allocate(
+      kChunkHeaderLength + MaxDataChunkLength()));
+  history_ = options_.dedup_window == 0 ? NULL :
+      new internal::ChunkHistory(allocator_, options_.dedup_window);
+  framed_->Append(kFramedStreamIdentifier, kFramedStreamIdentifierLength);
+}
+
+FramingSink::~FramingSink() {
+  Flush();
+  delete history_;
+  allocator_->Deallocate(buffer_, kBlockSize);
+  allocator_->Deallocate(output_, kChunkHeaderLength + MaxDataChunkLength());
+}
+
+void FramingSink::Append(const char* bytes, size_t n) {
+  bool end;
+  if (bytes == buffer_ + used_) {
+    // Written into the buffer from GetAppendBuffer(). Content-defined
+    // chunks may end before its end; the rest moves to the front.
+    assert(n <= kBlockSize - used_);
+    while (n > 0) {
+      const size_t k = FindChunkEnd(buffer_ + used_, n, used_, &end);
+      used_ += k;
+      n -= k;
+      if (end) {
+        WriteChunk(buffer_, used_);
+        memmove(buffer_, buffer_ + used_, n);
+        used_ = 0;
+      }
+    }
+    return;
+  }
+  while (n > 0) {
+    const size_t k = FindChunkEnd(bytes, n, used_, &end);
+    if (end && used_ == 0) {
+      // Chunks the caller's data directly.
+      WriteChunk(bytes, k);
+    } else {
+      memcpy(buffer_ + used_, bytes, k);
+      used_ += k;
+      if (end) {
+        WriteChunk(buffer_, used_);
+        used_ = 0;
+      }
+    }
+    bytes += k;
+    n -= k;
+  }
+}
+
+char* FramingSink::GetAppendBuffer(size_t length, char* scratch) {
+  return length <= kBlockSize - used_ ? buffer_ + used_ : scratch;
+}
+
+void FramingSink::Flush() {
+  if (used_ > 0) {
+    WriteChunk(buffer_, used_);
+    used_ = 0;
+  }
+  hash_ = 0;
+}
+
+size_t FramingSink::FindChunkEnd(const char* data, size_t n,
+                                 size_t chunk_length, bool* end) {
+  const size_t limit = std::min(n, kBlockSize - chunk_length);
+  if (options_.content_defined_chunks) {
+    // The hash only needs to cover the window before the shortest end.
+    size_t i = 0;
+    if (chunk_length < kMinContentDefinedChunk - kRollingHashWindow) {
+      i = std::min(limit, kMinContentDefinedChunk - kRollingHashWindow -
+                              chunk_length);
+    }
+    const uint8* p = reinterpret_cast<const uint8*>(data);
+    uint32 hash = hash_;
+    for (; i < limit; ++i) {
+      hash = (hash << 1) + GearValue(p[i]);
+      if (PREDICT_FALSE((hash & kChunkEndMask) == 0) &&
+          chunk_length + i + 1 >= kMinContentDefinedChunk) {
+        hash_ = 0;
+        *end = true;
+        return i + 1;
+      }
+    }
+    hash_ = hash;
+  }
+  *end = chunk_length + limit == kBlockSize;
+  if (*end) {
+    hash_ = 0;
+  }
+  return limit;
+}
+
+void FramingSink::WriteChunk(const char* data, size_t n) {
+  if (options_.sync_interval > 0 &&
+      position_ - last_sync_ >= options_.sync_interval) {
+    framed_->Append(kFramedStreamIdentifier, kFramedStreamIdentifierLength);
+    last_sync_ = position_;
+    position_ += kFramedStreamIdentifierLength;
+  }
+
+  // The chunk goes to output_ after its header and checksum.
+  char* const header = output_;
+  char* const contents = output_ + kChunkHeaderLength;
+  char* const compressed_data = contents + kChunkChecksumLength;
+  size_t compressed_length;
+  uint32 crc;
+  if (history_ != NULL) {
+    crc = crc32c::Value(data, n);
+    history_->Evict(position_);
+    const internal::ChunkHistory::Chunk* chunk = history_->Lookup(n, crc);
+    if (chunk != NULL) {
+      // Checks that the data is really the same, decoding into output_.
+      bool same;
+      if (chunk->type == kCompressedChunk) {
+        same = RawUncompress(chunk->data, chunk->length, output_) &&
+            memcmp(output_, data, n) == 0;
+      } else {
+        same = memcmp(chunk->data, data, n) == 0;
+      }
+      if (same) {
+        LittleEndian::Store32(contents, crc32c::Mask(crc));
+        const char* end = Varint::Encode32(
+            contents + kChunkChecksumLength,
+            static_cast<uint32>(position_ - chunk->offset));
+        const size_t length = end - contents;
+        EncodeChunkHeader(header, kReferenceChunk, length);
+        framed_->Append(header, kChunkHeaderLength + length);
+        position_ += kChunkHeaderLength + length;
+        return;
+      }
+    }
+    RawCompress(data, n, compressed_data, &compressed_length);
+  } else {
+    RawCompressAndChecksum(data, n, compressed_data, &compressed_length,
+                           NULL, &crc);
+  }
+
+  const bool compressed = compressed_length < n - n / 8;
+  const uint8 type = compressed ? kCompressedChunk : kUncompressedChunk;
+  const size_t data_length = compressed ? compressed_length : n;
+  const size_t length = kChunkChecksumLength + data_length;
+  EncodeChunkHeader(header, type, length);
+  LittleEndian::Store32(contents, crc32c::Mask(crc));
+  if (compressed) {
+    framed_->Append(header, kChunkHeaderLength + length);
+  } else {
+    framed_->Append(header, kChunkHeaderLength + kChunkChecksumLength);
+    framed_->Append(data, n);
+  }
+  if (history_ != NULL) {
+    history_->Add(position_, type, crc32c::Mask(crc),
+                  compressed ? compressed_data : data, data_length, n);
+    history_->Index(crc);
+  }
+  position_ += kChunkHeaderLength + length;
+}
+
+FramedSource::FramedSource(Source* framed, size_t dedup_window)
+    : allocator_(GetAllocator()),
+      framed_(framed),
+      position_(0),
+      chunk_(NULL),
+      buffer_(static_cast<char*>(allocator_->Allocate(kBlockSize))),
+      start_(buffer_),
+      available_(0),
+      ok_(true),
+      history_(dedup_window == 0 ? NULL :
+               new internal::ChunkHistory(allocator_, dedup_window)) {
+  char identifier[kFramedStreamIdentifierLength];
+  if (framed_->Available() < sizeof(identifier)) {
+    ok_ = false;
+    return;
+  }
+  Read(identifier, sizeof(identifier));
+  if (!IsStreamIdentifier(identifier)) {
+    ok_ = false;
+    return;
+  }
+  NextChunk();
+}
+
+FramedSource::~FramedSource() {
+  delete history_;
+  if (chunk_ != NULL) {
+    allocator_->Deallocate(chunk_, MaxDataChunkLength());
+  }
+  allocator_->Deallocate(buffer_, kBlockSize);
+}
+
+size_t FramedSource::Available() const {
+  return available_;
+}
+
+const char* FramedSource::Peek(size_t* len) {
+  *len = available_;
+  return start_;
+}
+
+void FramedSource::Skip(size_t n) {
+  assert(n <= available_);
+  start_ += n;
+  available_ -= n;
+  if (available_ == 0) {
+    NextChunk();
+  }
+}
+
+void FramedSource::Read(char* dest, size_t n) {
+  position_ += n;
+  while (n > 0) {
+    size_t fragment_size;
+    const char* fragment = framed_->Peek(&fragment_size);
+    const size_t to_copy = std::min(fragment_size, n);
+    if (dest != NULL) {
+      memcpy(dest, fragment, to_copy);
+      dest += to_copy;
+    }
+    framed_->Skip(to_copy);
+    n -= to_copy;
+  }
+}
+
+void FramedSource::NextChunk() {
+  available_ = 0;
+  for (;;) {
+    if (framed_->Available() == 0) {
+      return;  // The end of the stream
+    }
+    const uint64 chunk_offset = position_;
+    char header[kChunkHeaderLength];
+    if (framed_->Available() < sizeof(header)) {
+      break;
+    }
+    Read(header, sizeof(header));
+    const uint8 type = header[0];
+    const size_t length = ChunkLength(header);
+    if (length > framed_->Available() ||
+        (type >= kFirstUnskippableChunk && type < kFirstSkippableChunk)) {
+      break;
+    }
+
+    if (type == kStreamIdentifierChunk) {
+      char identifier[kFramedStreamIdentifierLength];
+      if (length != sizeof(identifier) - kChunkHeaderLength) {
+        break;
+      }
+      memcpy(identifier, header, kChunkHeaderLength);
+      Read(identifier + kChunkHeaderLength, length);
+      if (!IsStreamIdentifier(identifier)) {
+        break;
+      }
+      continue;
+    }
+
+    size_t decoded;
+    if (type == kReferenceChunk) {
+      // Decodes the chunk referred to again.
+      char contents[kMaxReferenceLength];
+      uint32 masked_crc, distance;
+      if (history_ == NULL || length > sizeof(contents)) {
+        break;
+      }
+      Read(contents, length);
+      if (!ParseReference(contents, length, &masked_crc, &distance) ||
+          distance == 0 || distance > chunk_offset) {
+        break;
+      }
+      history_->Evict(chunk_offset);
+      const internal::ChunkHistory::Chunk* chunk =
+          history_->Find(chunk_offset - distance);
+      if (chunk == NULL || chunk->masked_crc != masked_crc ||
+          !DecodeData(chunk->type, chunk->masked_crc, chunk->data,
+                      chunk->length, buffer_, &decoded)) {
+        break;
+      }
+    } else if (type >= kFirstSkippableChunk) {
+      Read(NULL, length);
+      continue;
+    } else {
+      // A data chunk: decodes it from the source if it is contiguous
+      // there, or from a copy otherwise.
+      if (length > MaxDataChunkLength()) {
+        break;
+      }
+      size_t fragment_size;
+      const char* contents = framed_->Peek(&fragment_size);
+      if (fragment_size < length) {
+        if (chunk_ == NULL) {
+          chunk_ = static_cast<char*>(
+              allocator_->Allocate(MaxDataChunkLength()));
+        }
+        Read(chunk_, length);
+        contents = chunk_;
+      }
+      const bool decoded_ok =
+          DecodeDataChunk(type, contents, length, buffer_, &decoded);
+      if (decoded_ok && history_ != NULL) {
+        history_->Evict(chunk_offset);
+        history_->Add(chunk_offset, type, LittleEndian::Load32(contents),
+                      contents + kChunkChecksumLength,
+                      length - kChunkChecksumLength, decoded);
+      }
+      if (contents != chunk_) {
+        framed_->Skip(length);
+        position_ += length;
+      }
+      if (!decoded_ok) {
+        break;
+      }
+    }
+    if (decoded > 0) {
+      start_ = buffer_;
+      available_ = decoded;
+      return;
+    }
+  }
+  ok_ = false;
+}
+
+size_t NextFramedSyncPoint(const char* framed, size_t n, size_t offset) {
+  char* scratch = NULL;
+  Allocator* allocator = GetAllocator();
+  size_t result = n;
+  while (offset < n && n - offset >= kFramedStreamIdentifierLength) {
+    const void* found = memchr(framed + offset, kFramedStreamIdentifier[0],
+                               n - offset - kFramedStreamIdentifierLength + 1);
+    if (found == NULL) {
+      break;
+    }
+    offset = static_cast<const char*>(found) - framed;
+    if (IsStreamIdentifier(framed + offset)) {
+      if (scratch == NULL) {
+        scratch = static_cast<char*>(allocator->Allocate(kBlockSize));
+      }
+      if (IsSyncPoint(framed, n, offset, scratch)) {
+        result = offset;
+        break;
+      }
+    }
+    ++offset;
+  }
+  if (scratch != NULL) {
+    allocator->Deallocate(scratch, kBlockSize);
+  }
+  return result;
+}
+
+bool UncompressFramedSplit(const char* framed, size_t n,
+                           size_t begin, size_t end, Sink* uncompressed) {
+  const size_t start = NextFramedSyncPoint(framed, n, begin);
+  if (begin == 0 && start != 0 && n > 0) {
+    // The stream itself must start with a (valid) identifier.
+    return false;
+  }
+  if (start >= end || start >= n) {
+    return true;
+  }
+
+  Allocator* allocator = GetAllocator();
+  char* output = static_cast<char*>(allocator->Allocate(kBlockSize));
+  bool ok = true;
+  size_t pos = start;
+  while (pos < n) {
+    if (n - pos < kChunkHeaderLength) {
+      ok = false;
+      break;
+    }
+    const uint8 type = framed[pos];
+    const size_t length = ChunkLength(framed + pos);
+    const char* contents = framed + pos + kChunkHeaderLength;
+    if (n - pos - kChunkHeaderLength < length) {
+      ok = false;
+      break;
+    }
+    if (type == kStreamIdentifierChunk) {
+      if (length != kFramedStreamIdentifierLength - kChunkHeaderLength ||
+          !IsStreamIdentifier(framed + pos)) {
+        ok = false;
+        break;
+      }
+      // The range ends at the first identifier at or after "end" that the
+      // next range will start from. One that fails verification is not a
+      // sync point, so we go on, and report the corruption that follows.
+      if (pos >= end && IsSyncPoint(framed, n, pos, output)) {
+        break;
+      }
+    } else if (type < kFirstUnskippableChunk) {
+      size_t decoded;
+      if (!DecodeDataChunk(type, contents, length, output, &decoded)) {
+        ok = false;
+        break;
+      }
+      uncompressed->Append(output, decoded);
+    } else if (type < kFirstSkippableChunk) {
+      ok = false;
+      break;
+    } else if (type == kReferenceChunk) {
+      size_t decoded;
+      if (!DecodeReference(framed, pos, contents, length, output, &decoded)) {
+        ok = false;
+        break;
+      }
+      uncompressed->Append(output, decoded);
+    }
+    pos += kChunkHeaderLength + length;
+  }
+  allocator->Deallocate(output, kBlockSize);
+  return ok;
+}
+
+}  // namespace snappy
@@ -0,0 +1,205 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The framing format (see framing_format.txt): a stream of chunks of at
+// most 64 KiB of data each, compressed independently and checksummed, for
+// files and streams that are too large to hold in memory.
+//
+// A framed stream starts with a stream identifier chunk, which may come
+// again anywhere between chunks. A FramingSink can repeat it at regular
+// intervals as a sync marker, which makes the stream splittable: a reader
+// given an arbitrary byte range can find the next marker and decode from
+// there (see NextFramedSyncPoint() and UncompressFramedSplit()).
+//
+// A FramingSink can also cut chunks where the content says so, rather
+// than every 64 KiB, so that data that reappears at another offset is cut
+// the same way, and write a chunk that repeats an earlier one as a small
+// reference to it. References use skippable chunk type 0x80, so they need
+// a reader from this file: any other reader skips them as the format says
+// it must, and silently returns the stream without the data they stand
+// for, with no error. Only turn deduplication on for streams that are
+// read with FramedSource or UncompressFramedSplit().
+
+#ifndef UTIL_SNAPPY_SNAPPY_FRAMING_H_
+#define UTIL_SNAPPY_SNAPPY_FRAMING_H_
+
+#include <stddef.h>
+
+#include "snappy-sinksource.h"
+#include "snappy-stubs-public.h"
+
+namespace snappy {
+
+class Allocator;
+namespace internal {
+  class ChunkHistory;
+}
+
+// The stream identifier chunk, with which every framed stream starts.
+static const char kFramedStreamIdentifier[] = "\xff\x06\x00\x00sNaPpY";
+static const size_t kFramedStreamIdentifierLength = 10;
+
+// Settings of a FramingSink.
+struct FramingOptions {
+  // No sync markers, fixed-size chunks, no deduplication.
+  FramingOptions();
+
+  // If nonzero, the stream identifier is written again before the first
+  // chunk that starts at least "sync_interval" bytes of output after the
+  // previous one, for readers that start in the middle.
+  size_t sync_interval;
+
+  // If true, chunks end where a rolling hash of the last 32 bytes says so
+  // (after 16 KiB at least, about 40 KiB on average, and 64 KiB at most),
+  // so an insertion or deletion changes only the chunks around it.
+  bool content_defined_chunks;
+
+  // If nonzero, a chunk whose data equals that of a chunk that started at
+  // most "dedup_window" bytes of output before it is written as a
+  // reference to that chunk, without compressing it again. Both writer and
+  // reader keep the chunks of the window in memory. References store the
+  // distance in 32 bits, so windows over 4 GiB - 1 are taken as that. See
+  // the top of this file for what other readers make of references.
+  size_t dedup_window;
+};
+
+// A Sink that writes what is appended to it to "*framed" as a framed
+// stream. Data is compressed in chunks of 64 KiB, or stored uncompressed
+// where that does not save at least 1/8. Call Flush() to write out a
+// partial chunk; the destructor does too. "*framed" must outlive this
+// object.
+class FramingSink : public Sink {
+ public:
+  // Writes sync markers every "sync_interval" bytes (see FramingOptions).
+  explicit FramingSink(Sink* framed, size_t sync_interval = 0);
+  FramingSink(Sink* framed, const FramingOptions& options);
+  virtual ~FramingSink();
+
+  virtual void Append(const char* bytes, size_t n);
+  virtual char* GetAppendBuffer(size_t length, char* scratch);
+
+  // Writes out the data appended so far as a (short) chunk.
+  void Flush();
+
+ private:
+  void Init();
+
+  // Returns how many of the "n" bytes at "data" belong to the chunk that
+  // already has "chunk_length" bytes, and whether the chunk ends there.
+  size_t FindChunkEnd(const char* data, size_t n, size_t chunk_length,
+                      bool* end);
+
+  // Writes "data[0,n-1]" (at most 64 KiB) as one chunk.
+  void WriteChunk(const char* data, size_t n);
+
+  Allocator* allocator_;
+  Sink* framed_;
+  FramingOptions options_;
+  uint64 position_;     // Bytes written so far
+  uint64 last_sync_;    // Where the last stream identifier was written
+  uint32 hash_;         // Rolling hash of the current chunk's last bytes
+  char* buffer_;        // Data for the next chunk
+  size_t used_;         // Bytes in buffer_
+  char* output_;        // The chunk being written
+  internal::ChunkHistory* history_;   // For deduplication, or NULL
+
+  FramingSink(const FramingSink&);
+  void operator=(const FramingSink&);
+};
+
+// A Source that yields the data of the framed stream in "*framed",
+// decoding a chunk at a time, and checking its checksum. The stream must
+// start with a stream identifier; other than that, repeated identifiers,
+// padding and reserved skippable chunks are skipped.
+//
+// If the stream turns out to be corrupted, this source ends early and ok()
+// returns false. Like for CompressingSource, Available() counts only the
+// data of the current chunk; it is nonzero until all data was read.
+// "*framed" must outlive this object.
+//
+// To resolve references, "dedup_window" must be at least the one the
+// stream was written with; references beyond it count as corruption.
+class FramedSource : public Source {
+ public:
+  explicit FramedSource(Source* framed, size_t dedup_window = 0);
+  virtual ~FramedSource();
+
+  virtual size_t Available() const;
+  virtual const char* Peek(size_t* len);
+  virtual void Skip(size_t n);
+
+  // Returns false if corrupted data was found so far.
+  bool ok() const { return ok_; }
+
+ private:
+  // Decodes chunks until one with data, or the end of the stream.
+  void NextChunk();
+
+  // Reads "n" bytes from "*framed_" into "dest"; they must be available.
+  void Read(char* dest, size_t n);
+
+  Allocator* allocator_;
+  Source* framed_;
+  uint64 position_;     // Bytes of "*framed_" read so far
+  char* chunk_;         // A chunk that was not contiguous in "*framed_"
+  char* buffer_;        // The data of the current chunk
+  const char* start_;   // The unread data of the current chunk
+  size_t available_;
+  bool ok_;
+  internal::ChunkHistory* history_;   // For resolving references, or NULL
+
+  FramedSource(const FramedSource&);
+  void operator=(const FramedSource&);
+};
+
+// Returns the offset of the first sync point at or after "offset" in the
+// framed stream (or part of one) in "framed[0,n-1]", or "n" if there is
+// none. A sync point is a stream identifier that is followed by valid
+// chunks for longer than any data chunk (or up to the end of "framed"),
+// and is not inside the data of a valid data chunk before it. This tells
+// identifiers apart from data that happens to look like one, including a
+// framed stream stored in this one, whose chunks are valid in themselves,
+// as long as the chunks around them are intact. Data stored in skippable
+// chunks is not checked this way. UncompressFramedSplit() applies the same
+// test at the end of a range as at its start.
+size_t NextFramedSyncPoint(const char* framed, size_t n, size_t offset);
+
+// Decodes the part of the framed stream "framed[0,n-1]" assigned to the
+// byte range ["begin", "end"), and appends it to "*uncompressed": the
+// chunks from the first sync point at or after "begin" up to the first
+// stream identifier at or after "end". The parts of adjacent ranges join
+// up, so readers that split a stream into ranges decode all of it exactly
+// once between them, provided it was written with sync markers. References
+// are resolved anywhere in "framed". Returns false if the data is
+// corrupted.
+bool UncompressFramedSplit(const char* framed, size_t n,
+                           size_t begin, size_t end, Sink* uncompressed);
+
+}  // namespace snappy
+
+#endif  // UTIL_SNAPPY_SNAPPY_FRAMING_H_
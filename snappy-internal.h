@@ -34,12 +34,15 @@
 #include "snappy-stubs-internal.h"
 
 namespace snappy {
+
+class Allocator;
+
 namespace internal {
 
 class WorkingMemory {
  public:
-  WorkingMemory() : large_table_(NULL) { }
-  ~WorkingMemory() { delete[] large_table_; }
+  WorkingMemory();
+  ~WorkingMemory();
 
   // Allocates and clears a hash table using memory in "*this",
   // stores the number of buckets in "*table_size" and returns a pointer to
@@ -49,6 +52,7 @@ class WorkingMemory {
  private:
   uint16 small_table_[1<<10];    // 2KB
   uint16* large_table_;          // Allocated only when needed
+  Allocator* allocator_;         // For large_table_
 
   DISALLOW_COPY_AND_ASSIGN(WorkingMemory);
 };
@@ -26,8 +26,26 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <string.h>
 
+#ifdef HAVE_UNISTD_H
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <new>
+#endif
+
+#include <algorithm>
+
 #include "snappy-sinksource.h"
 
 namespace snappy {
@@ -68,4 +86,326 @@ char* UncheckedByteArraySink::GetAppendBuffer(size_t len, char* scratch) {
   return dest_;
 }
 
+CheckedByteArraySink::~CheckedByteArraySink() { }
+
+void CheckedByteArraySink::Append(const char* data, size_t n) {
+  if (n > static_cast<size_t>(limit_ - dest_)) {
+    n = limit_ - dest_;
+    overflowed_ = true;
+  }
+  // Do no copying if the caller filled in the result of GetAppendBuffer()
+  if (data != dest_) {
+    memcpy(dest_, data, n);
+  }
+  dest_ += n;
+}
+
+char* CheckedByteArraySink::GetAppendBuffer(size_t len, char* scratch) {
+  return len <= static_cast<size_t>(limit_ - dest_) ? dest_ : scratch;
+}
+
+StringSink::~StringSink() {
+  dest_->resize(size_);
+}
+
+void StringSink::Reserve(size_t n) {
+  if (dest_->size() - size_ < n) {
+    // Grow geometrically, so each byte is moved a constant number of times
+    // on average.
+    const size_t new_size = std::max(size_ + n, 2 * dest_->size());
+#ifdef __cpp_lib_string_resize_and_overwrite
+    // Leave the new space uninitialized; it is written before it is read,
+    // and what is not is trimmed by the destructor.
+    dest_->resize_and_overwrite(new_size, [](char*, size_t m) { return m; });
+#else
+    dest_->resize(new_size);
+#endif
+  }
+}
+
+void StringSink::Append(const char* data, size_t n) {
+  Reserve(n);
+  char* dest = &(*dest_)[size_];
+  // Do no copying if the caller filled in the result of GetAppendBuffer()
+  if (data != dest) {
+    memcpy(dest, data, n);
+  }
+  size_ += n;
+}
+
+char* StringSink::GetAppendBuffer(size_t len, char* /* scratch */) {
+  Reserve(len);
+  return &(*dest_)[size_];
+}
+
+#ifdef HAVE_UNISTD_H
+
+namespace {
+
+// Allocates a buffer aligned as "options" ask, and stores its size, rounded
+// up to a multiple of the alignment, in "*capacity".
+char* AllocateBuffer(const FileOptions& options, size_t* capacity) {
+  const size_t alignment = std::max(options.alignment, sizeof(void*));
+  size_t size = (options.buffer_size + alignment - 1) & ~(alignment - 1);
+  if (size == 0) {
+    size = alignment;
+  }
+  void* buffer;
+  if (posix_memalign(&buffer, alignment, size) != 0) {
+    throw std::bad_alloc();
+  }
+  *capacity = size;
+  return static_cast<char*>(buffer);
+}
+
+// Turns on O_DIRECT for "fd" if "options" ask for it and the file offset
+// is aligned. Returns the flags to restore afterwards, or -1.
+int EnableDirect(int fd, const FileOptions& options) {
+#ifdef O_DIRECT
+  if (!options.direct) {
+    return -1;
+  }
+  const off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (offset < 0 || offset % options.alignment != 0) {
+    return -1;
+  }
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0) {
+    return -1;
+  }
+  return flags;
+#else
+  return -1;
+#endif
+}
+
+void RestoreFlags(int fd, int* saved_flags) {
+  if (*saved_flags >= 0) {
+    fcntl(fd, F_SETFL, *saved_flags);
+    *saved_flags = -1;
+  }
+}
+
+}  // namespace
+
+FileSource::FileSource(int fd, const FileOptions& options) : fd_(fd) {
+  struct stat st;
+  off_t offset = -1;
+  int error = 0;
+  if (fstat(fd, &st) != 0 || (S_ISREG(st.st_mode) &&
+                              (offset = lseek(fd, 0, SEEK_CUR)) < 0)) {
+    error = errno;
+  } else if (!S_ISREG(st.st_mode)) {
+    // The length is not known; use the other constructor.
+    error = EINVAL;
+  }
+  Init(error == 0 && offset < st.st_size ? st.st_size - offset : 0, options);
+  error_ = error;
+}
+
+FileSource::FileSource(int fd, size_t length, const FileOptions& options)
+    : fd_(fd) {
+  Init(length, options);
+}
+
+void FileSource::Init(size_t length, const FileOptions& options) {
+  buffer_ = AllocateBuffer(options, &capacity_);
+  start_ = 0;
+  end_ = 0;
+  remaining_ = length;
+  error_ = 0;
+  saved_flags_ = length > 0 ? EnableDirect(fd_, options) : -1;
+}
+
+FileSource::~FileSource() {
+  RestoreFlags(fd_, &saved_flags_);
+  free(buffer_);
+}
+
+size_t FileSource::Available() const {
+  return (end_ - start_) + remaining_;
+}
+
+const char* FileSource::Peek(size_t* len) {
+  if (start_ == end_ && remaining_ > 0) {
+    Refill();
+  }
+  *len = end_ - start_;
+  return buffer_ + start_;
+}
+
+void FileSource::Skip(size_t n) {
+  for (;;) {
+    const size_t len = std::min(n, end_ - start_);
+    start_ += len;
+    n -= len;
+    if (n == 0 || remaining_ == 0) {
+      break;
+    }
+    Refill();
+  }
+}
+
+void FileSource::Refill() {
+  start_ = end_ = 0;
+  for (;;) {
+    // Direct reads must fill whole blocks, which the buffer size is a
+    // multiple of. Otherwise do not read past the end, as a socket may
+    // carry more data after it. There is a single buffer to fill, so
+    // unlike in FileSink, there is nothing for readv() to batch.
+    const size_t request = saved_flags_ >= 0 ? capacity_
+                                             : std::min(capacity_, remaining_);
+    const ssize_t n = read(fd_, buffer_, request);
+    if (n > 0) {
+      end_ = std::min(static_cast<size_t>(n), remaining_);
+      remaining_ -= end_;
+      return;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EINVAL && saved_flags_ >= 0) {
+      // The file system does not support O_DIRECT after all.
+      RestoreFlags(fd_, &saved_flags_);
+      continue;
+    }
+    error_ = n < 0 ? errno : EIO;
+    remaining_ = 0;
+    return;
+  }
+}
+
+FileSink::FileSink(int fd, const FileOptions& options)
+    : fd_(fd), socket_(false) {
+  Init(options);
+}
+
+FileSink::FileSink(int fd, const FileOptions& options, bool socket)
+    : fd_(fd), socket_(socket) {
+  Init(options);
+}
+
+void FileSink::Init(const FileOptions& options) {
+  buffer_ = AllocateBuffer(options, &capacity_);
+  used_ = 0;
+  error_ = 0;
+  saved_flags_ = socket_ ? -1 : EnableDirect(fd_, options);
+}
+
+FileSink::~FileSink() {
+  Flush();
+  RestoreFlags(fd_, &saved_flags_);
+  free(buffer_);
+}
+
+void FileSink::Append(const char* bytes, size_t n) {
+  if (bytes == buffer_ + used_) {
+    // Filled in through GetAppendBuffer().
+    used_ += n;
+  } else if (n <= capacity_ - used_) {
+    memcpy(buffer_ + used_, bytes, n);
+    used_ += n;
+  } else if (saved_flags_ >= 0) {
+    // Direct writes must be whole blocks, so go through the buffer.
+    while (n > 0) {
+      const size_t len = std::min(n, capacity_ - used_);
+      memcpy(buffer_ + used_, bytes, len);
+      used_ += len;
+      bytes += len;
+      n -= len;
+      if (used_ == capacity_) {
+        Write(buffer_, used_, NULL, 0);
+        used_ = 0;
+      }
+    }
+    return;
+  } else {
+    // Write the buffered data and "bytes" with one system call, without
+    // copying "bytes".
+    Write(buffer_, used_, bytes, n);
+    used_ = 0;
+    return;
+  }
+  if (used_ == capacity_) {
+    Write(buffer_, used_, NULL, 0);
+    used_ = 0;
+  }
+}
+
+char* FileSink::GetAppendBuffer(size_t length, char* scratch) {
+  // If it does not fit, Append() writes the scratch buffer out along with
+  // the buffered data.
+  return length <= capacity_ - used_ ? buffer_ + used_ : scratch;
+}
+
+bool FileSink::Flush() {
+  if (used_ > 0) {
+    // A partial block cannot be written directly; this is normally the end
+    // of the output anyway.
+    RestoreFlags(fd_, &saved_flags_);
+    Write(buffer_, used_, NULL, 0);
+    used_ = 0;
+  }
+  return error_ == 0;
+}
+
+void FileSink::Write(const char* bytes1, size_t n1,
+                     const char* bytes2, size_t n2) {
+  // The system's iovec; snappy-stubs-public.h may define its own.
+  struct ::iovec iov[2];
+  int iovcnt = 0;
+  if (n1 > 0) {
+    iov[iovcnt].iov_base = const_cast<char*>(bytes1);
+    iov[iovcnt].iov_len = n1;
+    ++iovcnt;
+  }
+  if (n2 > 0) {
+    iov[iovcnt].iov_base = const_cast<char*>(bytes2);
+    iov[iovcnt].iov_len = n2;
+    ++iovcnt;
+  }
+  struct ::iovec* next = iov;
+  while (iovcnt > 0 && error_ == 0) {
+    ssize_t written;
+    if (socket_) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = next;
+      msg.msg_iovlen = iovcnt;
+#ifdef MSG_NOSIGNAL
+      written = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+#else
+      written = sendmsg(fd_, &msg, 0);
+#endif
+    } else {
+      written = writev(fd_, next, iovcnt);
+    }
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EINVAL && saved_flags_ >= 0) {
+        // The file system does not support O_DIRECT after all.
+        RestoreFlags(fd_, &saved_flags_);
+        continue;
+      }
+      error_ = errno;
+      break;
+    }
+    // Resume after a partial write.
+    size_t done = written;
+    while (iovcnt > 0 && done >= next->iov_len) {
+      done -= next->iov_len;
+      ++next;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      next->iov_base = static_cast<char*>(next->iov_base) + done;
+      next->iov_len -= done;
+    }
+  }
+}
+
+#endif  // HAVE_UNISTD_H
+
 }
@@ -30,6 +30,7 @@
 #define UTIL_SNAPPY_SNAPPY_SINKSOURCE_H_
 
 #include <stddef.h>
+#include <string>
 
 
 namespace snappy {
@@ -131,6 +132,170 @@ class UncheckedByteArraySink : public Sink {
   char* dest_;
 };
 
+// A Sink implementation that writes to a flat array of "capacity" bytes.
+// Data that does not fit is dropped, and overflowed() becomes true.
+class CheckedByteArraySink : public Sink {
+ public:
+  CheckedByteArraySink(char* dest, size_t capacity)
+      : start_(dest), dest_(dest), limit_(dest + capacity),
+        overflowed_(false) { }
+  virtual ~CheckedByteArraySink();
+  virtual void Append(const char* data, size_t n);
+  virtual char* GetAppendBuffer(size_t len, char* scratch);
+
+  // Returns the number of bytes written to the array.
+  size_t NumberOfBytesWritten() const { return dest_ - start_; }
+
+  // Returns true if any data had to be dropped.
+  bool overflowed() const { return overflowed_; }
+ private:
+  char* start_;
+  char* dest_;
+  char* limit_;
+  bool overflowed_;
+};
+
+// A Sink implementation that appends to a string. GetAppendBuffer()
+// returns space inside the string, which grows geometrically, so
+// compressing into it needs neither a worst-case allocation up front nor
+// a copy per block.
+//
+// While the sink is in use the string extends past what was appended,
+// with unspecified contents, so it must not be read or modified until the
+// sink is destroyed; that trims it to the appended data. The new space is
+// left uninitialized where std::string::resize_and_overwrite() is
+// available (C++23), and zero-filled otherwise, which adds up to a memset
+// of at most twice the output over the life of the sink.
+class StringSink : public Sink {
+ public:
+  explicit StringSink(std::string* dest) : dest_(dest), size_(dest->size()) { }
+  virtual ~StringSink();
+  virtual void Append(const char* data, size_t n);
+  virtual char* GetAppendBuffer(size_t len, char* scratch);
+ private:
+  // Makes room for "n" more bytes after the appended data.
+  void Reserve(size_t n);
+
+  std::string* dest_;
+  size_t size_;  // Length of the appended data in *dest_
+};
+
+
+// Buffering options for FileSource and FileSink.
+struct FileOptions {
+  FileOptions() : buffer_size(1 << 20), alignment(4096), direct(false) { }
+
+  // Size of the buffer; rounded up to a multiple of "alignment". Large
+  // buffers keep the number of system calls down.
+  size_t buffer_size;
+
+  // Alignment of the buffer, a power of two. For "direct" it must be a
+  // multiple of the logical block size of the device.
+  size_t alignment;
+
+  // Bypass the page cache with O_DIRECT, if the system and file system
+  // support it and the file offset is aligned; otherwise ignored. Bulk
+  // reads and writes of data that will not be read again soon then do not
+  // evict anything else from the cache.
+  bool direct;
+};
+
+// A Source that reads from a file descriptor through a large aligned
+// buffer. Read errors and unexpected ends of input end the source early,
+// after which error() is nonzero and Available() may have promised more
+// data than it yields. The descriptor is not closed.
+class FileSource : public Source {
+ public:
+  // Reads the file "fd" from its current offset to its end.
+  explicit FileSource(int fd, const FileOptions& options = FileOptions());
+
+  // Reads the next "length" bytes of "fd", which may also be a pipe or a
+  // socket. With "direct", the file offset may end up past them.
+  FileSource(int fd, size_t length,
+             const FileOptions& options = FileOptions());
+
+  virtual ~FileSource();
+  virtual size_t Available() const;
+  virtual const char* Peek(size_t* len);
+  virtual void Skip(size_t n);
+
+  // Returns 0, or the errno value of the failed read (EIO if the input
+  // ended early).
+  int error() const { return error_; }
+
+ private:
+  void Init(size_t length, const FileOptions& options);
+  void Refill();
+
+  int fd_;
+  int saved_flags_;    // Flags of fd_ to restore, or -1
+  char* buffer_;
+  size_t capacity_;
+  size_t start_;       // Start of the unread data in buffer_
+  size_t end_;         // End of the data in buffer_
+  size_t remaining_;   // Bytes not read into buffer_ yet
+  int error_;
+
+  FileSource(const FileSource&);
+  void operator=(const FileSource&);
+};
+
+// A Sink that writes to a file descriptor through a large aligned buffer.
+// GetAppendBuffer() returns space in the buffer, and appends that do not
+// fit are written together with the buffered data in one writev(). Call
+// Flush() to find out whether everything was written; the destructor
+// flushes too, but cannot report errors. The descriptor is not closed.
+class FileSink : public Sink {
+ public:
+  explicit FileSink(int fd, const FileOptions& options = FileOptions());
+  virtual ~FileSink();
+  virtual void Append(const char* bytes, size_t n);
+  virtual char* GetAppendBuffer(size_t length, char* scratch);
+
+  // Writes out the buffered data. Returns false if this or an earlier
+  // write failed, in which case data was lost.
+  bool Flush();
+
+  // Returns 0, or the errno value of the first failed write. Later data is
+  // dropped.
+  int error() const { return error_; }
+
+ protected:
+  // For SocketSink.
+  FileSink(int fd, const FileOptions& options, bool socket);
+
+ private:
+  void Init(const FileOptions& options);
+  void Write(const char* bytes1, size_t n1, const char* bytes2, size_t n2);
+
+  int fd_;
+  bool socket_;        // Use sendmsg() rather than writev()
+  int saved_flags_;    // Flags of fd_ to restore, or -1
+  char* buffer_;
+  size_t capacity_;
+  size_t used_;        // Bytes in buffer_
+  int error_;
+
+  FileSink(const FileSink&);
+  void operator=(const FileSink&);
+};
+
+// A FileSource for a connected stream socket, reading the next "length"
+// bytes from it.
+class SocketSource : public FileSource {
+ public:
+  SocketSource(int fd, size_t length,
+               const FileOptions& options = FileOptions())
+      : FileSource(fd, length, options) { }
+};
+
+// A FileSink for a connected stream socket. A peer that went away shows up
+// as error() EPIPE, without raising SIGPIPE where the system allows.
+class SocketSink : public FileSink {
+ public:
+  explicit SocketSink(int fd, const FileOptions& options = FileOptions())
+      : FileSink(fd, options, true) { }
+};
 
 }
 
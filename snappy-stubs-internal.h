@@ -80,6 +80,22 @@ using namespace std;
 #define PREDICT_TRUE(x) x
 #endif
 
+// Inlining hint for small functions on hot paths that the compiler would
+// otherwise refuse to inline (e.g. because they are called from several
+// places within the same loop).
+#ifdef __GNUC__
+#define SNAPPY_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define SNAPPY_ALWAYS_INLINE
+#endif
+
+// Storage class for per-thread variables of plain types.
+#ifdef _MSC_VER
+#define SNAPPY_THREAD_LOCAL __declspec(thread)
+#else
+#define SNAPPY_THREAD_LOCAL __thread
+#endif
+
 // This is only used for recomputing the tag byte table used during
 // decompression; for simplicity we just remove it from the open-source
 // version (anyone who wants to regenerate it can just do the call
@@ -392,8 +408,9 @@ inline int Bits::FindLSBSetNonZero64(uint64 n) {
 // Variable-length integer encoding.
 class Varint {
  public:
-  // Maximum lengths of varint encoding of uint32.
+  // Maximum lengths of varint encoding of uint32 and uint64.
   static const int kMax32 = 5;
+  static const int kMax64 = 10;
 
   // Attempts to parse a varint32 from a prefix of the bytes in [ptr,limit-1].
   // Never reads a character at or beyond limit.  If a valid/terminated varint32
@@ -408,6 +425,11 @@ class Varint {
   //            byte just past the last encoded byte.
   static char* Encode32(char* ptr, uint32 v);
 
+  // REQUIRES   "ptr" points to a buffer of length sufficient to hold "v".
+  // EFFECTS    Encodes "v" into "ptr" and returns a pointer to the
+  //            byte just past the last encoded byte.
+  static char* Encode64(char* ptr, uint64 v);
+
   // EFFECTS    Appends the varint representation of "value" to "*s".
   static void Append32(string* s, uint32 value);
 };
@@ -462,6 +484,17 @@ inline char* Varint::Encode32(char* sptr, uint32 v) {
   return reinterpret_cast<char*>(ptr);
 }
 
+inline char* Varint::Encode64(char* sptr, uint64 v) {
+  unsigned char* ptr = reinterpret_cast<unsigned char*>(sptr);
+  static const int B = 128;
+  while (v >= B) {
+    *(ptr++) = v | B;
+    v >>= 7;
+  }
+  *(ptr++) = v;
+  return reinterpret_cast<char*>(ptr);
+}
+
 // If you know the internal layout of the std::string in use, you can
 // replace this function with one that resizes the string without
 // filling the new space with zeros (if applicable) --
@@ -39,6 +39,9 @@
 
 DEFINE_bool(run_microbenchmarks, true,
             "Run microbenchmarks before doing anything else.");
+DEFINE_bool(run_large_benchmarks, false,
+            "Also run the microbenchmarks that compress tens of megabytes "
+            "per iteration, which take minutes.");
 
 namespace snappy {
 
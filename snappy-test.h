@@ -132,7 +132,7 @@ namespace File {
 }  // namespace File
 
 namespace file {
-  int Defaults() { }
+  int Defaults() { return 0; }
 
   class DummyStatus {
    public:
@@ -158,6 +158,7 @@ namespace file {
     }
 
     fclose(fp);
+    return DummyStatus();
   }
 
   DummyStatus SetContents(const string& filename,
@@ -176,6 +177,7 @@ namespace file {
     }
 
     fclose(fp);
+    return DummyStatus();
   }
 }  // namespace file
 
@@ -191,8 +193,45 @@ void Test_Snappy_SimpleTests();
 void Test_Snappy_MaxBlowup();
 void Test_Snappy_RandomData();
 void Test_Snappy_FourByteOffset();
+void Test_Snappy_UncompressBatch();
+void Test_Snappy_UncompressInPlace();
+void Test_Snappy_UniformInput();
+void Test_Snappy_ConcatenateCompressed();
+void Test_Snappy_SplitCompressed();
+void Test_Snappy_FindInCompressed();
+void Test_Snappy_Crc32c();
+void Test_Snappy_UncompressAndChecksum();
+void Test_Snappy_CompressAndChecksum();
+void Test_Snappy_Session();
+void Test_Snappy_DeltaCompress();
+void Test_Snappy_CompressLarge();
+void Test_Snappy_UncompressingSource();
+void Test_Snappy_CompressingSource();
+void Test_Snappy_CompressShortSource();
+void Test_Snappy_Allocator();
+void Test_Snappy_HugePageAllocator();
+void Test_Snappy_ParallelCompress();
+void Test_Snappy_WorkStealingExecutor();
+void Test_Snappy_CompressWithBudget();
+void Test_Snappy_CompressIfSmallerThan();
+void Test_Snappy_AutoTuningCompressor();
+void Test_Snappy_FramedStream();
+void Test_Snappy_FramedStreamCorruption();
+void Test_Snappy_FramedStreamFakeSyncPoints();
+void Test_Snappy_FramedStreamNested();
+void Test_Snappy_FramedStreamCraftedHeaders();
+void Test_Snappy_FramedStreamContentDefinedChunks();
+void Test_Snappy_FramedStreamDeduplication();
+#ifdef __cpp_impl_coroutine
+void Test_Snappy_CompressAsync();
+#endif
+void Test_Snappy_CheckedByteArraySinkAndStringSink();
+#ifdef HAVE_UNISTD_H
+void Test_Snappy_FileSourceAndSink();
+#endif
 void Test_SnappyCorruption_TruncatedVarint();
 void Test_SnappyCorruption_UnterminatedVarint();
+void Test_SnappyCorruption_OverlongVarint();
 void Test_Snappy_ReadPastEndOfBuffer();
 void Test_Snappy_FindMatchLength();
 void Test_Snappy_FindMatchLengthRandom();
@@ -328,9 +367,24 @@ class Benchmark {
           (new Benchmark(#benchmark_name, benchmark_name))
 
 extern Benchmark* Benchmark_BM_UFlat;
+extern Benchmark* Benchmark_BM_UFlatPadded;
+extern Benchmark* Benchmark_BM_UFlatChecksum;
 extern Benchmark* Benchmark_BM_UIOVec;
+extern Benchmark* Benchmark_BM_USource;
+extern Benchmark* Benchmark_BM_FindInCompressed;
 extern Benchmark* Benchmark_BM_UValidate;
+extern Benchmark* Benchmark_BM_UFlatBatch;
 extern Benchmark* Benchmark_BM_ZFlat;
+extern Benchmark* Benchmark_BM_ZFlatChecksum;
+extern Benchmark* Benchmark_BM_ZFlatSession;
+extern Benchmark* Benchmark_BM_ZFlatAllocator;
+extern Benchmark* Benchmark_BM_ZLargeHugePages;
+extern Benchmark* Benchmark_BM_ZFlatParallel;
+extern Benchmark* Benchmark_BM_ZFlatBudget;
+extern Benchmark* Benchmark_BM_ZFlatIfSmaller;
+extern Benchmark* Benchmark_BM_ZFlatAutoTuned;
+extern Benchmark* Benchmark_BM_ZFramed;
+extern Benchmark* Benchmark_BM_ZFlatUniform;
 
 void ResetBenchmarkTiming();
 void StartBenchmarkTiming();
@@ -462,6 +516,7 @@ class ZLib {
 }  // namespace snappy
 
 DECLARE_bool(run_microbenchmarks);
+DECLARE_bool(run_large_benchmarks);
 
 static void RunSpecifiedBenchmarks() {
   if (!FLAGS_run_microbenchmarks) {
@@ -479,9 +534,26 @@ static void RunSpecifiedBenchmarks() {
   fprintf(stderr, "---------------------------------------------------\n");
 
   snappy::Benchmark_BM_UFlat->Run();
+  snappy::Benchmark_BM_UFlatPadded->Run();
+  snappy::Benchmark_BM_UFlatChecksum->Run();
   snappy::Benchmark_BM_UIOVec->Run();
+  snappy::Benchmark_BM_USource->Run();
+  snappy::Benchmark_BM_FindInCompressed->Run();
   snappy::Benchmark_BM_UValidate->Run();
+  snappy::Benchmark_BM_UFlatBatch->Run();
   snappy::Benchmark_BM_ZFlat->Run();
+  snappy::Benchmark_BM_ZFlatChecksum->Run();
+  snappy::Benchmark_BM_ZFlatSession->Run();
+  snappy::Benchmark_BM_ZFlatAllocator->Run();
+  if (FLAGS_run_large_benchmarks) {
+    snappy::Benchmark_BM_ZLargeHugePages->Run();
+    snappy::Benchmark_BM_ZFlatParallel->Run();
+  }
+  snappy::Benchmark_BM_ZFlatBudget->Run();
+  snappy::Benchmark_BM_ZFlatIfSmaller->Run();
+  snappy::Benchmark_BM_ZFlatAutoTuned->Run();
+  snappy::Benchmark_BM_ZFramed->Run();
+  snappy::Benchmark_BM_ZFlatUniform->Run();
 
   fprintf(stderr, "\n");
 }
@@ -495,8 +567,45 @@ static inline int RUN_ALL_TESTS() {
   snappy::Test_Snappy_MaxBlowup();
   snappy::Test_Snappy_RandomData();
   snappy::Test_Snappy_FourByteOffset();
+  snappy::Test_Snappy_UncompressBatch();
+  snappy::Test_Snappy_UncompressInPlace();
+  snappy::Test_Snappy_UniformInput();
+  snappy::Test_Snappy_ConcatenateCompressed();
+  snappy::Test_Snappy_SplitCompressed();
+  snappy::Test_Snappy_FindInCompressed();
+  snappy::Test_Snappy_Crc32c();
+  snappy::Test_Snappy_UncompressAndChecksum();
+  snappy::Test_Snappy_CompressAndChecksum();
+  snappy::Test_Snappy_Session();
+  snappy::Test_Snappy_DeltaCompress();
+  snappy::Test_Snappy_CompressLarge();
+  snappy::Test_Snappy_UncompressingSource();
+  snappy::Test_Snappy_CompressingSource();
+  snappy::Test_Snappy_CompressShortSource();
+  snappy::Test_Snappy_Allocator();
+  snappy::Test_Snappy_HugePageAllocator();
+  snappy::Test_Snappy_ParallelCompress();
+  snappy::Test_Snappy_WorkStealingExecutor();
+  snappy::Test_Snappy_CompressWithBudget();
+  snappy::Test_Snappy_CompressIfSmallerThan();
+  snappy::Test_Snappy_AutoTuningCompressor();
+  snappy::Test_Snappy_FramedStream();
+  snappy::Test_Snappy_FramedStreamCorruption();
+  snappy::Test_Snappy_FramedStreamFakeSyncPoints();
+  snappy::Test_Snappy_FramedStreamNested();
+  snappy::Test_Snappy_FramedStreamCraftedHeaders();
+  snappy::Test_Snappy_FramedStreamContentDefinedChunks();
+  snappy::Test_Snappy_FramedStreamDeduplication();
+#ifdef __cpp_impl_coroutine
+  snappy::Test_Snappy_CompressAsync();
+#endif
+  snappy::Test_Snappy_CheckedByteArraySinkAndStringSink();
+#ifdef HAVE_UNISTD_H
+  snappy::Test_Snappy_FileSourceAndSink();
+#endif
   snappy::Test_SnappyCorruption_TruncatedVarint();
   snappy::Test_SnappyCorruption_UnterminatedVarint();
+  snappy::Test_SnappyCorruption_OverlongVarint();
   snappy::Test_Snappy_ReadPastEndOfBuffer();
   snappy::Test_Snappy_FindMatchLength();
   snappy::Test_Snappy_FindMatchLengthRandom();
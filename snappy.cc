@@ -27,12 +27,18 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "snappy.h"
+#include "snappy-crc32c.h"
 #include "snappy-internal.h"
 #include "snappy-sinksource.h"
 
 #include <stdio.h>
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #include <algorithm>
+#include <new>
 #include <string>
 #include <vector>
 
@@ -243,7 +249,86 @@ bool GetUncompressedLength(const char* start, size_t n, size_t* result) {
   }
 }
 
+Allocator::~Allocator() { }
+
+namespace {
+
+// The allocator used unless another one was set.
+class NewDeleteAllocator : public Allocator {
+ public:
+  virtual void* Allocate(size_t size) { return ::operator new(size); }
+  virtual void Deallocate(void* ptr, size_t /* size */) {
+    ::operator delete(ptr);
+  }
+};
+
+SNAPPY_THREAD_LOCAL Allocator* thread_allocator = NULL;
+
+}  // namespace
+
+Allocator* SetAllocator(Allocator* allocator) {
+  Allocator* previous = thread_allocator;
+  thread_allocator = allocator;
+  return previous;
+}
+
+Allocator* GetAllocator() {
+  if (thread_allocator != NULL) {
+    return thread_allocator;
+  }
+  static NewDeleteAllocator default_allocator;
+  return &default_allocator;
+}
+
+// Allocates an uninitialized array of "n" T's through "*allocator".
+template <typename T>
+static inline T* AllocateArray(Allocator* allocator, size_t n) {
+  return static_cast<T*>(allocator->Allocate(n * sizeof(T)));
+}
+
+// Frees an array from AllocateArray<T>(allocator, n), if it is not NULL.
+template <typename T>
+static inline void DeallocateArray(Allocator* allocator, T* array, size_t n) {
+  if (array != NULL) {
+    allocator->Deallocate(array, n * sizeof(T));
+  }
+}
+
+// An array from AllocateArray<T>(), freed when this goes out of scope, so
+// that it is not leaked when a later allocation throws.
+template <typename T>
+class ScopedArray {
+ public:
+  explicit ScopedArray(Allocator* allocator)
+      : allocator_(allocator), array_(NULL), n_(0) { }
+  ~ScopedArray() { DeallocateArray(allocator_, array_, n_); }
+
+  // Allocates "n" T's; must be called at most once.
+  T* Allocate(size_t n) {
+    assert(array_ == NULL);
+    array_ = AllocateArray<T>(allocator_, n);
+    n_ = n;
+    return array_;
+  }
+  T* get() const { return array_; }
+
+ private:
+  Allocator* const allocator_;
+  T* array_;
+  size_t n_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedArray);
+};
+
 namespace internal {
+WorkingMemory::WorkingMemory()
+    : large_table_(NULL), allocator_(GetAllocator()) {
+}
+
+WorkingMemory::~WorkingMemory() {
+  DeallocateArray(allocator_, large_table_, kMaxHashTableSize);
+}
+
 uint16* WorkingMemory::GetHashTable(size_t input_size, int* table_size) {
   // Use smaller hash table when input.size() is smaller, since we
   // fill the table, incurring O(hash table size) overhead for
@@ -260,7 +345,7 @@ uint16* WorkingMemory::GetHashTable(size_t input_size, int* table_size) {
     table = small_table_;
   } else {
     if (large_table_ == NULL) {
-      large_table_ = new uint16[kMaxHashTableSize];
+      large_table_ = AllocateArray<uint16>(allocator_, kMaxHashTableSize);
     }
     table = large_table_;
   }
@@ -314,23 +399,14 @@ static inline uint32 GetUint32AtOffset(const char* v, int offset) {
 
 #endif
 
-// Flat array compression that does not emit the "uncompressed length"
-// prefix. Compresses "input" string to the "*op" buffer.
-//
-// REQUIRES: "input" is at most "kBlockSize" bytes long.
-// REQUIRES: "op" points to an array of memory that is at least
-// "MaxCompressedLength(input.size())" in size.
-// REQUIRES: All elements in "table[0..table_size-1]" are initialized to zero.
-// REQUIRES: "table_size" is a power of two
-//
-// Returns an "end" pointer into "op" buffer.
-// "end - op" is the compressed size of "input".
-namespace internal {
-char* CompressFragment(const char* input,
-                       size_t input_size,
-                       char* op,
-                       uint16* table,
-                       const int table_size) {
+// Implements CompressFragment(). Heuristic match skipping (see below)
+// speeds up after 2^kSkipShift bytes without a match.
+template <int kSkipShift>
+static inline char* CompressFragmentWithSkipShift(const char* input,
+                                                  size_t input_size,
+                                                  char* op,
+                                                  uint16* table,
+                                                  const int table_size) {
   // "ip" is the input pointer, and "op" is the output pointer.
   const char* ip = input;
   assert(input_size <= kBlockSize);
@@ -372,9 +448,10 @@ char* CompressFragment(const char* input,
       // and doesn't bother looking for matches everywhere.
       //
       // The "skip" variable keeps track of how many bytes there are since the
-      // last match; dividing it by 32 (ie. right-shifting by five) gives the
-      // number of bytes to move ahead for each iteration.
-      uint32 skip = 32;
+      // last match; dividing it by 32 (ie. right-shifting by five, the
+      // default kSkipShift) gives the number of bytes to move ahead for each
+      // iteration.
+      uint32 skip = 1 << kSkipShift;
 
       const char* next_ip = ip;
       const char* candidate;
@@ -382,7 +459,7 @@ char* CompressFragment(const char* input,
         ip = next_ip;
         uint32 hash = next_hash;
         assert(hash == Hash(ip, shift));
-        uint32 bytes_between_hash_lookups = skip++ >> 5;
+        uint32 bytes_between_hash_lookups = skip++ >> kSkipShift;
         next_ip = ip + bytes_between_hash_lookups;
         if (PREDICT_FALSE(next_ip > ip_limit)) {
           goto emit_remainder;
@@ -417,7 +494,8 @@ char* CompressFragment(const char* input,
         // We have a 4-byte match at ip, and no need to emit any
         // "literal bytes" prior to ip.
         const char* base = ip;
-        int matched = 4 + FindMatchLength(candidate + 4, ip + 4, ip_end);
+        int matched = 4 + internal::FindMatchLength(candidate + 4, ip + 4,
+                                                    ip_end);
         ip += matched;
         size_t offset = base - candidate;
         assert(0 == memcmp(base, candidate, matched));
@@ -451,8 +529,79 @@ char* CompressFragment(const char* input,
 
   return op;
 }
+
+// Flat array compression that does not emit the "uncompressed length"
+// prefix. Compresses "input" string to the "*op" buffer.
+//
+// REQUIRES: "input" is at most "kBlockSize" bytes long.
+// REQUIRES: "op" points to an array of memory that is at least
+// "MaxCompressedLength(input.size())" in size.
+// REQUIRES: All elements in "table[0..table_size-1]" are initialized to zero.
+// REQUIRES: "table_size" is a power of two
+//
+// Returns an "end" pointer into "op" buffer.
+// "end - op" is the compressed size of "input".
+namespace internal {
+char* CompressFragment(const char* input,
+                       size_t input_size,
+                       char* op,
+                       uint16* table,
+                       const int table_size) {
+  return CompressFragmentWithSkipShift<5>(input, input_size, op, table,
+                                          table_size);
+}
 }  // end namespace internal
 
+// Returns true iff "input[0..input_size-1]" consists of a single repeated
+// byte, as is common for zeroed pages. The input is compared 64 bytes at a
+// time against a word filled with the first byte, accumulating the
+// differences without branches so that the compiler can use vector
+// instructions for the inner loop.
+static bool IsUniform(const char* input, size_t input_size) {
+  if (input_size == 0) {
+    return true;
+  }
+  // ~0 / 255 is 0x0101010101010101.
+  const uint64 pattern =
+      static_cast<uint8>(input[0]) * (~static_cast<uint64>(0) / 255);
+  const char* ip = input;
+  const char* ip_end = input + input_size;
+  while (ip_end - ip >= 64) {
+    uint64 diff = 0;
+    for (int i = 0; i < 64; i += 8) {
+      diff |= UNALIGNED_LOAD64(ip + i) ^ pattern;
+    }
+    if (diff != 0) {
+      return false;
+    }
+    ip += 64;
+  }
+  for (; ip < ip_end; ++ip) {
+    if (*ip != input[0]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Same as CompressFragment() for input for which IsUniform() is true,
+// without touching a hash table. CompressFragment() finds the match at
+// offset one right at the second byte and extends it to the end, so the
+// result is a one-byte literal followed by the longest possible copies, or
+// just a literal if the input is too short for its main loop.
+static char* CompressUniformFragment(const char* input,
+                                     size_t input_size,
+                                     char* op) {
+  // See kInputMarginBytes in CompressFragment(); its main loop is entered
+  // only if at least two positions can be probed.
+  static const size_t kMinMatchInputSize = 15 + 2;
+  if (input_size < kMinMatchInputSize) {
+    return input_size == 0 ? op : EmitLiteral(op, input, input_size, false);
+  }
+  op = EmitLiteral(op, input, 1, true);
+  return EmitCopy(op, 1, input_size - 1);
+}
+
 // Signature of output types needed by decompression code.
 // The decompression code is templatized on a type that obeys this
 // signature so that we do not pay virtual function call overhead in
@@ -701,6 +850,10 @@ class SnappyDecompressor {
       if (n == 0) return false;
       const unsigned char c = *(reinterpret_cast<const unsigned char*>(ip));
       reader_->Skip(1);
+      if (shift == 28 && c > 0x0f) {
+        // More than 32 bits, as Varint::Parse32WithLimit() also rejects.
+        return false;
+      }
       *result |= static_cast<uint32>(c & 0x7f) << shift;
       if (c < 128) {
         break;
@@ -871,7 +1024,36 @@ bool GetUncompressedLength(Source* source, uint32* result) {
   return decompressor.ReadUncompressedLength(result);
 }
 
-size_t Compress(Source* reader, Sink* writer) {
+// Compresses "fragment[0,fragment_size-1]" (at most kBlockSize bytes) to
+// "dest", and returns the end of the output.
+static char* CompressBlock(const char* fragment, size_t fragment_size,
+                           char* dest, internal::WorkingMemory* wmem) {
+  if (IsUniform(fragment, fragment_size)) {
+    // Zeroed pages and the like; no need to clear and fill a hash table.
+    return CompressUniformFragment(fragment, fragment_size, dest);
+  }
+  // Get encoding table for compression
+  int table_size;
+  uint16* table = wmem->GetHashTable(fragment_size, &table_size);
+  return internal::CompressFragment(fragment, fragment_size,
+                                    dest, table, table_size);
+}
+
+// Compresses a block for an AutoTuningCompressor; see below.
+static char* TunedCompressBlock(internal::Tuner* tuner,
+                                const char* fragment, size_t fragment_size,
+                                char* dest, internal::WorkingMemory* wmem);
+
+// Compress(), optionally also computing the CRC-32C of each block of the
+// input (appended to "*block_crcs") and of all of it (stored in
+// "*stream_crc"), for CompressAndChecksum(), storing blocks as literals
+// once "*budget" is exhausted, for CompressWithBudget(), and compressing
+// blocks with "*tuner", for AutoTuningCompressor.
+static size_t InternalCompress(Source* reader, Sink* writer,
+                               std::vector<uint32>* block_crcs,
+                               uint32* stream_crc,
+                               CompressionBudget* budget,
+                               internal::Tuner* tuner) {
   size_t written = 0;
   size_t N = reader->Available();
   char ulength[Varint::kMax32];
@@ -880,14 +1062,26 @@ size_t Compress(Source* reader, Sink* writer) {
   written += (p - ulength);
 
   internal::WorkingMemory wmem;
+  Allocator* const allocator = GetAllocator();
+  ScopedArray<char> scratch_array(allocator);
   char* scratch = NULL;
+  ScopedArray<char> scratch_output_array(allocator);
   char* scratch_output = NULL;
+  const bool checksum = block_crcs != NULL || stream_crc != NULL;
+  bool literals_only = false;
+  bool ended_early = false;
+  if (stream_crc != NULL) {
+    *stream_crc = 0;
+  }
 
   while (N > 0) {
     // Get next block to compress (without copying if possible)
     size_t fragment_size;
     const char* fragment = reader->Peek(&fragment_size);
-    assert(fragment_size != 0);  // premature end of input
+    if (fragment_size == 0) {
+      ended_early = true;
+      break;
+    }
     const size_t num_to_read = min(N, kBlockSize);
     size_t bytes_read = fragment_size;
 
@@ -902,43 +1096,68 @@ size_t Compress(Source* reader, Sink* writer) {
         // If this is the last iteration, we want to allocate N bytes
         // of space, otherwise the max possible kBlockSize space.
         // num_to_read contains exactly the correct value
-        scratch = new char[num_to_read];
+        scratch = scratch_array.Allocate(num_to_read);
       }
       memcpy(scratch, fragment, bytes_read);
       reader->Skip(bytes_read);
 
       while (bytes_read < num_to_read) {
         fragment = reader->Peek(&fragment_size);
+        if (fragment_size == 0) {
+          // The source ended early, like a FileSource after a read error.
+          ended_early = true;
+          break;
+        }
         size_t n = min<size_t>(fragment_size, num_to_read - bytes_read);
         memcpy(scratch + bytes_read, fragment, n);
         bytes_read += n;
         reader->Skip(n);
       }
-      assert(bytes_read == num_to_read);
+      if (ended_early) {
+        break;
+      }
       fragment = scratch;
       fragment_size = num_to_read;
     }
     assert(fragment_size == num_to_read);
 
-    // Get encoding table for compression
-    int table_size;
-    uint16* table = wmem.GetHashTable(num_to_read, &table_size);
-
     // Compress input_fragment and append to dest
     const int max_output = MaxCompressedLength(num_to_read);
 
     // Need a scratch buffer for the output, in case the byte sink doesn't
     // have room for us directly.
     if (scratch_output == NULL) {
-      scratch_output = new char[max_output];
+      scratch_output = scratch_output_array.Allocate(max_output);
     } else {
       // Since we encode kBlockSize regions followed by a region
       // which is <= kBlockSize in length, a previously allocated
       // scratch_output[] region is big enough for this iteration.
     }
     char* dest = writer->GetAppendBuffer(max_output, scratch_output);
-    char* end = internal::CompressFragment(fragment, fragment_size,
-                                           dest, table, table_size);
+    if (budget != NULL && budget->Exhausted()) {
+      literals_only = true;
+      budget = NULL;
+    }
+    char* end;
+    if (literals_only) {
+      end = EmitLiteral(dest, fragment, fragment_size, false);
+    } else if (tuner != NULL) {
+      end = TunedCompressBlock(tuner, fragment, fragment_size, dest, &wmem);
+    } else {
+      end = CompressBlock(fragment, fragment_size, dest, &wmem);
+    }
+    if (checksum) {
+      // The fragment was just read by the compressor, so this does not
+      // need another trip to memory. The stream checksum is derived from
+      // the block checksums instead of by reading the input once more.
+      const uint32 crc = crc32c::Value(fragment, fragment_size);
+      if (block_crcs != NULL) {
+        block_crcs->push_back(crc);
+      }
+      if (stream_crc != NULL) {
+        *stream_crc = crc32c::Combine(*stream_crc, crc, fragment_size);
+      }
+    }
     writer->Append(dest, end - dest);
     written += (end - dest);
 
@@ -946,10 +1165,19 @@ size_t Compress(Source* reader, Sink* writer) {
     reader->Skip(pending_advance);
   }
 
-  delete[] scratch;
-  delete[] scratch_output;
+  // What was written is then a truncated stream, which will not decompress.
+  return ended_early ? 0 : written;
+}
 
-  return written;
+size_t Compress(Source* reader, Sink* writer) {
+  return InternalCompress(reader, writer, NULL, NULL, NULL, NULL);
+}
+
+size_t CompressAndChecksum(Source* reader, Sink* writer,
+                           std::vector<uint32>* block_crcs,
+                           uint32* stream_crc) {
+  return InternalCompress(reader, writer, block_crcs, stream_crc, NULL,
+                          NULL);
 }
 
 // -----------------------------------------------------------------------
@@ -1148,6 +1376,13 @@ class SnappyArrayWriter {
         op_(dst) {
   }
 
+  // Writes to "dst", where copies may also refer to the data in
+  // "base[0..dst-base-1]" that precedes it.
+  inline SnappyArrayWriter(char* base, char* dst)
+      : base_(base),
+        op_(dst) {
+  }
+
   inline void SetExpectedLength(size_t len) {
     op_limit_ = op_ + len;
   }
@@ -1181,6 +1416,24 @@ class SnappyArrayWriter {
     }
   }
 
+  // Like TryFastAppend(), but for every literal length that fits in the
+  // tag byte. The caller guarantees that 64 bytes can be read from "ip";
+  // see RawUncompressPadded().
+  inline bool TryFastAppendPadded(const char* ip, size_t len) {
+    char* op = op_;
+    const size_t space_left = op_limit_ - op;
+    if (len <= 16 && space_left >= 16) {
+      UnalignedCopy64(ip, op);
+      UnalignedCopy64(ip + 8, op + 8);
+    } else if (len <= 60 && space_left >= 64) {
+      memcpy(op, ip, 64);
+    } else {
+      return false;
+    }
+    op_ = op + len;
+    return true;
+  }
+
   inline bool AppendFromSelf(size_t offset, size_t len) {
     char* op = op_;
     const size_t space_left = op_limit_ - op;
@@ -1241,66 +1494,2618 @@ bool Uncompress(const char* compressed, size_t n, string* uncompressed) {
   return RawUncompress(compressed, n, string_as_array(uncompressed));
 }
 
+// -----------------------------------------------------------------------
+// Checksumming decompression
+// -----------------------------------------------------------------------
+
+// Output is folded into the checksum in chunks of about this size, so that
+// it is still in the L1 cache when it is read back.
+static const size_t kChecksumChunkSize = 8192;
 
-// A Writer that drops everything on the floor and just does validation
-class SnappyDecompressionValidator {
+// A SnappyArrayWriter that also computes the CRC-32C of what it writes.
+// Bytes below the output position are final (copies only ever scribble
+// beyond it), so they can be checksummed as soon as enough have piled up.
+class SnappyChecksummingArrayWriter {
  private:
-  size_t expected_;
-  size_t produced_;
+  SnappyArrayWriter writer_;
+  const char* op_;           // Mirrors the output position of "writer_"
+  const char* checksummed_;  // Output before this is included in "crc_"
+  uint32 crc_;
+
+  inline void Advance(size_t len) {
+    op_ += len;
+    if (PREDICT_FALSE(static_cast<size_t>(op_ - checksummed_) >=
+                      kChecksumChunkSize)) {
+      Fold();
+    }
+  }
+
+  void Fold() {
+    crc_ = crc32c::Extend(crc_, checksummed_, op_ - checksummed_);
+    checksummed_ = op_;
+  }
 
  public:
-  inline SnappyDecompressionValidator() : produced_(0) { }
+  inline explicit SnappyChecksummingArrayWriter(char* dst)
+      : writer_(dst),
+        op_(dst),
+        checksummed_(dst),
+        crc_(0) {
+  }
+
   inline void SetExpectedLength(size_t len) {
-    expected_ = len;
+    writer_.SetExpectedLength(len);
   }
+
   inline bool CheckLength() const {
-    return expected_ == produced_;
+    return writer_.CheckLength();
   }
+
   inline bool Append(const char* ip, size_t len) {
-    produced_ += len;
-    return produced_ <= expected_;
+    if (!writer_.Append(ip, len)) {
+      return false;
+    }
+    Advance(len);
+    return true;
   }
-  inline bool TryFastAppend(const char* ip, size_t available, size_t length) {
-    return false;
+
+  inline bool TryFastAppend(const char* ip, size_t available, size_t len) {
+    if (!writer_.TryFastAppend(ip, available, len)) {
+      return false;
+    }
+    Advance(len);
+    return true;
   }
+
   inline bool AppendFromSelf(size_t offset, size_t len) {
-    // See SnappyArrayWriter::AppendFromSelf for an explanation of
-    // the "offset - 1u" trick.
-    if (produced_ <= offset - 1u) return false;
-    produced_ += len;
-    return produced_ <= expected_;
+    if (!writer_.AppendFromSelf(offset, len)) {
+      return false;
+    }
+    Advance(len);
+    return true;
+  }
+
+  // Returns the CRC-32C of everything written so far.
+  uint32 crc() {
+    Fold();
+    return crc_;
   }
 };
 
-bool IsValidCompressedBuffer(const char* compressed, size_t n) {
+bool RawUncompressAndChecksum(const char* compressed, size_t n,
+                              char* uncompressed, uint32* crc32c) {
   ByteArraySource reader(compressed, n);
-  SnappyDecompressionValidator writer;
-  return InternalUncompress(&reader, &writer);
+  SnappyChecksummingArrayWriter output(uncompressed);
+  if (!InternalUncompress(&reader, &output)) {
+    return false;
+  }
+  *crc32c = output.crc();
+  return true;
 }
 
-void RawCompress(const char* input,
-                 size_t input_length,
-                 char* compressed,
-                 size_t* compressed_length) {
-  ByteArraySource reader(input, input_length);
-  UncheckedByteArraySink writer(compressed);
-  Compress(&reader, &writer);
+bool UncompressAndChecksum(const char* compressed, size_t n,
+                           string* uncompressed, uint32* crc32c) {
+  size_t ulength;
+  if (!GetUncompressedLength(compressed, n, &ulength)) {
+    return false;
+  }
+  // See Uncompress().
+  if (ulength > uncompressed->max_size()) {
+    return false;
+  }
+  STLStringResizeUninitialized(uncompressed, ulength);
+  return RawUncompressAndChecksum(compressed, n,
+                                  string_as_array(uncompressed), crc32c);
+}
 
-  // Compute how many bytes were added
-  *compressed_length = (writer.CurrentDestination() - compressed);
+// -----------------------------------------------------------------------
+// Padded-input decompression
+// -----------------------------------------------------------------------
+
+bool RawUncompressPadded(const char* compressed, size_t compressed_length,
+                         char* uncompressed) {
+  const char* ip_limit = compressed + compressed_length;
+  uint32 ulength;
+  const char* ip = Varint::Parse32WithLimit(compressed, ip_limit, &ulength);
+  if (ip == NULL) {
+    return false;
+  }
+  SnappyArrayWriter writer(uncompressed);
+  writer.SetExpectedLength(ulength);
+
+  // This is SnappyDecompressor::DecompressAllTags() without RefillTag() and
+  // MAYBE_REFILL(): as long as a tag starts before "ip_limit", its trailer
+  // and any literal that fits in the tag byte can be read straight from the
+  // padding, so those literals are copied with fixed-size moves. A stream
+  // that actually runs into the padding is corrupt, and is caught by the
+  // final check on "ip"; whatever garbage has been written by then stays
+  // within the output buffer.
+  while (ip < ip_limit) {
+    const unsigned char c = *(reinterpret_cast<const unsigned char*>(ip++));
+
+    if ((c & 0x3) == LITERAL) {
+      size_t literal_length = (c >> 2) + 1u;
+      if (writer.TryFastAppendPadded(ip, literal_length)) {
+        ip += literal_length;
+        continue;
+      }
+      if (PREDICT_FALSE(literal_length >= 61)) {
+        // Long literal.
+        const size_t literal_length_length = literal_length - 60;
+        literal_length =
+            (LittleEndian::Load32(ip) & wordmask[literal_length_length]) + 1;
+        ip += literal_length_length;
+      }
+      if (ip > ip_limit ||
+          static_cast<size_t>(ip_limit - ip) < literal_length ||
+          !writer.Append(ip, literal_length)) {
+        return false;
+      }
+      ip += literal_length;
+    } else {
+      const uint32 entry = char_table[c];
+      const uint32 trailer = LittleEndian::Load32(ip) & wordmask[entry >> 11];
+      const uint32 length = entry & 0xff;
+      ip += entry >> 11;
+
+      // copy_offset/256 is encoded in bits 8..10.  By just fetching
+      // those bits, we get copy_offset (since the bit-field starts at
+      // bit 8).
+      const uint32 copy_offset = entry & 0x700;
+      if (!writer.AppendFromSelf(copy_offset + trailer, length)) {
+        return false;
+      }
+    }
+  }
+  return ip == ip_limit && writer.CheckLength();
 }
 
-size_t Compress(const char* input, size_t input_length, string* compressed) {
-  // Pre-grow the buffer to the max length of the compressed output
-  compressed->resize(MaxCompressedLength(input_length));
+// -----------------------------------------------------------------------
+// In-place decompression
+// -----------------------------------------------------------------------
 
-  size_t compressed_length;
-  RawCompress(input, input_length, string_as_array(compressed),
-              &compressed_length);
-  compressed->resize(compressed_length);
-  return compressed_length;
+size_t MaxInPlaceMargin(size_t uncompressed_length) {
+  // Decoding in place works as long as the output never overtakes the input,
+  // i.e. as long as op <= ip between tags. With the compressed data ending at
+  // "end", this means that
+  //
+  //   end - ulen >= (input left to read) - (output left to write)
+  //
+  // must hold after every tag; the margin is the largest amount by which a
+  // tail of the stream can be bigger than what it decodes to.
+  //
+  // Every copy Compress() emits is at least four bytes long and takes at
+  // most three bytes to encode, so copies always make the tail smaller.
+  // Every literal except the last one in each block is followed by a copy,
+  // which saves at least one byte. A literal costs one tag byte if it is at
+  // most 60 bytes long, and at most three if it is longer (it cannot be
+  // longer than a block), so a literal-copy pair adds at most two bytes, and
+  // only if the literal is at least 61 bytes long. The trailing literal of
+  // each block adds up to three bytes on its own. Finally, the header
+  // is at most Varint::kMax32 bytes, which the buffer needs to hold as well.
+  const size_t num_blocks = uncompressed_length / kBlockSize + 1;
+  return Varint::kMax32 + 2 * (uncompressed_length / 61) + 3 * num_blocks;
+}
+
+// Reads the "n" byte little-endian trailer of a tag at "ip", where n <= 4,
+// without reading at or beyond "ip_limit".
+static inline uint32 LoadTrailer(const char* ip, const char* ip_limit,
+                                 size_t n) {
+  if (PREDICT_TRUE(ip_limit - ip >= 4)) {
+    return LittleEndian::Load32(ip) & wordmask[n];
+  }
+  uint32 v = 0;
+  for (size_t i = 0; i < n; ++i) {
+    v |= static_cast<uint32>(static_cast<uint8>(ip[i])) << (8 * i);
+  }
+  return v;
+}
+
+bool RawUncompressInPlace(char* buf, size_t buf_size,
+                          size_t compressed_offset, size_t compressed_length) {
+  if (compressed_offset > buf_size ||
+      compressed_length > buf_size - compressed_offset) {
+    return false;
+  }
+  const char* ip = buf + compressed_offset;
+  const char* ip_limit = ip + compressed_length;
+  uint32 ulength;
+  ip = Varint::Parse32WithLimit(ip, ip_limit, &ulength);
+  if (ip == NULL || ulength > buf_size) {
+    return false;
+  }
+  char* op = buf;
+  char* const op_limit = buf + ulength;
+
+  // Unlike SnappyDecompressor, this loop keeps every write below "ip", so
+  // that no compressed byte is overwritten before it has been read. Writes
+  // are exact unless there is room for the usual fast paths below "ip".
+  while (ip < ip_limit) {
+    assert(op <= ip);
+    const unsigned char c = *(reinterpret_cast<const unsigned char*>(ip++));
+    if ((c & 0x3) == LITERAL) {
+      size_t literal_length = (c >> 2) + 1u;
+      if (PREDICT_FALSE(literal_length >= 61)) {
+        // Long literal.
+        const size_t literal_length_length = literal_length - 60;
+        if (static_cast<size_t>(ip_limit - ip) < literal_length_length) {
+          return false;
+        }
+        literal_length = LoadTrailer(ip, ip_limit, literal_length_length) + 1;
+        ip += literal_length_length;
+      }
+      if (static_cast<size_t>(ip_limit - ip) < literal_length ||
+          static_cast<size_t>(op_limit - op) < literal_length) {
+        return false;
+      }
+      if (literal_length <= 16 && ip - op >= 16 && ip_limit - ip >= 16) {
+        UnalignedCopy64(ip, op);
+        UnalignedCopy64(ip + 8, op + 8);
+      } else {
+        // The literal may overlap its own destination, but always lies
+        // after it.
+        memmove(op, ip, literal_length);
+      }
+      ip += literal_length;
+      op += literal_length;
+    } else {
+      const uint32 entry = char_table[c];
+      const size_t trailer_length = entry >> 11;
+      if (static_cast<size_t>(ip_limit - ip) < trailer_length) {
+        return false;
+      }
+      const size_t offset =
+          (entry & 0x700) + LoadTrailer(ip, ip_limit, trailer_length);
+      const size_t length = entry & 0xff;
+      ip += trailer_length;
+
+      // See SnappyArrayWriter::AppendFromSelf() for the offset check.
+      if (static_cast<size_t>(op - buf) <= offset - 1u ||
+          static_cast<size_t>(op_limit - op) < length) {
+        return false;
+      }
+      // The output must not overtake the input; this is what
+      // MaxInPlaceMargin() guarantees for streams from Compress().
+      const size_t room = ip - op;
+      if (PREDICT_FALSE(room < length)) {
+        return false;
+      }
+      if (length <= 16 && offset >= 8 && room >= 16) {
+        UnalignedCopy64(op - offset, op);
+        UnalignedCopy64(op - offset + 8, op + 8);
+      } else if (room >= length + kMaxIncrementCopyOverflow) {
+        IncrementalCopyFastPath(op - offset, op, length);
+      } else {
+        IncrementalCopy(op - offset, op, length);
+      }
+      op += length;
+    }
+  }
+  return op == op_limit;
 }
 
+// -----------------------------------------------------------------------
+// Interleaved batch decompression
+// -----------------------------------------------------------------------
+
+// Number of streams RawUncompressBatch() advances in lock-step. Decoding a
+// tag is a short chain of dependent loads (the tag determines where the next
+// tag starts), so decoding one tag from each of several independent streams
+// per iteration lets the CPU overlap the chains. On x86-64 two lanes is the
+// sweet spot; with more, the lane state no longer fits in registers.
+static const int kDecodeLanes = 2;
+
+namespace {
+
+// Decoding state for one of the streams in RawUncompressBatch().
+struct DecodeLane {
+  DecodeLane() : ip(NULL), ip_limit(NULL), writer(NULL), index(0),
+                 active(false) { }
+
+  const char* ip;          // Next tag to decode
+  const char* ip_limit;    // End of the compressed input
+  SnappyArrayWriter writer;
+  size_t index;            // Position of the stream in the batch
+  bool active;             // Is a stream currently assigned to this lane?
+};
+
+}  // namespace
+
+// Decodes the tag at "lane->ip". This is the body of
+// SnappyDecompressor::DecompressAllTags() specialized for flat input, without
+// the refill logic: it simply declines (returns false) if fewer than
+// kMaximumTagLength bytes are left, or if the tag cannot be applied. The lane
+// is left untouched in that case, so that FinishDecodeLane() can take over
+// from the same tag.
+static inline SNAPPY_ALWAYS_INLINE bool DecodeLaneTag(DecodeLane* lane) {
+  const char* ip = lane->ip;
+  if (PREDICT_FALSE(lane->ip_limit - ip < kMaximumTagLength)) {
+    return false;
+  }
+  const unsigned char c = *(reinterpret_cast<const unsigned char*>(ip++));
+
+  if ((c & 0x3) == LITERAL) {
+    size_t literal_length = (c >> 2) + 1u;
+    if (lane->writer.TryFastAppend(ip, lane->ip_limit - ip, literal_length)) {
+      lane->ip = ip + literal_length;
+      return true;
+    }
+    if (PREDICT_FALSE(literal_length >= 61)) {
+      // Long literal.
+      const size_t literal_length_length = literal_length - 60;
+      literal_length =
+          (LittleEndian::Load32(ip) & wordmask[literal_length_length]) + 1;
+      ip += literal_length_length;
+    }
+    if (static_cast<size_t>(lane->ip_limit - ip) < literal_length ||
+        !lane->writer.Append(ip, literal_length)) {
+      return false;
+    }
+    lane->ip = ip + literal_length;
+  } else {
+    const uint32 entry = char_table[c];
+    const uint32 trailer = LittleEndian::Load32(ip) & wordmask[entry >> 11];
+    const uint32 length = entry & 0xff;
+    const uint32 copy_offset = entry & 0x700;
+    if (!lane->writer.AppendFromSelf(copy_offset + trailer, length)) {
+      return false;
+    }
+    lane->ip = ip + (entry >> 11);
+  }
+  return true;
+}
+
+// Decodes whatever DecodeLaneTag() declined, using the general decompressor.
+// Returns true iff the stream in "lane" was valid.
+static bool FinishDecodeLane(DecodeLane* lane) {
+  ByteArraySource reader(lane->ip, lane->ip_limit - lane->ip);
+  SnappyDecompressor decompressor(&reader);
+  decompressor.DecompressAllTags(&lane->writer);
+  return decompressor.eof() && lane->writer.CheckLength();
+}
+
+namespace {
+
+// Hands out the streams of a RawUncompressBatch() call to the lanes, and
+// collects the results.
+class DecodeBatch {
+ public:
+  DecodeBatch(const char* const* compressed,
+              const size_t* compressed_length,
+              size_t n,
+              char* const* uncompressed,
+              bool* valid)
+      : compressed_(compressed),
+        compressed_length_(compressed_length),
+        n_(n),
+        uncompressed_(uncompressed),
+        valid_(valid),
+        next_(0),
+        num_active_(0),
+        all_valid_(true) {
+  }
+
+  int num_active() const { return num_active_; }
+  bool all_valid() const { return all_valid_; }
+
+  // Assigns the next stream with a well-formed header to "lane", or leaves
+  // it inactive if there are no more streams.
+  void AssignNext(DecodeLane* lane) {
+    while (next_ < n_) {
+      const size_t i = next_++;
+      const char* limit = compressed_[i] + compressed_length_[i];
+      uint32 ulength;
+      const char* ip =
+          Varint::Parse32WithLimit(compressed_[i], limit, &ulength);
+      if (ip == NULL) {
+        SetResult(i, false);
+        continue;
+      }
+      lane->ip = ip;
+      lane->ip_limit = limit;
+      lane->writer = SnappyArrayWriter(uncompressed_[i]);
+      lane->writer.SetExpectedLength(ulength);
+      lane->index = i;
+      lane->active = true;
+      ++num_active_;
+      return;
+    }
+  }
+
+  // Finishes the stream in "lane" and assigns the next one.
+  void Retire(DecodeLane* lane) {
+    SetResult(lane->index, FinishDecodeLane(lane));
+    lane->ip = lane->ip_limit = NULL;
+    lane->active = false;
+    --num_active_;
+    AssignNext(lane);
+  }
+
+ private:
+  void SetResult(size_t i, bool ok) {
+    if (valid_ != NULL) valid_[i] = ok;
+    all_valid_ &= ok;
+  }
+
+  const char* const* compressed_;
+  const size_t* compressed_length_;
+  const size_t n_;
+  char* const* uncompressed_;
+  bool* valid_;
+  size_t next_;
+  int num_active_;
+  bool all_valid_;
+};
+
+}  // namespace
+
+// Decodes tags from all lanes in turn until one of them declines, and
+// returns the index of that lane. The lanes are copied to locals so that the
+// compiler can keep their state in registers for the duration of the loop.
+static inline int DecodeLanesInLockStep(DecodeLane* lanes) {
+  DecodeLane lane0 = lanes[0];
+  DecodeLane lane1 = lanes[1];
+  int declined;
+  for ( ;; ) {
+    if (PREDICT_FALSE(!DecodeLaneTag(&lane0))) {
+      declined = 0;
+      break;
+    }
+    if (PREDICT_FALSE(!DecodeLaneTag(&lane1))) {
+      declined = 1;
+      break;
+    }
+  }
+  lanes[0] = lane0;
+  lanes[1] = lane1;
+  return declined;
+}
+
+bool RawUncompressBatch(const char* const* compressed,
+                        const size_t* compressed_length,
+                        size_t n,
+                        char* const* uncompressed,
+                        bool* valid) {
+  DecodeBatch batch(compressed, compressed_length, n, uncompressed, valid);
+  DecodeLane lanes[kDecodeLanes];
+  for (int k = 0; k < kDecodeLanes; ++k) {
+    batch.AssignNext(&lanes[k]);
+  }
+
+  // A lane declines when its stream is (nearly) done or something is wrong
+  // with it; it is then finished carefully and given the next stream.
+  while (batch.num_active() == kDecodeLanes) {
+    batch.Retire(&lanes[DecodeLanesInLockStep(lanes)]);
+  }
+
+  // Out of streams; finish the stragglers one at a time.
+  for (int k = 0; k < kDecodeLanes; ++k) {
+    if (lanes[k].active) {
+      batch.Retire(&lanes[k]);
+    }
+  }
+  return batch.all_valid();
+}
+
+
+// A Writer that drops everything on the floor and just does validation
+class SnappyDecompressionValidator {
+ private:
+  size_t expected_;
+  size_t produced_;
+
+ public:
+  inline SnappyDecompressionValidator() : produced_(0) { }
+  inline void SetExpectedLength(size_t len) {
+    expected_ = len;
+  }
+  inline bool CheckLength() const {
+    return expected_ == produced_;
+  }
+  inline bool Append(const char* ip, size_t len) {
+    produced_ += len;
+    return produced_ <= expected_;
+  }
+  inline bool TryFastAppend(const char* ip, size_t available, size_t length) {
+    return false;
+  }
+  inline bool AppendFromSelf(size_t offset, size_t len) {
+    // See SnappyArrayWriter::AppendFromSelf for an explanation of
+    // the "offset - 1u" trick.
+    if (produced_ <= offset - 1u) return false;
+    produced_ += len;
+    return produced_ <= expected_;
+  }
+};
+
+bool IsValidCompressedBuffer(const char* compressed, size_t n) {
+  ByteArraySource reader(compressed, n);
+  SnappyDecompressionValidator writer;
+  return InternalUncompress(&reader, &writer);
+}
+
+void RawCompress(const char* input,
+                 size_t input_length,
+                 char* compressed,
+                 size_t* compressed_length) {
+  ByteArraySource reader(input, input_length);
+  UncheckedByteArraySink writer(compressed);
+  Compress(&reader, &writer);
+
+  // Compute how many bytes were added
+  *compressed_length = (writer.CurrentDestination() - compressed);
+}
+
+void RawCompressAndChecksum(const char* input,
+                            size_t input_length,
+                            char* compressed,
+                            size_t* compressed_length,
+                            std::vector<uint32>* block_crcs,
+                            uint32* stream_crc) {
+  ByteArraySource reader(input, input_length);
+  UncheckedByteArraySink writer(compressed);
+  CompressAndChecksum(&reader, &writer, block_crcs, stream_crc);
+  *compressed_length = (writer.CurrentDestination() - compressed);
+}
+
+// A lower bound on the compressed length of any "n" bytes: no tag stands for
+// more than 64 bytes with fewer than 3 (copies of up to 11 bytes take 2,
+// literals one more than their length).
+static inline size_t MinCompressedLength(size_t n) {
+  return 3 * (n / 64);
+}
+
+bool CompressIfSmallerThan(const char* input,
+                           size_t input_length,
+                           size_t max_compressed_length,
+                           char* compressed,
+                           size_t* compressed_length) {
+  char ulength[Varint::kMax32];
+  const size_t header_length = Varint::Encode32(ulength, input_length) -
+                               ulength;
+  if (header_length > max_compressed_length) {
+    return false;
+  }
+  memcpy(compressed, ulength, header_length);
+  char* op = compressed + header_length;
+  char* const op_limit = compressed + max_compressed_length;
+
+  internal::WorkingMemory wmem;
+  Allocator* const allocator = GetAllocator();
+  char* scratch_output = NULL;
+  const size_t scratch_output_size = MaxCompressedLength(kBlockSize);
+  bool success = true;
+  for (size_t pos = 0; pos < input_length; pos += kBlockSize) {
+    const size_t fragment_size = min(kBlockSize, input_length - pos);
+    if (MinCompressedLength(input_length - pos) >
+        static_cast<size_t>(op_limit - op)) {
+      // Not even the most compressible data would fit.
+      success = false;
+      break;
+    }
+    if (static_cast<size_t>(op_limit - op) >=
+        MaxCompressedLength(fragment_size)) {
+      op = CompressBlock(input + pos, fragment_size, op, &wmem);
+      continue;
+    }
+    // Near the end of the room, the worst case no longer fits; compress
+    // to the side and see.
+    if (scratch_output == NULL) {
+      scratch_output = AllocateArray<char>(allocator, scratch_output_size);
+    }
+    char* end = CompressBlock(input + pos, fragment_size, scratch_output,
+                              &wmem);
+    const size_t length = end - scratch_output;
+    if (length > static_cast<size_t>(op_limit - op)) {
+      success = false;
+      break;
+    }
+    memcpy(op, scratch_output, length);
+    op += length;
+  }
+
+  DeallocateArray(allocator, scratch_output, scratch_output_size);
+  if (success) {
+    *compressed_length = op - compressed;
+  }
+  return success;
+}
+
+size_t Compress(const char* input, size_t input_length, string* compressed) {
+  // Pre-grow the buffer to the max length of the compressed output
+  compressed->resize(MaxCompressedLength(input_length));
+
+  size_t compressed_length;
+  RawCompress(input, input_length, string_as_array(compressed),
+              &compressed_length);
+  compressed->resize(compressed_length);
+  return compressed_length;
+}
+
+// -----------------------------------------------------------------------
+// Splicing compressed buffers
+// -----------------------------------------------------------------------
+
+bool ConcatenateCompressed(const char* const* compressed,
+                           const size_t* compressed_length,
+                           size_t n,
+                           string* output) {
+  // The tags of a stream only ever refer back to output of the same stream,
+  // so they are position independent and can simply be laid end to end.
+  uint64 total_length = 0;
+  size_t total_tag_bytes = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const char* limit = compressed[i] + compressed_length[i];
+    uint32 ulength;
+    const char* tags = Varint::Parse32WithLimit(compressed[i], limit, &ulength);
+    if (tags == NULL) {
+      return false;
+    }
+    total_length += ulength;
+    total_tag_bytes += limit - tags;
+  }
+  if (total_length > kuint32max) {
+    return false;
+  }
+
+  output->clear();
+  output->reserve(Varint::kMax32 + total_tag_bytes);
+  Varint::Append32(output, static_cast<uint32>(total_length));
+  for (size_t i = 0; i < n; ++i) {
+    const char* limit = compressed[i] + compressed_length[i];
+    uint32 ulength;
+    const char* tags = Varint::Parse32WithLimit(compressed[i], limit, &ulength);
+    output->append(tags, limit - tags);
+  }
+  return true;
+}
+
+// Walks the tags in ["tags", "ip_limit") of a stream of "ulength" bytes
+// for SplitCompressed(), storing the possible cuts in "cut_output" and
+// "cut_input" and their number in "*num_cuts". Returns false if the tags
+// are corrupted.
+static bool FindCuts(const char* tags, const char* ip_limit, size_t ulength,
+                     size_t* cut_output, const char** cut_input,
+                     size_t* num_cuts) {
+  size_t produced = 0;
+  const char* ip = tags;
+  while (ip < ip_limit) {
+    if (produced % kBlockSize == 0 && produced > 0) {
+      // Only while produced <= ulength, so at most ulength / kBlockSize.
+      cut_output[*num_cuts] = produced;
+      cut_input[*num_cuts] = ip;
+      ++*num_cuts;
+    }
+
+    const unsigned char c = *(reinterpret_cast<const unsigned char*>(ip++));
+    if ((c & 0x3) == LITERAL) {
+      size_t literal_length = (c >> 2) + 1u;
+      if (literal_length >= 61) {
+        const size_t literal_length_length = literal_length - 60;
+        if (static_cast<size_t>(ip_limit - ip) < literal_length_length) {
+          return false;
+        }
+        literal_length = LoadTrailer(ip, ip_limit, literal_length_length) + 1;
+        ip += literal_length_length;
+      }
+      if (static_cast<size_t>(ip_limit - ip) < literal_length) {
+        return false;
+      }
+      ip += literal_length;
+      produced += literal_length;
+    } else {
+      const uint32 entry = char_table[c];
+      const size_t trailer_length = entry >> 11;
+      if (static_cast<size_t>(ip_limit - ip) < trailer_length) {
+        return false;
+      }
+      const size_t offset =
+          (entry & 0x700) + LoadTrailer(ip, ip_limit, trailer_length);
+      ip += trailer_length;
+      if (produced <= offset - 1u) {
+        return false;
+      }
+      // This copy rules out any cut it reaches back across.
+      while (*num_cuts > 0 && cut_output[*num_cuts - 1] > produced - offset) {
+        --*num_cuts;
+      }
+      produced += entry & 0xff;
+    }
+    if (produced > ulength) {
+      return false;
+    }
+  }
+  return produced == ulength;
+}
+
+bool SplitCompressed(const char* compressed, size_t compressed_length,
+                     size_t min_part_length, std::vector<string>* parts) {
+  parts->clear();
+  const char* ip_limit = compressed + compressed_length;
+  uint32 ulength;
+  const char* const tags = Varint::Parse32WithLimit(compressed, ip_limit,
+                                                    &ulength);
+  if (tags == NULL) {
+    return false;
+  }
+
+  // First walk the tags and collect the possible cuts: tag boundaries at
+  // block boundaries of the output, where no later copy reaches back past
+  // the cut. "cut_output" and "cut_input" hold the output position and the
+  // position of the tag at each of the first "num_cuts" of them. There is
+  // at most one per block of the output.
+  Allocator* const allocator = GetAllocator();
+  const size_t max_cuts = ulength / kBlockSize;
+  size_t* cut_output = NULL;
+  const char** cut_input = NULL;
+  if (max_cuts > 0) {
+    cut_output = AllocateArray<size_t>(allocator, max_cuts);
+    cut_input = AllocateArray<const char*>(allocator, max_cuts);
+  }
+  size_t num_cuts = 0;
+  const bool valid = FindCuts(tags, ip_limit, ulength, cut_output, cut_input,
+                              &num_cuts);
+
+  // Then cut as soon as a part is long enough.
+  const char* part_start = tags;
+  size_t part_output_start = 0;
+  for (size_t i = 0; valid && i <= num_cuts; ++i) {
+    const bool last = (i == num_cuts);
+    const size_t output_end = last ? ulength : cut_output[i];
+    if (!last && output_end - part_output_start < min_part_length) {
+      continue;
+    }
+    const char* input_end = last ? ip_limit : cut_input[i];
+    parts->push_back(string());
+    string* part = &parts->back();
+    Varint::Append32(part, output_end - part_output_start);
+    part->append(part_start, input_end - part_start);
+    part_start = input_end;
+    part_output_start = output_end;
+  }
+  DeallocateArray(allocator, cut_output, max_cuts);
+  DeallocateArray(allocator, cut_input, max_cuts);
+  return valid;
+}
+
+// -----------------------------------------------------------------------
+// Compressed-domain search
+// -----------------------------------------------------------------------
+
+// Appends "base + i" to "*hits" for every occurrence of "pattern" at
+// "data[i]" with i + pattern_length <= n.
+static void FindAllIn(const char* data, size_t n,
+                      const char* pattern, size_t pattern_length,
+                      size_t base, std::vector<size_t>* hits) {
+  if (n < pattern_length) {
+    return;
+  }
+  const char* p = data;
+  const char* last = data + n - pattern_length;
+  if (last - p < 16) {
+    // Not worth calling memchr() for; this is the common case of checking
+    // the few positions around a tag boundary.
+    for (; p <= last; ++p) {
+      if (*p == pattern[0] &&
+          memcmp(p + 1, pattern + 1, pattern_length - 1) == 0) {
+        hits->push_back(base + (p - data));
+      }
+    }
+    return;
+  }
+  while (p <= last) {
+    p = static_cast<const char*>(memchr(p, pattern[0], last - p + 1));
+    if (p == NULL) {
+      return;
+    }
+    if (memcmp(p + 1, pattern + 1, pattern_length - 1) == 0) {
+      hits->push_back(base + (p - data));
+    }
+    ++p;
+  }
+}
+
+namespace {
+
+// The recent output of the stream being searched by FindInCompressed(),
+// which copies are resolved against.
+class SearchWindow {
+ public:
+  // Keeps at least "history" bytes of output.
+  explicit SearchWindow(size_t history)
+      : allocator_(GetAllocator()),
+        history_(history),
+        capacity_(2 * history),
+        buffer_(AllocateArray<char>(allocator_, capacity_ + kSlopBytes)),
+        start_(0),
+        length_(0) {
+  }
+
+  ~SearchWindow() {
+    DeallocateArray(allocator_, buffer_, capacity_ + kSlopBytes);
+  }
+
+  // Output position of the first byte held.
+  size_t start() const { return start_; }
+  // Output position just after the last byte held.
+  size_t end() const { return start_ + length_; }
+  // The byte at output position "pos", which must be held.
+  const char* at(size_t pos) const { return buffer_ + (pos - start_); }
+
+  // The most that may be appended at once.
+  size_t max_append() const { return capacity_ - history_; }
+
+  // Whether appending "len" bytes will drop bytes from the front.
+  bool WouldSlide(size_t len) const { return length_ + len > capacity_; }
+
+  // REQUIRES: "literal" can be read 16 bytes beyond "len".
+  void AppendLiteral(const char* literal, size_t len) {
+    assert(len <= max_append());
+    MakeRoom(len);
+    char* op = Tail();
+    if (len <= 16) {
+      UnalignedCopy64(literal, op);
+      UnalignedCopy64(literal + 8, op + 8);
+    } else {
+      memcpy(op, literal, len);
+    }
+    length_ += len;
+  }
+
+  // Drops bytes from the front if appending "len" bytes needs the room.
+  void MakeRoom(size_t len) {
+    if (WouldSlide(len)) {
+      const size_t drop = length_ - history_;
+      memmove(buffer_, buffer_ + drop, history_);
+      start_ += drop;
+      length_ = history_;
+    }
+  }
+
+  // REQUIRES: "offset" bytes of history are held, even after MakeRoom(len).
+  void AppendCopy(size_t offset, size_t len) {
+    assert(len <= max_append());
+    MakeRoom(len);
+    char* op = Tail();
+    if (len <= 16 && offset >= 8) {
+      UnalignedCopy64(op - offset, op);
+      UnalignedCopy64(op - offset + 8, op + 8);
+    } else {
+      IncrementalCopyFastPath(op - offset, op, len);
+    }
+    length_ += len;
+  }
+
+ private:
+  // The fast paths above may write this far past the appended bytes.
+  static const size_t kSlopBytes = 16 + kMaxIncrementCopyOverflow;
+
+  char* Tail() { return buffer_ + length_; }
+
+  Allocator* const allocator_;
+  const size_t history_;
+  const size_t capacity_;
+  char* const buffer_;
+  size_t start_;
+  size_t length_;
+
+  DISALLOW_COPY_AND_ASSIGN(SearchWindow);
+};
+
+}  // namespace
+
+// Decides all start positions in ["*unchecked", "end" - "pattern_length"]
+// by scanning the window; they must still be held by it.
+static inline void SearchWindowUpTo(const SearchWindow& window, size_t end,
+                                    const char* pattern, size_t pattern_length,
+                                    size_t* unchecked,
+                                    std::vector<size_t>* offsets) {
+  if (end >= *unchecked + pattern_length) {
+    FindAllIn(window.at(*unchecked), end - *unchecked, pattern,
+              pattern_length, *unchecked, offsets);
+    *unchecked = end - pattern_length + 1;
+  }
+}
+
+bool FindInCompressed(const char* compressed, size_t compressed_length,
+                      const char* pattern, size_t pattern_length,
+                      std::vector<size_t>* offsets) {
+  offsets->clear();
+  if (pattern_length == 0) {
+    return IsValidCompressedBuffer(compressed, compressed_length);
+  }
+  const char* ip_limit = compressed + compressed_length;
+  uint32 ulength;
+  const char* ip = Varint::Parse32WithLimit(compressed, ip_limit, &ulength);
+  if (ip == NULL) {
+    return false;
+  }
+  const size_t m = pattern_length;
+
+  // The bytes produced by a copy repeat earlier output, so occurrences that
+  // lie entirely within a copy are derived from the occurrences already
+  // found in its source. Everything else is scanned for in the window, in
+  // as few and as long runs as possible: start positions from "unchecked"
+  // on are decided only when a copy needs them, when they are about to
+  // leave the window, or at the end.
+  //
+  // The window covers the reach of copies from Compress(), plus enough to
+  // match across a tag boundary. Other streams may copy from further back;
+  // those fall back to decompressing everything.
+  SearchWindow window(kBlockSize + m);
+  size_t unchecked = 0;
+  size_t produced = 0;
+  bool too_far_back = false;
+  while (ip < ip_limit) {
+    const unsigned char c = *(reinterpret_cast<const unsigned char*>(ip++));
+    if ((c & 0x3) == LITERAL) {
+      size_t literal_length = (c >> 2) + 1u;
+      if (literal_length >= 61) {
+        const size_t literal_length_length = literal_length - 60;
+        if (static_cast<size_t>(ip_limit - ip) < literal_length_length) {
+          return false;
+        }
+        literal_length = LoadTrailer(ip, ip_limit, literal_length_length) + 1;
+        ip += literal_length_length;
+      }
+      if (static_cast<size_t>(ip_limit - ip) < literal_length ||
+          ulength - produced < literal_length) {
+        return false;
+      }
+      while (literal_length > 0) {
+        const size_t n = min(literal_length, window.max_append());
+        if (window.WouldSlide(n)) {
+          SearchWindowUpTo(window, produced, pattern, m, &unchecked, offsets);
+        }
+        if (n <= 16 && ip_limit - ip < 16) {
+          // Too close to the end to read ahead; go through a copy.
+          char tail[16] = { 0 };
+          memcpy(tail, ip, n);
+          window.AppendLiteral(tail, n);
+        } else {
+          window.AppendLiteral(ip, n);
+        }
+        ip += n;
+        literal_length -= n;
+        produced += n;
+      }
+    } else {
+      const uint32 entry = char_table[c];
+      const size_t trailer_length = entry >> 11;
+      if (static_cast<size_t>(ip_limit - ip) < trailer_length) {
+        return false;
+      }
+      const size_t offset =
+          (entry & 0x700) + LoadTrailer(ip, ip_limit, trailer_length);
+      const size_t length = entry & 0xff;
+      ip += trailer_length;
+      if (produced <= offset - 1u || ulength - produced < length) {
+        return false;
+      }
+      if (window.WouldSlide(length)) {
+        SearchWindowUpTo(window, produced, pattern, m, &unchecked, offsets);
+        window.MakeRoom(length);
+      }
+      // Checked after sliding, against the history that is left.
+      if (produced - offset < window.start()) {
+        too_far_back = true;
+        break;
+      }
+      const size_t q = produced;
+      window.AppendCopy(offset, length);
+      produced += length;
+      if (length < m) {
+        continue;  // Nothing to derive; scan it along with the rest.
+      }
+
+      // Decide everything up to the copy, including occurrences that
+      // straddle its start, then derive the ones inside it: they mirror
+      // those "offset" bytes before them, which may themselves be inside
+      // the copy if it overlaps its source. "offsets" is sorted and grows
+      // while we walk it.
+      SearchWindowUpTo(window, q - 1 + m, pattern, m, &unchecked, offsets);
+      assert(unchecked == q);
+      const size_t last_start = produced - m;
+      std::vector<size_t>::iterator it = std::lower_bound(
+          offsets->begin(), offsets->end(), q - offset);
+      for (size_t i = it - offsets->begin();
+           i < offsets->size() && (*offsets)[i] + offset <= last_start;
+           ++i) {
+        offsets->push_back((*offsets)[i] + offset);
+      }
+      unchecked = last_start + 1;
+    }
+  }
+
+  if (too_far_back) {
+    // A copy reached back further than the window; search the old way.
+    string uncompressed;
+    if (!Uncompress(compressed, compressed_length, &uncompressed)) {
+      return false;
+    }
+    offsets->clear();
+    FindAllIn(uncompressed.data(), uncompressed.size(), pattern, m, 0,
+              offsets);
+    return true;
+  }
+  if (produced != ulength) {
+    return false;
+  }
+  SearchWindowUpTo(window, produced, pattern, m, &unchecked, offsets);
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// Session compression
+// -----------------------------------------------------------------------
+
+// The amount of earlier data that messages of a session can refer to. This
+// is also the largest offset a two-byte copy can express.
+static const size_t kSessionHistorySize = kBlockSize;
+
+// Both ends of a session keep the history followed by the current message
+// in one buffer of this size, which is moved down when it fills up.
+static const size_t kSessionBufferSize = kSessionHistorySize + 4 * kBlockSize;
+
+static const int kSessionHashTableBits = kMaxHashTableBits;
+
+// Like internal::CompressFragment(), but "input[0..input_size-1]" is
+// preceded by earlier data in "base[0..input-base-1]" that copies may
+// refer to, as long as their offset is below kSessionHistorySize.
+// "table" maps hashes to positions relative to "base" and is kept from one
+// call to the next, so that it remembers the earlier data.
+static char* CompressFragmentWithHistory(const char* base,
+                                         const char* input,
+                                         size_t input_size,
+                                         char* op,
+                                         uint32* table) {
+  assert(input_size <= kBlockSize);
+  const int shift = 32 - kSessionHashTableBits;
+  const char* ip = input;
+  const char* ip_end = input + input_size;
+  const char* next_emit = ip;
+
+  const size_t kInputMarginBytes = 15;
+  if (PREDICT_TRUE(input_size >= kInputMarginBytes)) {
+    const char* ip_limit = ip_end - kInputMarginBytes;
+
+    for (;;) {
+      // Look for a 4-byte match, skipping ahead faster the longer we go
+      // without one, as in CompressFragment().
+      uint32 skip = 32;
+      const char* candidate;
+      for (;;) {
+        const uint32 hash = Hash(ip, shift);
+        candidate = base + table[hash];
+        table[hash] = ip - base;
+        if (candidate < ip &&
+            static_cast<size_t>(ip - candidate) < kSessionHistorySize &&
+            UNALIGNED_LOAD32(ip) == UNALIGNED_LOAD32(candidate)) {
+          break;
+        }
+        ip += skip++ >> 5;
+        if (PREDICT_FALSE(ip > ip_limit)) {
+          goto emit_remainder;
+        }
+      }
+
+      // Unlike in CompressFragment(), the very first position can match.
+      if (ip > next_emit) {
+        assert(next_emit + 16 <= ip_end);
+        op = EmitLiteral(op, next_emit, ip - next_emit, true);
+      }
+
+      // Emit copies for as long as the input right after the last one
+      // matches something too.
+      do {
+        const char* match_start = ip;
+        const int matched = 4 + internal::FindMatchLength(candidate + 4,
+                                                          ip + 4, ip_end);
+        ip += matched;
+        op = EmitCopy(op, match_start - candidate, matched);
+        next_emit = ip;
+        if (PREDICT_FALSE(ip >= ip_limit)) {
+          goto emit_remainder;
+        }
+        table[Hash(ip - 1, shift)] = ip - base - 1;
+        const uint32 hash = Hash(ip, shift);
+        candidate = base + table[hash];
+        table[hash] = ip - base;
+      } while (candidate < ip &&
+               static_cast<size_t>(ip - candidate) < kSessionHistorySize &&
+               UNALIGNED_LOAD32(ip) == UNALIGNED_LOAD32(candidate));
+      ++ip;
+    }
+  }
+
+ emit_remainder:
+  if (next_emit < ip_end) {
+    op = EmitLiteral(op, next_emit, ip_end - next_emit, false);
+  }
+  return op;
+}
+
+// Makes room for at least "n" more bytes after the "*used" bytes in
+// "*buffer" (of "*capacity" bytes), keeping the last kSessionHistorySize
+// bytes as history. Returns by how much the data was moved down.
+static size_t MakeRoomInSessionBuffer(Allocator* allocator, size_t n,
+                                      char** buffer, size_t* used,
+                                      size_t* capacity) {
+  size_t moved = 0;
+  if (*used + n > *capacity && *used > kSessionHistorySize) {
+    moved = *used - kSessionHistorySize;
+    memmove(*buffer, *buffer + moved, kSessionHistorySize);
+    *used = kSessionHistorySize;
+  }
+  if (*used + n > *capacity) {
+    // Only for messages bigger than the buffer.
+    const size_t new_capacity = *used + n;
+    char* new_buffer = AllocateArray<char>(allocator, new_capacity);
+    memcpy(new_buffer, *buffer, *used);
+    DeallocateArray(allocator, *buffer, *capacity);
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+  }
+  return moved;
+}
+
+SessionCompressor::SessionCompressor()
+    : allocator_(GetAllocator()),
+      buffer_(AllocateArray<char>(allocator_, kSessionBufferSize)),
+      used_(0),
+      table_(AllocateArray<uint32>(allocator_, 1 << kSessionHashTableBits)) {
+  Reset();
+}
+
+SessionCompressor::~SessionCompressor() {
+  DeallocateArray(allocator_, buffer_, kSessionBufferSize);
+  DeallocateArray(allocator_, table_, 1 << kSessionHashTableBits);
+}
+
+void SessionCompressor::Reset() {
+  used_ = 0;
+  memset(table_, 0, sizeof(*table_) << kSessionHashTableBits);
+}
+
+size_t SessionCompressor::Compress(const char* input, size_t input_length,
+                                   string* output) {
+  output->resize(Varint::kMax32 + MaxCompressedLength(input_length));
+  char* const dest = string_as_array(output);
+  char* op = Varint::Encode32(dest, input_length);
+
+  size_t capacity = kSessionBufferSize;
+  while (input_length > 0) {
+    const size_t fragment_size = min(input_length, kBlockSize);
+    const size_t moved =
+        MakeRoomInSessionBuffer(allocator_, fragment_size, &buffer_, &used_,
+                                &capacity);
+    assert(capacity == kSessionBufferSize);
+    if (moved > 0) {
+      // Positions that fell out of the buffer become 0, which is never a
+      // match within kSessionHistorySize of the current position.
+      for (int i = 0; i < (1 << kSessionHashTableBits); ++i) {
+        table_[i] = table_[i] >= moved ? table_[i] - moved : 0;
+      }
+    }
+    char* fragment = buffer_ + used_;
+    memcpy(fragment, input, fragment_size);
+    op = CompressFragmentWithHistory(buffer_, fragment, fragment_size, op,
+                                     table_);
+    used_ += fragment_size;
+    input += fragment_size;
+    input_length -= fragment_size;
+  }
+
+  output->resize(op - dest);
+  return op - dest;
+}
+
+SessionUncompressor::SessionUncompressor()
+    : allocator_(GetAllocator()),
+      buffer_(AllocateArray<char>(allocator_, kSessionBufferSize)),
+      used_(0),
+      capacity_(kSessionBufferSize) {
+}
+
+SessionUncompressor::~SessionUncompressor() {
+  DeallocateArray(allocator_, buffer_, capacity_);
+}
+
+void SessionUncompressor::Reset() {
+  used_ = 0;
+}
+
+bool SessionUncompressor::Uncompress(const char* compressed,
+                                     size_t compressed_length,
+                                     string* uncompressed) {
+  size_t ulength;
+  if (!GetUncompressedLength(compressed, compressed_length, &ulength)) {
+    return false;
+  }
+  if (ulength > uncompressed->max_size()) {
+    return false;
+  }
+  MakeRoomInSessionBuffer(allocator_, ulength, &buffer_, &used_, &capacity_);
+
+  // Decode right after the history, so that copies can refer to it.
+  ByteArraySource reader(compressed, compressed_length);
+  SnappyArrayWriter writer(buffer_, buffer_ + used_);
+  if (!InternalUncompress(&reader, &writer)) {
+    return false;
+  }
+  uncompressed->assign(buffer_ + used_, ulength);
+  used_ += ulength;
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// Delta compression
+// -----------------------------------------------------------------------
+
+// Copies that reach into the reference are usually far away, and cost five
+// bytes each; shorter matches are not worth it.
+static const int kMinFarCopyLength = 8;
+
+static const int kMinDeltaHashTableBits = 10;
+static const int kMaxDeltaHashTableBits = 20;
+
+// Emits a copy with a four-byte offset, which can reach anywhere.
+static inline char* EmitCopyWithFourByteOffset(char* op, size_t offset,
+                                               int len) {
+  assert(len >= 1);
+  assert(len <= 64);
+  *op++ = COPY_4_BYTE_OFFSET + ((len - 1) << 2);
+  LittleEndian::Store32(op, offset);
+  return op + 4;
+}
+
+// Like EmitCopy(), but for any offset that fits in 32 bits.
+static inline char* EmitFarCopy(char* op, size_t offset, int len) {
+  if (offset < 65536) {
+    return EmitCopy(op, offset, len);
+  }
+  while (len > 64) {
+    op = EmitCopyWithFourByteOffset(op, offset, 64);
+    len -= 64;
+  }
+  return EmitCopyWithFourByteOffset(op, offset, len);
+}
+
+// A Writer for DecompressAllTags() that treats "reference" as if it came
+// right before the output, so that copies can refer to it.
+class SnappyDeltaWriter {
+ private:
+  SnappyArrayWriter writer_;
+  const char* reference_end_;
+  size_t reference_length_;
+  size_t produced_;
+
+ public:
+  inline SnappyDeltaWriter(const char* reference, size_t reference_length,
+                           char* dst)
+      : writer_(dst),
+        reference_end_(reference + reference_length),
+        reference_length_(reference_length),
+        produced_(0) {
+  }
+
+  inline void SetExpectedLength(size_t len) {
+    writer_.SetExpectedLength(len);
+  }
+
+  inline bool CheckLength() const {
+    return writer_.CheckLength();
+  }
+
+  inline bool Append(const char* ip, size_t len) {
+    if (!writer_.Append(ip, len)) {
+      return false;
+    }
+    produced_ += len;
+    return true;
+  }
+
+  inline bool TryFastAppend(const char* ip, size_t available, size_t len) {
+    if (!writer_.TryFastAppend(ip, available, len)) {
+      return false;
+    }
+    produced_ += len;
+    return true;
+  }
+
+  inline bool AppendFromSelf(size_t offset, size_t len) {
+    if (PREDICT_TRUE(offset <= produced_)) {
+      // Also rejects offset == 0.
+      if (!writer_.AppendFromSelf(offset, len)) {
+        return false;
+      }
+    } else {
+      // The copy starts in the reference, and may run on into the output.
+      const size_t from_end = offset - produced_;
+      if (from_end > reference_length_) {
+        return false;
+      }
+      const size_t from_reference = min(len, from_end);
+      if (!writer_.Append(reference_end_ - from_end, from_reference)) {
+        return false;
+      }
+      if (len > from_reference &&
+          !writer_.AppendFromSelf(offset, len - from_reference)) {
+        return false;
+      }
+    }
+    produced_ += len;
+    return true;
+  }
+};
+
+bool DeltaCompress(const char* reference, size_t reference_length,
+                   const char* input, size_t input_length,
+                   string* output) {
+  if (input_length > kuint32max ||
+      reference_length > kuint32max - input_length) {
+    return false;
+  }
+
+  output->resize(MaxCompressedLength(input_length));
+  char* const dest = string_as_array(output);
+  char* op = Varint::Encode32(dest, input_length);
+
+  // Positions in the hash table are in the concatenation of reference and
+  // input, which is also what offsets count in.
+  int table_bits = kMinDeltaHashTableBits;
+  while (table_bits < kMaxDeltaHashTableBits &&
+         (static_cast<size_t>(1) << table_bits) <
+         reference_length + input_length) {
+    ++table_bits;
+  }
+  const int shift = 32 - table_bits;
+  Allocator* const allocator = GetAllocator();
+  uint32* table = AllocateArray<uint32>(allocator, 1 << table_bits);
+  memset(table, 0, sizeof(*table) << table_bits);
+
+  // Index all of the reference. Later positions overwrite earlier ones,
+  // which keeps a sample of the positions in big references.
+  if (reference_length >= 4) {
+    for (size_t i = 0; i + 4 <= reference_length; ++i) {
+      table[Hash(reference + i, shift)] = i;
+    }
+  }
+
+  const char* ip = input;
+  const char* ip_end = input + input_length;
+  const char* next_emit = ip;
+  const size_t kInputMarginBytes = 15;
+  if (input_length >= kInputMarginBytes) {
+    const char* ip_limit = ip_end - kInputMarginBytes;
+    uint32 skip = 32;
+    while (ip <= ip_limit) {
+      const size_t pos = reference_length + (ip - input);
+      const uint32 hash = Hash(ip, shift);
+      const size_t candidate_pos = table[hash];
+      table[hash] = pos;
+
+      // Find out how long the match is, if there is one. Matches in the
+      // reference must not run past its end.
+      int matched = 0;
+      if (candidate_pos < reference_length) {
+        const char* candidate = reference + candidate_pos;
+        if (reference_length - candidate_pos >= 4 &&
+            UNALIGNED_LOAD32(candidate) == UNALIGNED_LOAD32(ip)) {
+          const char* limit =
+              ip + min<size_t>(ip_end - ip, reference_length - candidate_pos);
+          matched = 4 + internal::FindMatchLength(candidate + 4, ip + 4,
+                                                  limit);
+        }
+      } else if (candidate_pos < pos) {
+        const char* candidate = input + (candidate_pos - reference_length);
+        if (UNALIGNED_LOAD32(candidate) == UNALIGNED_LOAD32(ip)) {
+          matched = 4 + internal::FindMatchLength(candidate + 4, ip + 4,
+                                                  ip_end);
+        }
+      }
+      const size_t offset = pos - candidate_pos;
+      if (matched < 4 || (offset >= 65536 && matched < kMinFarCopyLength)) {
+        ip += skip++ >> 5;
+        continue;
+      }
+
+      if (ip > next_emit) {
+        op = EmitLiteral(op, next_emit, ip - next_emit, true);
+      }
+      op = EmitFarCopy(op, offset, matched);
+      ip += matched;
+      next_emit = ip;
+      skip = 32;
+      if (ip <= ip_limit) {
+        table[Hash(ip - 1, shift)] = pos + matched - 1;
+      }
+    }
+  }
+  if (next_emit < ip_end) {
+    op = EmitLiteral(op, next_emit, ip_end - next_emit, false);
+  }
+
+  DeallocateArray(allocator, table, 1 << table_bits);
+  output->resize(op - dest);
+  return true;
+}
+
+bool DeltaUncompress(const char* reference, size_t reference_length,
+                     const char* compressed, size_t compressed_length,
+                     string* uncompressed) {
+  size_t ulength;
+  if (!GetUncompressedLength(compressed, compressed_length, &ulength)) {
+    return false;
+  }
+  if (ulength > uncompressed->max_size()) {
+    return false;
+  }
+  STLStringResizeUninitialized(uncompressed, ulength);
+  ByteArraySource reader(compressed, compressed_length);
+  SnappyDeltaWriter writer(reference, reference_length,
+                           string_as_array(uncompressed));
+  return InternalUncompress(&reader, &writer);
+}
+
+// -----------------------------------------------------------------------
+// Chained streams for large inputs
+// -----------------------------------------------------------------------
+
+// The uncompressed size of each chunk of a chained stream, except the last.
+static const size_t kLargeChunkSize = 16 * kBlockSize;
+
+namespace {
+
+// A Source that yields the first "limit" bytes of another one.
+class LimitedSource : public Source {
+ public:
+  LimitedSource(Source* source, size_t limit)
+      : source_(source),
+        limit_(limit) {
+  }
+  virtual ~LimitedSource() { }
+
+  virtual size_t Available() const {
+    return min(source_->Available(), limit_);
+  }
+
+  virtual const char* Peek(size_t* len) {
+    const char* result = source_->Peek(len);
+    *len = min(*len, limit_);
+    return result;
+  }
+
+  virtual void Skip(size_t n) {
+    assert(n <= limit_);
+    source_->Skip(n);
+    limit_ -= n;
+  }
+
+ private:
+  Source* source_;
+  size_t limit_;
+};
+
+}  // namespace
+
+// Reads "n" bytes from "*r" into "dest". Returns false if it runs out.
+static bool ReadFromSource(Source* r, char* dest, size_t n) {
+  if (r->Available() < n) {
+    return false;
+  }
+  while (n > 0) {
+    size_t fragment_size;
+    const char* fragment = r->Peek(&fragment_size);
+    if (fragment_size == 0) {
+      return false;  // Ended early after all.
+    }
+    const size_t len = min(n, fragment_size);
+    memcpy(dest, fragment, len);
+    r->Skip(len);
+    dest += len;
+    n -= len;
+  }
+  return true;
+}
+
+// Reads a varint of up to 64 bits from "*r" into "*result". Returns false
+// if the source ends first or the varint is malformed.
+static bool ReadVarint64(Source* r, uint64* result) {
+  uint64 value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (r->Available() == 0) {
+      return false;
+    }
+    size_t n;
+    const unsigned char c = *reinterpret_cast<const unsigned char*>(
+        r->Peek(&n));
+    r->Skip(1);
+    if (shift == 63 && c > 1) {
+      return false;
+    }
+    value |= static_cast<uint64>(c & 127) << shift;
+    if (c < 128) {
+      *result = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads the varint32 at the start of "*r" into "*result", with the rules of
+// Varint::Parse32WithLimit(). Returns false if there is none.
+static bool ReadVarint32(Source* r, uint32* result) {
+  char buf[Varint::kMax32];
+  size_t len = 0;
+  while (len < sizeof(buf)) {
+    if (r->Available() == 0) {
+      return false;
+    }
+    size_t n;
+    buf[len] = *r->Peek(&n);
+    r->Skip(1);
+    if (static_cast<unsigned char>(buf[len++]) < 128) {
+      break;
+    }
+  }
+  return Varint::Parse32WithLimit(buf, buf + len, result) != NULL;
+}
+
+size_t CompressLarge(Source* reader, Sink* writer) {
+  size_t written = 0;
+  uint64 N = reader->Available();
+  char header[Varint::kMax64];
+  char* p = Varint::Encode64(header, N);
+  writer->Append(header, p - header);
+  written += (p - header);
+
+  // Each chunk is an ordinary compressed stream, preceded by its length.
+  Allocator* const allocator = GetAllocator();
+  char* scratch = NULL;
+  size_t scratch_size = 0;
+  while (N > 0) {
+    const size_t chunk_size = min<uint64>(N, kLargeChunkSize);
+    if (scratch == NULL) {
+      // The first chunk is the biggest.
+      scratch_size = MaxCompressedLength(chunk_size);
+      scratch = AllocateArray<char>(allocator, scratch_size);
+    }
+    LimitedSource chunk(reader, chunk_size);
+    UncheckedByteArraySink chunk_writer(scratch);
+    const size_t chunk_length =
+        chunk.Available() < chunk_size ? 0 : Compress(&chunk, &chunk_writer);
+    if (chunk_length == 0) {
+      // The source ended early; see Compress().
+      written = 0;
+      break;
+    }
+    p = Varint::Encode32(header, chunk_length);
+    writer->Append(header, p - header);
+    writer->Append(scratch, chunk_length);
+    written += (p - header) + chunk_length;
+    N -= chunk_size;
+  }
+
+  DeallocateArray(allocator, scratch, scratch_size);
+  return written;
+}
+
+bool UncompressLarge(Source* compressed, Sink* uncompressed) {
+  uint64 N;
+  if (!ReadVarint64(compressed, &N)) {
+    return false;
+  }
+
+  const size_t max_chunk_length = MaxCompressedLength(kLargeChunkSize);
+  Allocator* const allocator = GetAllocator();
+  char* input_scratch = NULL;
+  char* output_scratch = NULL;
+  size_t output_scratch_size = 0;
+  bool success = true;
+  while (N > 0) {
+    uint64 chunk_length;
+    if (!ReadVarint64(compressed, &chunk_length) ||
+        chunk_length > max_chunk_length ||
+        chunk_length > compressed->Available()) {
+      success = false;
+      break;
+    }
+    const size_t chunk_size = min<uint64>(N, kLargeChunkSize);
+
+    // Get the chunk in one piece, without copying if possible.
+    size_t fragment_size;
+    const char* chunk = compressed->Peek(&fragment_size);
+    size_t pending_advance = 0;
+    if (fragment_size >= chunk_length) {
+      pending_advance = chunk_length;
+    } else {
+      if (input_scratch == NULL) {
+        input_scratch = AllocateArray<char>(allocator, max_chunk_length);
+      }
+      if (!ReadFromSource(compressed, input_scratch, chunk_length)) {
+        success = false;
+        break;
+      }
+      chunk = input_scratch;
+    }
+
+    size_t ulength;
+    if (!GetUncompressedLength(chunk, chunk_length, &ulength) ||
+        ulength != chunk_size) {
+      success = false;
+      break;
+    }
+    if (output_scratch == NULL) {
+      // The first chunk is the biggest.
+      output_scratch_size = chunk_size;
+      output_scratch = AllocateArray<char>(allocator, output_scratch_size);
+    }
+    char* dest = uncompressed->GetAppendBuffer(chunk_size, output_scratch);
+    if (!RawUncompress(chunk, chunk_length, dest)) {
+      success = false;
+      break;
+    }
+    uncompressed->Append(dest, chunk_size);
+    compressed->Skip(pending_advance);
+    N -= chunk_size;
+  }
+
+  DeallocateArray(allocator, input_scratch, max_chunk_length);
+  DeallocateArray(allocator, output_scratch, output_scratch_size);
+  return success;
+}
+
+bool GetLargeUncompressedLength(Source* source, size_t* result) {
+  uint64 length;
+  if (!ReadVarint64(source, &length) ||
+      length > static_cast<size_t>(-1)) {
+    return false;
+  }
+  *result = length;
+  return true;
+}
+
+bool GetLargeUncompressedLength(const char* compressed,
+                                size_t compressed_length, size_t* result) {
+  ByteArraySource reader(compressed, compressed_length);
+  return GetLargeUncompressedLength(&reader, result);
+}
+
+// -----------------------------------------------------------------------
+// Lazy decompression
+// -----------------------------------------------------------------------
+
+// UncompressingSource keeps this much earlier output for copies to refer to,
+// which is as far as copies from Compress() reach.
+static const size_t kUncompressingSourceHistory = kBlockSize;
+
+// ... and decompresses up to this much output ahead of the reader.
+static const size_t kUncompressingSourceLookahead = kBlockSize;
+
+// The copy fast paths may write this far past the end of the output.
+static const size_t kUncompressingSourceSlop = 16 + kMaxIncrementCopyOverflow;
+
+static const size_t kUncompressingSourceBufferSize =
+    kUncompressingSourceHistory + kUncompressingSourceLookahead +
+    kUncompressingSourceSlop;
+
+UncompressingSource::UncompressingSource(Source* compressed)
+    : allocator_(GetAllocator()),
+      compressed_(compressed),
+      buffer_(AllocateArray<char>(allocator_,
+                                  kUncompressingSourceBufferSize)),
+      start_(0),
+      end_(0),
+      remaining_(0),
+      pending_literal_(0),
+      ok_(true) {
+  uint32 length;
+  if (ReadVarint32(compressed, &length)) {
+    remaining_ = length;
+  } else {
+    ok_ = false;
+  }
+}
+
+UncompressingSource::~UncompressingSource() {
+  DeallocateArray(allocator_, buffer_, kUncompressingSourceBufferSize);
+}
+
+size_t UncompressingSource::Available() const {
+  return (end_ - start_) + remaining_;
+}
+
+const char* UncompressingSource::Peek(size_t* len) {
+  if (start_ == end_ && remaining_ > 0) {
+    Refill();
+  }
+  *len = end_ - start_;
+  return buffer_ + start_;
+}
+
+void UncompressingSource::Skip(size_t n) {
+  assert(n <= Available());
+  for (;;) {
+    const size_t len = min(n, end_ - start_);
+    start_ += len;
+    n -= len;
+    if (n == 0 || remaining_ == 0) {
+      break;
+    }
+    Refill();
+  }
+}
+
+void UncompressingSource::Refill() {
+  assert(start_ == end_);
+  if (end_ > kUncompressingSourceHistory) {
+    // Everything has been read; keep only what copies may refer to.
+    memmove(buffer_, buffer_ + end_ - kUncompressingSourceHistory,
+            kUncompressingSourceHistory);
+    start_ = end_ = kUncompressingSourceHistory;
+  }
+  if (!DecodeTags() || start_ == end_) {
+    // The compressed data is corrupted or truncated. What was decoded up to
+    // here can still be read.
+    ok_ = false;
+    remaining_ = 0;
+  }
+}
+
+// Skips the consumed part of "*fragment" in "*r", and sets "*fragment",
+// "*ip" and "*ip_limit" to the next one. It is empty at the end.
+static inline void NextFragment(Source* r, const char** fragment,
+                                const char** ip, const char** ip_limit) {
+  r->Skip(*ip - *fragment);
+  size_t fragment_size;
+  *fragment = *ip = r->Peek(&fragment_size);
+  *ip_limit = *ip + min(fragment_size, r->Available());
+}
+
+bool UncompressingSource::DecodeTags() {
+  // Decode tags until the lookahead is full. The only decoder state kept
+  // between calls is the part of a literal that did not fit.
+  const size_t limit = kUncompressingSourceHistory +
+                       kUncompressingSourceLookahead;
+  const char* fragment = NULL;
+  const char* ip = NULL;
+  const char* ip_limit = NULL;
+  NextFragment(compressed_, &fragment, &ip, &ip_limit);
+  bool success = true;
+  while (remaining_ > 0) {
+    if (pending_literal_ > 0) {
+      size_t len = min(pending_literal_, limit - end_);
+      if (len == 0) {
+        break;
+      }
+      if (ip == ip_limit) {
+        NextFragment(compressed_, &fragment, &ip, &ip_limit);
+        if (ip == ip_limit) {
+          success = false;
+          break;
+        }
+      }
+      len = min<size_t>(len, ip_limit - ip);
+      memcpy(buffer_ + end_, ip, len);
+      ip += len;
+      end_ += len;
+      remaining_ -= len;
+      pending_literal_ -= len;
+      continue;
+    }
+    if (limit - end_ < 64) {
+      // Might not have room for a copy.
+      break;
+    }
+
+    // Decode the tag in place, unless it may straddle two fragments.
+    char tag_scratch[kMaximumTagLength];
+    const char* tag = ip;
+    if (ip_limit - ip < kMaximumTagLength) {
+      compressed_->Skip(ip - fragment);
+      fragment = ip = NULL;
+      if (!ReadFromSource(compressed_, tag_scratch, 1) ||
+          !ReadFromSource(compressed_, tag_scratch + 1,
+                          char_table[static_cast<uint8>(tag_scratch[0])] >>
+                          11)) {
+        success = false;
+        break;
+      }
+      tag = tag_scratch;
+      NextFragment(compressed_, &fragment, &ip, &ip_limit);
+    }
+    const unsigned char c = static_cast<unsigned char>(tag[0]);
+    const uint32 entry = char_table[c];
+    const size_t trailer_length = entry >> 11;
+    const uint32 trailer = LittleEndian::Load32(tag + 1) &
+                           wordmask[trailer_length];
+    if (tag == ip) {
+      ip += 1 + trailer_length;
+    }
+
+    if ((c & 0x3) == LITERAL) {
+      size_t literal_length = (c >> 2) + 1u;
+      if (literal_length >= 61) {
+        literal_length = trailer + 1;
+      }
+      if (literal_length > remaining_) {
+        success = false;
+        break;
+      }
+      pending_literal_ = literal_length;
+    } else {
+      const size_t offset = (entry & 0x700) + trailer;
+      const size_t length = entry & 0xff;
+      // Only the buffered history can be copied from; a longer offset is
+      // either corrupt or beyond what Compress() produces.
+      if (offset == 0 || offset > end_ || length > remaining_) {
+        success = false;
+        break;
+      }
+      char* op = buffer_ + end_;
+      if (length <= 16 && offset >= 8) {
+        UnalignedCopy64(op - offset, op);
+        UnalignedCopy64(op - offset + 8, op + 8);
+      } else {
+        IncrementalCopyFastPath(op - offset, op, length);
+      }
+      end_ += length;
+      remaining_ -= length;
+    }
+  }
+  if (fragment != NULL) {
+    compressed_->Skip(ip - fragment);
+  }
+  return success;
+}
+
+// -----------------------------------------------------------------------
+// Lazy compression
+// -----------------------------------------------------------------------
+
+CompressingSource::CompressingSource(Source* uncompressed)
+    : allocator_(GetAllocator()),
+      uncompressed_(uncompressed),
+      wmem_(new (AllocateArray<internal::WorkingMemory>(allocator_, 1))
+            internal::WorkingMemory),
+      scratch_(NULL),
+      output_(AllocateArray<char>(allocator_,
+                                  MaxCompressedLength(kBlockSize))),
+      start_(0),
+      end_(0),
+      remaining_(uncompressed->Available()),
+      ok_(true) {
+  // The first block is compressed only once the header has been read.
+  char* p = Varint::Encode32(output_, remaining_);
+  end_ = p - output_;
+}
+
+CompressingSource::~CompressingSource() {
+  wmem_->~WorkingMemory();
+  DeallocateArray(allocator_, wmem_, 1);
+  DeallocateArray(allocator_, scratch_, kBlockSize);
+  DeallocateArray(allocator_, output_, MaxCompressedLength(kBlockSize));
+}
+
+size_t CompressingSource::Available() const {
+  return end_ - start_;
+}
+
+const char* CompressingSource::Peek(size_t* len) {
+  *len = end_ - start_;
+  return output_ + start_;
+}
+
+void CompressingSource::Skip(size_t n) {
+  assert(n <= Available());
+  start_ += n;
+  if (start_ == end_) {
+    // Keep a block ready, so Available() is nonzero until the end.
+    Refill();
+  }
+}
+
+void CompressingSource::Refill() {
+  assert(start_ == end_);
+  start_ = end_ = 0;
+  if (remaining_ == 0) {
+    return;
+  }
+  const size_t num_to_read = min(remaining_, kBlockSize);
+  size_t fragment_size;
+  const char* fragment = uncompressed_->Peek(&fragment_size);
+  if (fragment_size >= num_to_read) {
+    // Compress straight from the source.
+    end_ = CompressBlock(fragment, num_to_read, output_, wmem_) - output_;
+    uncompressed_->Skip(num_to_read);
+  } else {
+    if (scratch_ == NULL) {
+      scratch_ = AllocateArray<char>(allocator_, kBlockSize);
+    }
+    size_t bytes_read = 0;
+    while (bytes_read < num_to_read) {
+      fragment = uncompressed_->Peek(&fragment_size);
+      if (fragment_size == 0) {
+        // The source ended early. End this one too, rather than compress
+        // a block of data that was never supplied.
+        remaining_ = 0;
+        ok_ = false;
+        return;
+      }
+      const size_t n = min(fragment_size, num_to_read - bytes_read);
+      memcpy(scratch_ + bytes_read, fragment, n);
+      uncompressed_->Skip(n);
+      bytes_read += n;
+    }
+    end_ = CompressBlock(scratch_, num_to_read, output_, wmem_) - output_;
+  }
+  remaining_ -= num_to_read;
+}
+
+// -----------------------------------------------------------------------
+// Arena allocation
+// -----------------------------------------------------------------------
+
+// Allocations are rounded up to this, which suits any type.
+static const size_t kArenaAlignment = 16;
+
+// Returns the bytes an arena hands out for "size". A size of 0 still takes
+// kArenaAlignment, so that each allocation is a distinct non-NULL pointer.
+static inline size_t ArenaAllocationSize(size_t size) {
+  if (size == 0) {
+    return kArenaAlignment;
+  }
+  return (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+}
+
+ArenaAllocator::ArenaAllocator(size_t block_size)
+    : block_size_(block_size),
+      ptr_(NULL),
+      limit_(NULL),
+      memory_usage_(0) {
+}
+
+ArenaAllocator::~ArenaAllocator() {
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    ::operator delete(blocks_[i].first);
+  }
+}
+
+void* ArenaAllocator::Allocate(size_t size) {
+  size = ArenaAllocationSize(size);
+  if (PREDICT_FALSE(size > static_cast<size_t>(limit_ - ptr_))) {
+    NewBlock(size);
+  }
+  char* result = ptr_;
+  ptr_ += size;
+  return result;
+}
+
+void ArenaAllocator::Deallocate(void* ptr, size_t size) {
+  size = ArenaAllocationSize(size);
+  if (static_cast<char*>(ptr) + size == ptr_) {
+    ptr_ = static_cast<char*>(ptr);
+  }
+}
+
+void ArenaAllocator::Reset() {
+  if (blocks_.empty()) {
+    return;
+  }
+  for (size_t i = 1; i < blocks_.size(); ++i) {
+    ::operator delete(blocks_[i].first);
+  }
+  blocks_.resize(1);
+  ptr_ = blocks_[0].first;
+  limit_ = ptr_ + blocks_[0].second;
+  memory_usage_ = blocks_[0].second;
+}
+
+void ArenaAllocator::NewBlock(size_t size) {
+  // Operator new returns memory aligned for any type.
+  const size_t block_size = max(size, block_size_);
+  char* block = static_cast<char*>(::operator new(block_size));
+  blocks_.push_back(std::make_pair(block, block_size));
+  ptr_ = block;
+  limit_ = block + block_size;
+  memory_usage_ += block_size;
+}
+
+// -----------------------------------------------------------------------
+// Huge pages
+// -----------------------------------------------------------------------
+
+static const size_t kHugePageSize = 2 << 20;
+
+static inline size_t RoundUpToHugePage(size_t size) {
+  return (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+HugePageAllocator::HugePageAllocator(size_t min_size)
+    : min_size_(max<size_t>(min_size, 1)) {
+}
+
+HugePageAllocator::~HugePageAllocator() { }
+
+void* HugePageAllocator::Allocate(size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+  if (size >= min_size_) {
+    const size_t length = RoundUpToHugePage(size);
+#ifdef MAP_HUGETLB
+    void* pool = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (pool != MAP_FAILED) {
+      return pool;
+    }
+#endif
+    // Transparent huge pages need 2 MiB alignment; map a huge page more
+    // than needed, and cut off the ends.
+    void* mapping = mmap(NULL, length + kHugePageSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    char* const start = static_cast<char*>(mapping);
+    char* const aligned = reinterpret_cast<char*>(
+        RoundUpToHugePage(reinterpret_cast<uintptr_t>(start)));
+    if (aligned > start) {
+      munmap(start, aligned - start);
+    }
+    if (start + kHugePageSize > aligned) {
+      munmap(aligned + length, start + kHugePageSize - aligned);
+    }
+    AdviseHugePages(aligned, length);
+    return aligned;
+  }
+#endif
+  return ::operator new(size);
+}
+
+void HugePageAllocator::Deallocate(void* ptr, size_t size) {
+#ifdef HAVE_SYS_MMAN_H
+  if (size >= min_size_) {
+    munmap(ptr, RoundUpToHugePage(size));
+    return;
+  }
+#endif
+  ::operator delete(ptr);
+}
+
+void AdviseHugePages(const void* data, size_t size) {
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_HUGEPAGE)
+  const uintptr_t start = reinterpret_cast<uintptr_t>(data);
+  const uintptr_t begin = RoundUpToHugePage(start);
+  const uintptr_t end = (start + size) & ~(kHugePageSize - 1);
+  if (begin < end) {
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+// -----------------------------------------------------------------------
+// Parallel compression
+// -----------------------------------------------------------------------
+
+// ParallelCompress() hands out this many blocks per task, so that a task is
+// long enough to be worth scheduling.
+static const size_t kParallelBlocksPerTask = kLargeChunkSize / kBlockSize;
+
+namespace {
+
+// Compresses the tasks' pieces of the input into fixed-size slots of one
+// output buffer, each after Varint::kMax32 bytes of room for a length
+// prefix, and records their compressed lengths.
+class ParallelCompressLoop : public Executor::Loop {
+ public:
+  ParallelCompressLoop(const char* input, size_t input_length,
+                       size_t task_size, bool large,
+                       char* slots, size_t slot_size, size_t* lengths)
+      : input_(input), input_length_(input_length), task_size_(task_size),
+        large_(large), slots_(slots), slot_size_(slot_size),
+        lengths_(lengths) { }
+
+  virtual void Run(size_t i) {
+    const char* piece = input_ + i * task_size_;
+    const size_t piece_size = min(task_size_, input_length_ - i * task_size_);
+    char* dest = slots_ + i * slot_size_ + Varint::kMax32;
+    if (large_) {
+      RawCompress(piece, piece_size, dest, &lengths_[i]);
+      return;
+    }
+    // The blocks of an ordinary stream, without its length.
+    internal::WorkingMemory wmem;
+    char* op = dest;
+    for (size_t pos = 0; pos < piece_size; pos += kBlockSize) {
+      op = CompressBlock(piece + pos, min(kBlockSize, piece_size - pos), op,
+                         &wmem);
+    }
+    lengths_[i] = op - dest;
+  }
+
+ private:
+  const char* input_;
+  size_t input_length_;
+  size_t task_size_;
+  bool large_;
+  char* slots_;
+  size_t slot_size_;
+  size_t* lengths_;
+};
+
+}  // namespace
+
+// Compresses "input" in kLargeChunkSize pieces on "executor", straight into
+// "*compressed", then closes the gaps between the pieces. With "large",
+// the output is that of CompressLarge(), otherwise that of Compress().
+static size_t ParallelCompressPieces(const char* input, size_t input_length,
+                                     bool large, string* compressed,
+                                     Executor* executor) {
+  if (executor == NULL) {
+    executor = DefaultExecutor();
+  }
+  const size_t num_tasks =
+      (input_length + kLargeChunkSize - 1) / kLargeChunkSize;
+  const size_t slot_size = Varint::kMax32 + (large ?
+      MaxCompressedLength(kLargeChunkSize) :
+      kParallelBlocksPerTask * MaxCompressedLength(kBlockSize));
+  STLStringResizeUninitialized(compressed,
+                               Varint::kMax64 + num_tasks * slot_size);
+  char* const base = string_as_array(compressed);
+  char* const slots = base + Varint::kMax64;
+
+  Allocator* const allocator = GetAllocator();
+  size_t* const lengths = num_tasks == 0 ? NULL :
+      AllocateArray<size_t>(allocator, num_tasks);
+  ParallelCompressLoop loop(input, input_length, kLargeChunkSize, large,
+                            slots, slot_size, lengths);
+  executor->ParallelFor(num_tasks, &loop);
+
+  // Each slot is at least as big as what goes into it, so the output
+  // never overtakes the data still to be moved.
+  char* op = large ? Varint::Encode64(base, input_length) :
+      Varint::Encode32(base, input_length);
+  for (size_t i = 0; i < num_tasks; ++i) {
+    if (large) {
+      op = Varint::Encode32(op, lengths[i]);
+    }
+    memmove(op, slots + i * slot_size + Varint::kMax32, lengths[i]);
+    op += lengths[i];
+  }
+  DeallocateArray(allocator, lengths, num_tasks);
+  compressed->resize(op - base);
+  return op - base;
+}
+
+size_t ParallelCompress(const char* input, size_t input_length,
+                        string* compressed, Executor* executor) {
+  return ParallelCompressPieces(input, input_length, false, compressed,
+                                executor);
+}
+
+size_t ParallelCompressLarge(const char* input, size_t input_length,
+                             string* compressed, Executor* executor) {
+  return ParallelCompressPieces(input, input_length, true, compressed,
+                                executor);
+}
+
+namespace {
+
+// One chunk of a CompressLarge() stream, and where it decompresses to.
+struct LargeChunk {
+  const char* compressed;
+  size_t compressed_length;
+  size_t offset;
+};
+
+class ParallelUncompressLoop : public Executor::Loop {
+ public:
+  ParallelUncompressLoop(const LargeChunk* chunks, char* uncompressed,
+                         char* ok)
+      : chunks_(chunks), uncompressed_(uncompressed), ok_(ok) { }
+
+  virtual void Run(size_t i) {
+    ok_[i] = RawUncompress(chunks_[i].compressed,
+                           chunks_[i].compressed_length,
+                           uncompressed_ + chunks_[i].offset);
+  }
+
+ private:
+  const LargeChunk* chunks_;
+  char* uncompressed_;
+  char* ok_;
+};
+
+}  // namespace
+
+bool ParallelUncompressLarge(const char* compressed,
+                             size_t compressed_length,
+                             string* uncompressed, Executor* executor) {
+  if (executor == NULL) {
+    executor = DefaultExecutor();
+  }
+  ByteArraySource reader(compressed, compressed_length);
+  uint64 N;
+  if (!ReadVarint64(&reader, &N) || N > static_cast<size_t>(-1)) {
+    return false;
+  }
+
+  // Find the chunks, and check that they add up to the full length before
+  // committing any memory to it. Each takes at least two bytes, which
+  // bounds their number by the input rather than by the header.
+  const size_t max_chunk_length = MaxCompressedLength(kLargeChunkSize);
+  const size_t max_chunks = min<uint64>((N + kLargeChunkSize - 1) /
+                                        kLargeChunkSize,
+                                        reader.Available() / 2);
+  Allocator* const allocator = GetAllocator();
+  LargeChunk* const chunks = max_chunks == 0 ? NULL :
+      AllocateArray<LargeChunk>(allocator, max_chunks);
+  size_t num_chunks = 0;
+  size_t offset = 0;
+  bool success = true;
+  while (offset < N) {
+    uint64 chunk_length;
+    if (num_chunks == max_chunks ||
+        !ReadVarint64(&reader, &chunk_length) ||
+        chunk_length > max_chunk_length ||
+        chunk_length > reader.Available()) {
+      success = false;
+      break;
+    }
+    LargeChunk* chunk = &chunks[num_chunks];
+    chunk->compressed = compressed + (compressed_length - reader.Available());
+    chunk->compressed_length = chunk_length;
+    chunk->offset = offset;
+    const size_t chunk_size = min<uint64>(N - offset, kLargeChunkSize);
+    size_t ulength;
+    if (!GetUncompressedLength(chunk->compressed, chunk->compressed_length,
+                               &ulength) ||
+        ulength != chunk_size) {
+      success = false;
+      break;
+    }
+    ++num_chunks;
+    reader.Skip(chunk_length);
+    offset += chunk_size;
+  }
+
+  if (success) {
+    STLStringResizeUninitialized(uncompressed, N);
+    char* const ok = num_chunks == 0 ? NULL :
+        AllocateArray<char>(allocator, num_chunks);
+    ParallelUncompressLoop loop(chunks, string_as_array(uncompressed), ok);
+    executor->ParallelFor(num_chunks, &loop);
+    success = std::find(ok, ok + num_chunks, false) == ok + num_chunks;
+    DeallocateArray(allocator, ok, num_chunks);
+  }
+  DeallocateArray(allocator, chunks, max_chunks);
+  return success;
+}
+
+// -----------------------------------------------------------------------
+// Compression with a time limit
+// -----------------------------------------------------------------------
+
+static uint64 WallTimeNanos() {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#elif defined(HAVE_SYS_TIME_H)
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (static_cast<uint64>(tv.tv_sec) * 1000000 + tv.tv_usec) * 1000;
+#else
+  return static_cast<uint64>(time(NULL)) * 1000000000;
+#endif
+}
+
+static uint64 WallTimeMicros() {
+  return WallTimeNanos() / 1000;
+}
+
+static uint64 CpuTimeMicros() {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<uint64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+  return static_cast<uint64>(clock()) * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+CompressionBudget::~CompressionBudget() { }
+
+Deadline::Deadline(uint64 microseconds)
+    : deadline_(WallTimeMicros() + microseconds) {
+}
+
+bool Deadline::Exhausted() {
+  return WallTimeMicros() >= deadline_;
+}
+
+CpuBudget::CpuBudget(uint64 microseconds)
+    : microseconds_(microseconds), started_(false), start_(0) {
+}
+
+bool CpuBudget::Exhausted() {
+  // The CPU time of one thread means nothing on another, so the start is
+  // taken on the thread that uses the budget.
+  const uint64 now = CpuTimeMicros();
+  if (!started_) {
+    started_ = true;
+    start_ = now;
+  }
+  return now - start_ >= microseconds_;
+}
+
+size_t CompressWithBudget(Source* reader, Sink* writer,
+                          CompressionBudget* budget) {
+  return InternalCompress(reader, writer, NULL, NULL, budget, NULL);
+}
+
+size_t CompressWithBudget(const char* input, size_t input_length,
+                          string* compressed, CompressionBudget* budget) {
+  compressed->resize(MaxCompressedLength(input_length));
+  ByteArraySource reader(input, input_length);
+  UncheckedByteArraySink writer(string_as_array(compressed));
+  CompressWithBudget(&reader, &writer, budget);
+  const size_t compressed_length =
+      writer.CurrentDestination() - string_as_array(compressed);
+  compressed->resize(compressed_length);
+  return compressed_length;
+}
+
+// -----------------------------------------------------------------------
+// Auto-tuned compression
+// -----------------------------------------------------------------------
+
+CompressionOptions::CompressionOptions()
+    : hash_table_bits(kMaxHashTableBits),
+      skip_shift(5),
+      block_size(kBlockSize) {
+}
+
+TuningObjective::~TuningObjective() { }
+
+CostObjective::CostObjective(double cost_per_second, double cost_per_byte)
+    : cost_per_second_(cost_per_second), cost_per_byte_(cost_per_byte) {
+}
+
+double CostObjective::Score(size_t /* uncompressed_length */,
+                            size_t compressed_length, double seconds) {
+  return -(seconds * cost_per_second_ + compressed_length * cost_per_byte_);
+}
+
+// The settings AutoTuningCompressor tries; the first are those of
+// Compress().
+static const struct {
+  int hash_table_bits;
+  int skip_shift;
+  size_t block_size;
+} kTuningCandidates[] = {
+  { kMaxHashTableBits, 5, kBlockSize },
+  { 12, 5, kBlockSize },
+  { 10, 5, kBlockSize },
+  { kMaxHashTableBits, 4, kBlockSize },
+  { kMaxHashTableBits, 6, kBlockSize },
+  { kMaxHashTableBits, 7, kBlockSize },
+  { 12, 5, kBlockSize / 4 },
+  { 10, 4, kBlockSize / 4 },
+};
+static const size_t kNumTuningCandidates = ARRAYSIZE(kTuningCandidates);
+
+// Compresses "fragment" (at most kBlockSize bytes) to "dest" in pieces of
+// "options.block_size" bytes, and returns the end of the output. Literals
+// cost at most 1/30 more than their length and the rest compresses, so
+// the output stays within MaxCompressedLength(fragment_size) for pieces
+// of at least 256 bytes.
+static char* CompressBlockWithOptions(const char* fragment,
+                                      size_t fragment_size, char* dest,
+                                      internal::WorkingMemory* wmem,
+                                      const CompressionOptions& options) {
+  for (size_t pos = 0; pos < fragment_size; pos += options.block_size) {
+    const char* piece = fragment + pos;
+    const size_t piece_size = min(options.block_size, fragment_size - pos);
+    if (IsUniform(piece, piece_size)) {
+      dest = CompressUniformFragment(piece, piece_size, dest);
+      continue;
+    }
+    int table_size;
+    uint16* table = wmem->GetHashTable(
+        min<size_t>(piece_size, 1 << options.hash_table_bits), &table_size);
+    switch (options.skip_shift) {
+      case 4:
+        dest = CompressFragmentWithSkipShift<4>(piece, piece_size, dest,
+                                                table, table_size);
+        break;
+      case 6:
+        dest = CompressFragmentWithSkipShift<6>(piece, piece_size, dest,
+                                                table, table_size);
+        break;
+      case 7:
+        dest = CompressFragmentWithSkipShift<7>(piece, piece_size, dest,
+                                                table, table_size);
+        break;
+      default:
+        dest = internal::CompressFragment(piece, piece_size, dest,
+                                          table, table_size);
+        break;
+    }
+  }
+  return dest;
+}
+
+namespace internal {
+
+// The state of an AutoTuningCompressor.
+class Tuner {
+ public:
+  Tuner(TuningObjective* objective, size_t sample_length);
+  ~Tuner();
+
+  char* CompressBlock(const char* fragment, size_t fragment_size,
+                      char* dest, WorkingMemory* wmem);
+
+  bool tuned() const { return chosen_ >= 0; }
+  const CompressionOptions& options() const {
+    return candidates_[max(chosen_, 0)].options;
+  }
+
+ private:
+  struct Candidate {
+    CompressionOptions options;
+    uint64 compressed_length;   // Of the sampled blocks.
+    uint64 nanos;               // Spent compressing the sampled blocks.
+  };
+
+  // Picks the candidate that did best on the samples.
+  void Choose();
+
+  Allocator* allocator_;
+  TuningObjective* objective_;
+  size_t sample_length_;
+  size_t sampled_;              // Input bytes compressed by all candidates.
+  Candidate candidates_[kNumTuningCandidates];
+  size_t first_;                // The candidate to try first on a block.
+  int chosen_;                  // Index of the chosen candidate, or -1.
+  char* scratch_[2];            // For the outputs of the candidates.
+
+  DISALLOW_COPY_AND_ASSIGN(Tuner);
+};
+
+Tuner::Tuner(TuningObjective* objective, size_t sample_length)
+    : allocator_(GetAllocator()),
+      objective_(objective),
+      sample_length_(sample_length),
+      sampled_(0),
+      first_(0),
+      chosen_(sample_length == 0 ? 0 : -1) {
+  for (size_t i = 0; i < kNumTuningCandidates; ++i) {
+    Candidate* candidate = &candidates_[i];
+    candidate->options.hash_table_bits = kTuningCandidates[i].hash_table_bits;
+    candidate->options.skip_shift = kTuningCandidates[i].skip_shift;
+    candidate->options.block_size = kTuningCandidates[i].block_size;
+    candidate->compressed_length = 0;
+    candidate->nanos = 0;
+  }
+  scratch_[0] = scratch_[1] = NULL;
+}
+
+Tuner::~Tuner() {
+  for (int i = 0; i < 2; ++i) {
+    DeallocateArray(allocator_, scratch_[i], MaxCompressedLength(kBlockSize));
+  }
+}
+
+char* Tuner::CompressBlock(const char* fragment, size_t fragment_size,
+                           char* dest, WorkingMemory* wmem) {
+  if (tuned()) {
+    return CompressBlockWithOptions(fragment, fragment_size, dest, wmem,
+                                    candidates_[chosen_].options);
+  }
+
+  // Try every candidate, keeping the output of the best so far. Start
+  // with a different one each time, so that no candidate always pays for
+  // bringing the block into cache.
+  for (int i = 0; i < 2; ++i) {
+    if (scratch_[i] == NULL) {
+      scratch_[i] = AllocateArray<char>(allocator_,
+                                        MaxCompressedLength(kBlockSize));
+    }
+  }
+  char* output = scratch_[0];
+  char* best_output = NULL;
+  size_t best_length = 0;
+  double best_score = 0;
+  for (size_t k = 0; k < kNumTuningCandidates; ++k) {
+    Candidate* candidate = &candidates_[(first_ + k) % kNumTuningCandidates];
+    const uint64 start = WallTimeNanos();
+    char* end = CompressBlockWithOptions(fragment, fragment_size, output,
+                                         wmem, candidate->options);
+    const uint64 nanos = WallTimeNanos() - start;
+    const size_t length = end - output;
+    candidate->compressed_length += length;
+    candidate->nanos += nanos;
+    const double score = objective_->Score(fragment_size, length,
+                                           nanos * 1e-9);
+    if (best_output == NULL || score > best_score) {
+      best_output = output;
+      best_length = length;
+      best_score = score;
+      output = (output == scratch_[0]) ? scratch_[1] : scratch_[0];
+    }
+  }
+  first_ = (first_ + 1) % kNumTuningCandidates;
+
+  memcpy(dest, best_output, best_length);
+  sampled_ += fragment_size;
+  if (sampled_ >= sample_length_) {
+    Choose();
+  }
+  return dest + best_length;
+}
+
+void Tuner::Choose() {
+  double best_score = 0;
+  for (size_t i = 0; i < kNumTuningCandidates; ++i) {
+    const double score = objective_->Score(
+        sampled_, candidates_[i].compressed_length,
+        candidates_[i].nanos * 1e-9);
+    if (chosen_ < 0 || score > best_score) {
+      chosen_ = static_cast<int>(i);
+      best_score = score;
+    }
+  }
+  for (int i = 0; i < 2; ++i) {
+    DeallocateArray(allocator_, scratch_[i], MaxCompressedLength(kBlockSize));
+    scratch_[i] = NULL;
+  }
+}
+
+}  // end namespace internal
+
+static char* TunedCompressBlock(internal::Tuner* tuner,
+                                const char* fragment, size_t fragment_size,
+                                char* dest, internal::WorkingMemory* wmem) {
+  return tuner->CompressBlock(fragment, fragment_size, dest, wmem);
+}
+
+AutoTuningCompressor::AutoTuningCompressor(TuningObjective* objective,
+                                           size_t sample_length)
+    : allocator_(GetAllocator()),
+      tuner_(new (AllocateArray<internal::Tuner>(allocator_, 1))
+             internal::Tuner(objective, sample_length)) {
+}
+
+AutoTuningCompressor::~AutoTuningCompressor() {
+  tuner_->~Tuner();
+  DeallocateArray(allocator_, tuner_, 1);
+}
+
+size_t AutoTuningCompressor::Compress(Source* source, Sink* sink) {
+  return InternalCompress(source, sink, NULL, NULL, NULL, tuner_);
+}
+
+size_t AutoTuningCompressor::Compress(const char* input, size_t input_length,
+                                      string* compressed) {
+  compressed->resize(MaxCompressedLength(input_length));
+  ByteArraySource reader(input, input_length);
+  UncheckedByteArraySink writer(string_as_array(compressed));
+  Compress(&reader, &writer);
+  const size_t compressed_length =
+      writer.CurrentDestination() - string_as_array(compressed);
+  compressed->resize(compressed_length);
+  return compressed_length;
+}
+
+bool AutoTuningCompressor::tuned() const {
+  return tuner_->tuned();
+}
+
+const CompressionOptions& AutoTuningCompressor::options() const {
+  return tuner_->options();
+}
 
 } // end namespace snappy
 
@@ -41,12 +41,20 @@
 
 #include <stddef.h>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "snappy-sinksource.h"
 #include "snappy-stubs-public.h"
 
 namespace snappy {
   class Source;
   class Sink;
+  class Allocator;
+  namespace internal {
+    class WorkingMemory;
+    class Tuner;
+  }
 
   // ------------------------------------------------------------------------
   // Generic compression/decompression routines.
@@ -54,8 +62,25 @@ namespace snappy {
 
   // Compress the bytes read from "*source" and append to "*sink". Return the
   // number of bytes written.
+  //
+  // If "*source" ends before the number of bytes its Available() gave at
+  // the start (a FileSource does on a read error), this returns 0, and
+  // what was appended to "*sink" is a truncated stream that will not
+  // decompress. The same goes for the other functions that compress from
+  // a Source below.
   size_t Compress(Source* source, Sink* sink);
 
+  // Same as Compress(source, sink), but also checksums the input as it is
+  // compressed. If "block_crcs" is non-NULL, the CRC-32C of each block of
+  // kBlockSize input bytes (the last one may be shorter) is appended to it,
+  // in order; these are the checksums a framed stream stores with its
+  // chunks, unmasked. If "stream_crc" is non-NULL, it is set to the CRC-32C
+  // of the whole input. Each block is checksummed right after it is
+  // compressed, while it is still in cache.
+  size_t CompressAndChecksum(Source* source, Sink* sink,
+                             std::vector<uint32>* block_crcs,
+                             uint32* stream_crc);
+
   // Find the uncompressed length of the given stream, as given by the header.
   // Note that the true length could deviate from this; the stream could e.g.
   // be truncated.
@@ -65,6 +90,31 @@ namespace snappy {
   // or recreate the source yourself before attempting any further calls.
   bool GetUncompressedLength(Source* source, uint32* result);
 
+  // The routines above are limited to 4 GiB, as the length of a compressed
+  // stream is stored in 32 bits. The following ones work on a chained
+  // stream of any size instead: a varint with the total uncompressed length
+  // in 64 bits, followed by chunks of 1 MiB of uncompressed data (the last
+  // one may be shorter), each stored as a varint with its compressed length
+  // followed by an ordinary compressed stream. Both directions stream
+  // through the data a chunk at a time.
+
+  // Compress all of "*source" to "*sink" as a chained stream. Return the
+  // number of bytes written.
+  size_t CompressLarge(Source* source, Sink* sink);
+
+  // Decompress the chained stream in "*compressed" to "*uncompressed".
+  // Returns false if it is corrupted, in which case a prefix of the data
+  // may already have been written to "*uncompressed".
+  bool UncompressLarge(Source* compressed, Sink* uncompressed);
+
+  // Find the uncompressed length of the chained stream in "*source" (or in
+  // "compressed[0,compressed_length-1]"), as given by its header. Returns
+  // false if the header is malformed or the length does not fit in a
+  // size_t. The caveats of GetUncompressedLength() apply.
+  bool GetLargeUncompressedLength(Source* source, size_t* result);
+  bool GetLargeUncompressedLength(const char* compressed,
+                                  size_t compressed_length, size_t* result);
+
   // ------------------------------------------------------------------------
   // Higher-level string based routines (should be sufficient for most users)
   // ------------------------------------------------------------------------
@@ -109,6 +159,26 @@ namespace snappy {
                    char* compressed,
                    size_t* compressed_length);
 
+  // Same as RawCompress(), with the checksums of CompressAndChecksum().
+  void RawCompressAndChecksum(const char* input,
+                              size_t input_length,
+                              char* compressed,
+                              size_t* compressed_length,
+                              std::vector<uint32>* block_crcs,
+                              uint32* stream_crc);
+
+  // Same as RawCompress(), but only if the output takes at most
+  // "max_compressed_length" bytes, and "compressed" needs only that much
+  // room. Returns false, leaving "compressed" in an undefined state, if
+  // the output would be longer; compression stops as soon as that is
+  // certain, checked after each block. Useful for storing data compressed
+  // only when that saves enough space.
+  bool CompressIfSmallerThan(const char* input,
+                             size_t input_length,
+                             size_t max_compressed_length,
+                             char* compressed,
+                             size_t* compressed_length);
+
   // Given data in "compressed[0..compressed_length-1]" generated by
   // calling the Snappy::Compress routine, this routine
   // stores the uncompressed data to
@@ -146,6 +216,163 @@ namespace snappy {
   bool RawUncompressToIOVec(Source* compressed, const struct iovec* iov,
                             size_t iov_cnt);
 
+  // Same as RawUncompress(compressed, compressed_length, uncompressed), but
+  // also sets "*crc32c" to the CRC-32C (Castagnoli) checksum of the
+  // uncompressed data, unmasked. The checksum is computed while
+  // decompressing, a few kilobytes behind the output, so the data is
+  // checksummed while still in cache instead of in a second pass over
+  // memory. "*crc32c" is not modified if decompression fails.
+  bool RawUncompressAndChecksum(const char* compressed,
+                                size_t compressed_length,
+                                char* uncompressed,
+                                uint32* crc32c);
+
+  // Same as Uncompress(compressed, compressed_length, uncompressed), with
+  // the checksum computed as by RawUncompressAndChecksum().
+  bool UncompressAndChecksum(const char* compressed, size_t compressed_length,
+                             string* uncompressed, uint32* crc32c);
+
+  // Same as RawUncompress(compressed, compressed_length, uncompressed), but
+  // faster, since it does not need to guard against reading past the end of
+  // the input after every tag.
+  //
+  // REQUIRES: At least kInputPaddingBytes bytes after the end of the input,
+  // "compressed[compressed_length..compressed_length+kInputPaddingBytes-1]",
+  // are readable. They are never written, and their contents do not matter:
+  // a valid input decodes the same whatever they hold.
+  bool RawUncompressPadded(const char* compressed, size_t compressed_length,
+                           char* uncompressed);
+
+  // Decompresses the data in "buf[compressed_offset..compressed_offset +
+  // compressed_length - 1]", generated by the Snappy::Compress routine, to
+  //    buf[0..GetUncompressedLength(compressed)-1]
+  // without using a second buffer. This works because the output is written
+  // front to back and is (mostly) bigger than the input, so the typical use
+  // is to read the compressed data into the tail of a buffer sized for the
+  // uncompressed data. The output must never overtake the input that is
+  // still to be read, which is guaranteed for any stream produced by
+  // Compress() if
+  //    compressed_offset + compressed_length >=
+  //        uncompressed_length + MaxInPlaceMargin(uncompressed_length)
+  // If the condition does not hold, decompression may fail even though the
+  // data is valid. The contents of "buf" are unspecified on failure.
+  //
+  // returns false if the message is corrupted, does not fit in "buf", or
+  // could not be decompressed in place
+  bool RawUncompressInPlace(char* buf, size_t buf_size,
+                            size_t compressed_offset,
+                            size_t compressed_length);
+
+  // Returns the number of bytes beyond "uncompressed_length" that a buffer
+  // needs so that RawUncompressInPlace() always succeeds on the output of
+  // Compress() placed at its tail. This is about 3% of the uncompressed
+  // length, and much less than MaxCompressedLength() adds.
+  size_t MaxInPlaceMargin(size_t uncompressed_length);
+
+  // Decompresses "n" independent buffers, where buffer i is
+  // "compressed[i][0..compressed_length[i]-1]" and is decompressed to
+  // uncompressed[i][0..GetUncompressedLength(compressed[i])-1]. The result is
+  // the same as calling RawUncompress() on each buffer, but several buffers
+  // are decoded in lock-step so that their tag-decoding dependency chains
+  // overlap. How much that helps depends on the CPU: on the machines it was
+  // measured on, it was on par with a loop over RawUncompress() for 1-4 KB
+  // messages and at most 20% faster for 8-16 KB ones.
+  //
+  // If "valid" is non-NULL, valid[i] is set to whether buffer i could be
+  // decompressed. Returns true iff all of the buffers were valid.
+  //
+  // REQUIRES: The "uncompressed" buffers do not overlap with each other.
+  bool RawUncompressBatch(const char* const* compressed,
+                          const size_t* compressed_length,
+                          size_t n,
+                          char* const* uncompressed,
+                          bool* valid);
+
+  // Sets "*output" to a single compressed buffer that decompresses to the
+  // concatenation of what the "n" buffers
+  // "compressed[i][0..compressed_length[i]-1]" decompress to. Only the
+  // headers are rewritten; the rest of the data is copied as it is.
+  // Original contents of "*output" are lost.
+  //
+  // The result is valid if all of the inputs are, and then decompresses to
+  // the concatenation. It can also be valid when some inputs are not, since
+  // a copy in one input may reach back into the output of the ones before
+  // it; SplitCompressed() cannot recover the original boundaries of such a
+  // result. Returns false if an input has a malformed header or if the
+  // total uncompressed length does not fit in 32 bits.
+  bool ConcatenateCompressed(const char* const* compressed,
+                             const size_t* compressed_length,
+                             size_t n,
+                             string* output);
+
+  // The reverse of ConcatenateCompressed(): splits
+  // "compressed[0..compressed_length-1]" into "*parts", each a valid
+  // compressed buffer, such that decompressing the parts and concatenating
+  // the results gives the original data. Again no data is recompressed.
+  //
+  // Cuts are made only at multiples of kBlockSize in the uncompressed data,
+  // and only where no later copy refers back across the cut, so they need
+  // not be where the parts of a ConcatenateCompressed() result began.
+  // Compress() output can be cut at every block boundary. A part is ended
+  // at the first possible cut once it holds at least "min_part_length"
+  // uncompressed bytes, so pass kBlockSize to split into single blocks.
+  //
+  // Returns false, with "*parts" in an unspecified state, if the input is
+  // corrupted.
+  bool SplitCompressed(const char* compressed, size_t compressed_length,
+                       size_t min_part_length, std::vector<string>* parts);
+
+  // Finds all occurrences of "pattern[0..pattern_length-1]" in the data
+  // that "compressed[0..compressed_length-1]" decompresses to, and stores
+  // their offsets into the uncompressed data in "*offsets" in increasing
+  // order, including overlapping occurrences. An empty pattern matches
+  // nowhere.
+  //
+  // This keeps only a window of about two blocks of recent output instead
+  // of the whole uncompressed data, and derives the occurrences inside
+  // copies that are at least as long as the pattern from those in their
+  // source instead of scanning them. The window is still rebuilt from all
+  // of the tags, so this takes more CPU than Uncompress() followed by a
+  // scan (it measured at a little over half the throughput); what it saves
+  // is memory. For streams from Compress(), memory use is independent of
+  // the size of the data. A stream with a copy from further back than the
+  // window (which Compress() never writes) is decompressed in full instead.
+  //
+  // Returns false, with "*offsets" in an unspecified state, if the message
+  // is corrupted.
+  bool FindInCompressed(const char* compressed, size_t compressed_length,
+                        const char* pattern, size_t pattern_length,
+                        std::vector<size_t>* offsets);
+
+  // Sets "*output" to the compressed version of "input[0,input_length-1]",
+  // as a delta against "reference[0,reference_length-1]": copies may refer
+  // to the reference as if it came right before the input, so data shared
+  // with the reference is cheap however far apart it is. This makes the
+  // output a small patch when the input is a new version of the reference,
+  // whatever their size. Copies into the reference use the four-byte offset
+  // tags of the format, which take five bytes per 64 bytes copied, so data
+  // that is unchanged from the reference costs about 8% of its size.
+  // Original contents of "*output" are lost.
+  //
+  // The output can only be decompressed by DeltaUncompress() with the same
+  // reference (or by Uncompress(), if it happens not to refer to it).
+  //
+  // Returns false if "reference_length + input_length" does not fit in 32
+  // bits.
+  bool DeltaCompress(const char* reference, size_t reference_length,
+                     const char* input, size_t input_length,
+                     string* output);
+
+  // Decompresses "compressed[0,compressed_length-1]", generated by
+  // DeltaCompress() against "reference[0,reference_length-1]", to
+  // "*uncompressed". Original contents of "*uncompressed" are lost.
+  //
+  // returns false if the message is corrupted, or refers to more reference
+  // data than given
+  bool DeltaUncompress(const char* reference, size_t reference_length,
+                       const char* compressed, size_t compressed_length,
+                       string* uncompressed);
+
   // Returns the maximal size of the compressed representation of
   // input data that is "source_bytes" bytes in length;
   size_t MaxCompressedLength(size_t source_bytes);
@@ -176,8 +403,520 @@ namespace snappy {
   static const int kBlockLog = 16;
   static const size_t kBlockSize = 1 << kBlockLog;
 
+  // The number of readable bytes RawUncompressPadded() requires after the
+  // end of its input. It reads literals that fit in the tag byte (up to 60
+  // bytes) 64 bytes at a time.
+  static const size_t kInputPaddingBytes = 64;
+
   static const int kMaxHashTableBits = 14;
   static const size_t kMaxHashTableSize = 1 << kMaxHashTableBits;
+
+  // ------------------------------------------------------------------------
+  // Sources that compress or decompress as they are read
+  // ------------------------------------------------------------------------
+
+  // A Source that yields the uncompressed data of the compressed stream in
+  // "*compressed", decompressing it only as far as it is read. Peek() and
+  // Skip() decompress up to 64 KiB at a time into an internal buffer, so
+  // parsers can consume the data incrementally and stop early without
+  // decompressing the rest, and memory use does not depend on its size.
+  //
+  // Copies may refer back at most 64 KiB, which holds for all data from
+  // Compress(). If the data turns out to be corrupted (or copies from
+  // further back), the source ends early and ok() returns false; Available()
+  // may then have promised more data than it yields. "*compressed" must
+  // outlive this object and is left positioned somewhere in the stream.
+  class UncompressingSource : public Source {
+   public:
+    explicit UncompressingSource(Source* compressed);
+    virtual ~UncompressingSource();
+
+    virtual size_t Available() const;
+    virtual const char* Peek(size_t* len);
+    virtual void Skip(size_t n);
+
+    // Returns false if corrupted data was found so far.
+    bool ok() const { return ok_; }
+
+   private:
+    // Decompresses more data into buffer_, after everything in it was read.
+    void Refill();
+    bool DecodeTags();
+
+    Allocator* allocator_;
+    Source* compressed_;
+    char* buffer_;            // History, followed by decompressed data
+    size_t start_;            // Start of the unread data in buffer_
+    size_t end_;              // End of the decompressed data in buffer_
+    size_t remaining_;        // Bytes not decompressed yet
+    size_t pending_literal_;  // Literal bytes not decompressed yet
+    bool ok_;
+
+    UncompressingSource(const UncompressingSource&);
+    void operator=(const UncompressingSource&);
+  };
+
+  // A Source that yields what Compress() would write for the data in
+  // "*uncompressed", compressing it one 64 KiB block at a time as it is
+  // read. This plugs compression into anything that consumes a Source,
+  // with memory use independent of the input size.
+  //
+  // The compressed length is not known before the end, so Available()
+  // counts only the compressed bytes that are ready: it is nonzero until
+  // all of the output was read, but is not its total length. Consumers
+  // that size a buffer from Available() up front must not be given this
+  // source. "*uncompressed" must outlive this object.
+  class CompressingSource : public Source {
+   public:
+    explicit CompressingSource(Source* uncompressed);
+    virtual ~CompressingSource();
+
+    virtual size_t Available() const;
+    virtual const char* Peek(size_t* len);
+    virtual void Skip(size_t n);
+
+    // Returns false if "*uncompressed" ended before the length it gave
+    // when this object was constructed. This source then ends early too,
+    // after a truncated stream that will not decompress.
+    bool ok() const { return ok_; }
+
+   private:
+    // Compresses the next block into output_, after everything in it was
+    // read.
+    void Refill();
+
+    Allocator* allocator_;
+    Source* uncompressed_;
+    internal::WorkingMemory* wmem_;
+    char* scratch_;      // Input block that spans fragments of the source
+    char* output_;       // Compressed data
+    size_t start_;       // Start of the unread data in output_
+    size_t end_;         // End of the compressed data in output_
+    size_t remaining_;   // Input bytes not compressed yet
+    bool ok_;
+
+    CompressingSource(const CompressingSource&);
+    void operator=(const CompressingSource&);
+  };
+
+  // ------------------------------------------------------------------------
+  // Session compression, for streams of small, similar messages
+  // ------------------------------------------------------------------------
+
+  // Compresses a sequence of messages, each of which may refer to the last
+  // 64 KiB of the messages compressed before it. This compresses small
+  // messages that resemble each other (as on an RPC connection) much better
+  // than compressing them one by one.
+  //
+  // Each message is compressed to the usual format, except that copies may
+  // reach back into earlier messages, so it can only be decompressed by a
+  // SessionUncompressor that has decompressed all of the earlier messages
+  // of the session, in order. The first message after construction or
+  // Reset() is an ordinary compressed buffer.
+  class SessionCompressor {
+   public:
+    SessionCompressor();
+    ~SessionCompressor();
+
+    // Sets "*output" to the compressed version of
+    // "input[0,input_length-1]", and adds the input to the history.
+    // Returns the length of "*output".
+    size_t Compress(const char* input, size_t input_length, string* output);
+
+    // Forgets the history, starting a new session.
+    void Reset();
+
+   private:
+    Allocator* allocator_;
+    char* buffer_;   // History, followed by room for the next message
+    size_t used_;    // Bytes of history in buffer_
+    uint32* table_;  // Hash table of positions in buffer_
+
+    SessionCompressor(const SessionCompressor&);
+    void operator=(const SessionCompressor&);
+  };
+
+  // Decompresses the messages of a SessionCompressor.
+  class SessionUncompressor {
+   public:
+    SessionUncompressor();
+    ~SessionUncompressor();
+
+    // Decompresses "compressed[0,compressed_length-1]", the next message of
+    // the session, to "*uncompressed", and adds it to the history.
+    //
+    // returns false if the message is corrupted; the history is then
+    // unchanged, but since the compressing side has moved on, the session
+    // should normally be Reset() at both ends
+    bool Uncompress(const char* compressed, size_t compressed_length,
+                    string* uncompressed);
+
+    // Forgets the history, starting a new session.
+    void Reset();
+
+   private:
+    Allocator* allocator_;
+    char* buffer_;     // History, followed by room for the next message
+    size_t used_;      // Bytes of history in buffer_
+    size_t capacity_;  // Size of buffer_
+
+    SessionUncompressor(const SessionUncompressor&);
+    void operator=(const SessionUncompressor&);
+  };
+
+  // ------------------------------------------------------------------------
+  // Memory allocation
+  // ------------------------------------------------------------------------
+
+  // Allocates the memory snappy uses internally: hash tables, scratch
+  // buffers and the buffers of the classes above. Strings passed in by the
+  // caller are allocated by std::string as usual.
+  class Allocator {
+   public:
+    Allocator() { }
+    virtual ~Allocator();
+
+    // Returns "size" bytes of memory, suitably aligned for any type.
+    virtual void* Allocate(size_t size) = 0;
+
+    // Frees "ptr", which Allocate(size) returned. Never called with NULL.
+    virtual void Deallocate(void* ptr, size_t size) = 0;
+
+   private:
+    Allocator(const Allocator&);
+    void operator=(const Allocator&);
+  };
+
+  // Makes snappy allocate through "*allocator" on the calling thread, or
+  // through new and delete (the default) if it is NULL, and returns the
+  // previous allocator. The classes above keep the allocator that was
+  // current when they were constructed, which must outlive them.
+  //
+  // Some bookkeeping still comes from new and delete: the state that
+  // Executor::ParallelFor() shares with the threads that help it (freed
+  // by whichever thread finishes last), the threads and queues of a
+  // WorkStealingExecutor, and the index of recent chunks that FramingSink
+  // and FramedSource keep for deduplication (the chunks themselves use the
+  // allocator).
+  Allocator* SetAllocator(Allocator* allocator);
+
+  // Returns the allocator in use on the calling thread.
+  Allocator* GetAllocator();
+
+  // An Allocator for per-request arenas. It hands out memory from large
+  // blocks and releases it all at once in Reset() or the destructor;
+  // Deallocate() only reclaims the most recent allocation, which is enough
+  // for the short-lived buffers of a call to be reused within it. Not
+  // thread-safe.
+  class ArenaAllocator : public Allocator {
+   public:
+    explicit ArenaAllocator(size_t block_size = 1 << 20);
+    virtual ~ArenaAllocator();
+
+    virtual void* Allocate(size_t size);
+    virtual void Deallocate(void* ptr, size_t size);
+
+    // Frees everything allocated, keeping the first block for reuse.
+    void Reset();
+
+    // Returns the number of bytes of memory held in blocks.
+    size_t MemoryUsage() const { return memory_usage_; }
+
+   private:
+    // Starts a new block with room for at least "size" bytes.
+    void NewBlock(size_t size);
+
+    const size_t block_size_;
+    std::vector<std::pair<char*, size_t> > blocks_;  // Start and size
+    char* ptr_;    // Free space in the current block
+    char* limit_;
+    size_t memory_usage_;
+
+    ArenaAllocator(const ArenaAllocator&);
+    void operator=(const ArenaAllocator&);
+  };
+
+  // An Allocator that backs large buffers with 2 MiB huge pages, to cut TLB
+  // misses when compressing large data sets. Allocations of at least
+  // "min_size" bytes are rounded up to whole huge pages and taken from the
+  // reserved huge page pool (MAP_HUGETLB) if there is one, or else mapped
+  // 2 MiB-aligned and marked for transparent huge pages. Smaller ones, and
+  // all of them on systems without mmap(), use new and delete.
+  //
+  // Only buffers that scale with the input benefit, like the input and
+  // output of CompressLarge() and its scratch buffers. The hash table and
+  // other per-block state of the compressor are a few dozen KiB, well
+  // below any sensible "min_size", and already covered by a handful of
+  // ordinary TLB entries.
+  class HugePageAllocator : public Allocator {
+   public:
+    explicit HugePageAllocator(size_t min_size = 1 << 20);
+    virtual ~HugePageAllocator();
+
+    virtual void* Allocate(size_t size);
+    virtual void Deallocate(void* ptr, size_t size);
+
+   private:
+    const size_t min_size_;
+
+    HugePageAllocator(const HugePageAllocator&);
+    void operator=(const HugePageAllocator&);
+  };
+
+  // Asks for the whole 2 MiB pages inside "data[0,size-1]", such as a large
+  // input buffer, to be backed by transparent huge pages. This takes effect
+  // for pages not touched yet; the system may collapse the others later.
+  // Does nothing where this is not supported.
+  void AdviseHugePages(const void* data, size_t size);
+
+  // ------------------------------------------------------------------------
+  // Parallel compression
+  // ------------------------------------------------------------------------
+
+  // Runs the work of the parallel codecs below. Implement it to run them on
+  // an existing thread pool; otherwise a built-in one is used.
+  class Executor {
+   public:
+    // A unit of work for Submit().
+    class Task {
+     public:
+      Task() { }
+      virtual ~Task();
+      virtual void Run() = 0;
+
+     private:
+      Task(const Task&);
+      void operator=(const Task&);
+    };
+
+    // The body of a ParallelFor() loop.
+    class Loop {
+     public:
+      Loop() { }
+      virtual ~Loop();
+      virtual void Run(size_t i) = 0;
+
+     private:
+      Loop(const Loop&);
+      void operator=(const Loop&);
+    };
+
+    Executor() { }
+    virtual ~Executor();
+
+    // Arranges for task->Run() to be called once, on any thread, and
+    // returns. "*task" must stay alive until then; Run() may delete it.
+    virtual void Submit(Task* task) = 0;
+
+    // Calls loop->Run(i) for every i in [0, n), possibly in parallel, and
+    // returns once all calls have returned. The calling thread takes part,
+    // so this finishes even if no other thread gets around to it, and may
+    // be called from within a task. The default implementation runs on
+    // Submit().
+    virtual void ParallelFor(size_t n, Loop* loop);
+
+   private:
+    Executor(const Executor&);
+    void operator=(const Executor&);
+  };
+
+  // An Executor with a fixed number of threads, each with its own queue of
+  // tasks. Tasks submitted from within a task go to the queue of the same
+  // thread, which runs the most recent ones first while idle threads steal
+  // the oldest ones from others; this keeps nested work local and balances
+  // the load. Without thread support, tasks run in Submit().
+  class WorkStealingExecutor : public Executor {
+   public:
+    // Starts "num_threads" threads, or one per processor if it is 0.
+    explicit WorkStealingExecutor(int num_threads);
+
+    // Runs the tasks that are still queued, then stops the threads.
+    virtual ~WorkStealingExecutor();
+
+    virtual void Submit(Task* task);
+
+    // Returns the number of threads.
+    int num_threads() const;
+
+   private:
+    struct Impl;
+    Impl* impl_;
+
+    WorkStealingExecutor(const WorkStealingExecutor&);
+    void operator=(const WorkStealingExecutor&);
+  };
+
+  // Returns the executor used when none is given: a WorkStealingExecutor
+  // with one thread per processor, started on first use.
+  Executor* DefaultExecutor();
+
+  // Sets "*compressed" to exactly what Compress() produces for
+  // "input[0,input_length-1]", compressing groups of blocks in parallel on
+  // "*executor" (DefaultExecutor() if NULL). Returns the compressed length.
+  //
+  // The buffers each group needs come from the allocator of the thread that
+  // runs it, so the caller's allocator only covers the groups the calling
+  // thread runs itself (see Executor::ParallelFor()); a per-request
+  // ArenaAllocator does not bound the memory of the pool threads. The
+  // caller's allocator is not handed to them, as it need not be
+  // thread-safe. To control their memory, call SetAllocator() on the
+  // threads of your own Executor.
+  size_t ParallelCompress(const char* input, size_t input_length,
+                          string* compressed, Executor* executor);
+
+  // Likewise, for CompressLarge(), with one task per chunk.
+  size_t ParallelCompressLarge(const char* input, size_t input_length,
+                               string* compressed, Executor* executor);
+
+  // Decompresses the output of CompressLarge() into "*uncompressed", with
+  // the chunks decompressed in parallel on "*executor" (DefaultExecutor()
+  // if NULL). Returns false if the data is corrupted.
+  bool ParallelUncompressLarge(const char* compressed,
+                               size_t compressed_length,
+                               string* uncompressed, Executor* executor);
+
+  // ------------------------------------------------------------------------
+  // Compression with a time limit
+  // ------------------------------------------------------------------------
+
+  // Bounds the time CompressWithBudget() spends looking for matches.
+  class CompressionBudget {
+   public:
+    CompressionBudget() { }
+    virtual ~CompressionBudget();
+
+    // Returns true once the budget is used up. Called before each block is
+    // compressed, until it returns true.
+    virtual bool Exhausted() = 0;
+
+   private:
+    CompressionBudget(const CompressionBudget&);
+    void operator=(const CompressionBudget&);
+  };
+
+  // A budget of "microseconds" of wall-clock time from construction.
+  class Deadline : public CompressionBudget {
+   public:
+    explicit Deadline(uint64 microseconds);
+    virtual bool Exhausted();
+
+   private:
+    uint64 deadline_;
+  };
+
+  // A budget of "microseconds" of CPU time of the compressing thread (or
+  // of the process, where that is not available), counted from the first
+  // Exhausted() call, which CompressWithBudget() makes on that thread
+  // before the first block. It can therefore be constructed on another
+  // thread, but not be shared by compressions on different threads.
+  // Unlike a Deadline, it does not run out while the thread is waiting for
+  // a processor.
+  class CpuBudget : public CompressionBudget {
+   public:
+    explicit CpuBudget(uint64 microseconds);
+    virtual bool Exhausted();
+
+   private:
+    const uint64 microseconds_;
+    bool started_;
+    uint64 start_;  // CPU time of the first Exhausted() call
+  };
+
+  // Same as Compress(), but once "*budget" is exhausted, the remaining
+  // blocks are stored as literals, at about the speed of a memcpy. The
+  // output is a valid compressed stream either way, and identical to that
+  // of Compress() if the budget lasts.
+  size_t CompressWithBudget(Source* source, Sink* sink,
+                            CompressionBudget* budget);
+  size_t CompressWithBudget(const char* input, size_t input_length,
+                            string* compressed, CompressionBudget* budget);
+
+  // ------------------------------------------------------------------------
+  // Auto-tuned compression
+  // ------------------------------------------------------------------------
+
+  // Settings of the compressor. All of them give ordinary compressed data.
+  struct CompressionOptions {
+    // The settings Compress() uses.
+    CompressionOptions();
+
+    // Log2 of the largest hash table, from 8 to kMaxHashTableBits. Smaller
+    // tables are cleared faster and stay in cache, but find fewer matches.
+    int hash_table_bits;
+
+    // After 2^skip_shift bytes without a match, the compressor starts to
+    // skip bytes, faster and faster; from 4 to 7. Lower values get through
+    // incompressible data faster, higher ones find more matches.
+    int skip_shift;
+
+    // The size of the blocks compressed independently of each other, from
+    // 256 to kBlockSize. Smaller blocks find fewer matches, but their hash
+    // tables are smaller.
+    size_t block_size;
+  };
+
+  // Rates a way of compressing data; higher scores are better.
+  class TuningObjective {
+   public:
+    TuningObjective() { }
+    virtual ~TuningObjective();
+
+    // Returns the score of compressing "uncompressed_length" bytes to
+    // "compressed_length" bytes in "seconds".
+    virtual double Score(size_t uncompressed_length,
+                         size_t compressed_length, double seconds) = 0;
+
+   private:
+    TuningObjective(const TuningObjective&);
+    void operator=(const TuningObjective&);
+  };
+
+  // Prefers the lowest total cost, at "cost_per_second" of compression
+  // time plus "cost_per_byte" of output, as for a service paying for both
+  // CPU time and storage or bandwidth.
+  class CostObjective : public TuningObjective {
+   public:
+    CostObjective(double cost_per_second, double cost_per_byte);
+    virtual double Score(size_t uncompressed_length,
+                         size_t compressed_length, double seconds);
+
+   private:
+    double cost_per_second_;
+    double cost_per_byte_;
+  };
+
+  // Compresses a stream of data, given in one or more calls of Compress(),
+  // choosing CompressionOptions to suit it. Each block of the first
+  // "sample_length" bytes is compressed with several candidate settings
+  // (and stored as compressed by the best one); after that, the settings
+  // that did best on them overall, according to "*objective", are used
+  // for the rest. The output is ordinary compressed data. "*objective"
+  // must outlive this object. Like the classes above SetAllocator(), it
+  // keeps the allocator that was current when it was constructed.
+  class AutoTuningCompressor {
+   public:
+    explicit AutoTuningCompressor(TuningObjective* objective,
+                                  size_t sample_length = 256 << 10);
+    ~AutoTuningCompressor();
+
+    // Same as snappy::Compress(), for the next part of the stream.
+    size_t Compress(Source* source, Sink* sink);
+    size_t Compress(const char* input, size_t input_length,
+                    string* compressed);
+
+    // Returns true once the settings have been chosen.
+    bool tuned() const;
+
+    // The chosen settings, once tuned() is true.
+    const CompressionOptions& options() const;
+
+   private:
+    Allocator* allocator_;
+    internal::Tuner* tuner_;
+
+    AutoTuningCompressor(const AutoTuningCompressor&);
+    void operator=(const AutoTuningCompressor&);
+  };
 }  // end namespace snappy
 
 
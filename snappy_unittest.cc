@@ -31,14 +31,26 @@
 
 
 #include <algorithm>
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "snappy.h"
+#include "snappy-async.h"
+#include "snappy-c.h"
+#include "snappy-crc32c.h"
+#include "snappy-framing.h"
 #include "snappy-internal.h"
 #include "snappy-test.h"
 #include "snappy-sinksource.h"
 
+#ifdef HAVE_UNISTD_H
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 DEFINE_int32(start_len, -1,
              "Starting prefix size for testing (-1: just full file contents)");
 DEFINE_int32(end_len, -1,
@@ -532,6 +544,26 @@ static void VerifyIOVec(const string& input) {
   delete[] buf;
 }
 
+static void VerifyPadded(const string& input) {
+  string compressed;
+  snappy::Compress(input.data(), input.size(), &compressed);
+
+  // Fill the padding with something that looks like a long copy, to make
+  // sure it does not get decoded.
+  string padded = compressed;
+  padded.append(snappy::kInputPaddingBytes, '\xfe');
+  string uncompressed(input.size() + 1, '\0');
+  CHECK(snappy::RawUncompressPadded(padded.data(), compressed.size(),
+                                    string_as_array(&uncompressed)));
+  CHECK_EQ(0, memcmp(uncompressed.data(), input.data(), input.size()));
+
+  // Cutting off the end must be noticed even though more bytes are readable.
+  if (compressed.size() > 1) {
+    CHECK(!snappy::RawUncompressPadded(padded.data(), compressed.size() - 1,
+                                       string_as_array(&uncompressed)));
+  }
+}
+
 // Test that data compressed by a compressor that does not
 // obey block sizes is uncompressed properly.
 static void VerifyNonBlockedCompression(const string& input) {
@@ -583,6 +615,7 @@ static int Verify(const string& input) {
 
   VerifyNonBlockedCompression(input);
   VerifyIOVec(input);
+  VerifyPadded(input);
   if (!input.empty()) {
     const string expanded = Expand(input);
     VerifyNonBlockedCompression(expanded);
@@ -817,214 +850,2596 @@ TEST(Snappy, FourByteOffset) {
   CHECK_EQ(uncompressed, src);
 }
 
-TEST(Snappy, IOVecEdgeCases) {
-  // Test some tricky edge cases in the iovec output that are not necessarily
-  // exercised by random tests.
+// Makes a random string of "len" bytes that compresses moderately well.
+static string RandomCompressibleString(ACMRandom* rnd, size_t len) {
+  string x;
+  while (x.size() < len) {
+    int run_len = 1;
+    if (rnd->OneIn(10)) {
+      run_len = rnd->Skewed(8);
+    }
+    char c = rnd->Skewed(3);
+    while (run_len-- > 0 && x.size() < len) {
+      x += c;
+    }
+  }
+  return x;
+}
 
-  // Our output blocks look like this initially (the last iovec is bigger
-  // than depicted):
-  // [  ] [ ] [    ] [        ] [        ]
-  static const int kLengths[] = { 2, 1, 4, 8, 128 };
+TEST(Snappy, UncompressBatch) {
+  ACMRandom rnd(FLAGS_test_random_seed);
 
-  struct iovec iov[ARRAYSIZE(kLengths)];
-  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
-    iov[i].iov_base = new char[kLengths[i]];
-    iov[i].iov_len = kLengths[i];
+  for (int trial = 0; trial < 50; ++trial) {
+    const int n = rnd.Uniform(12);
+    vector<string> inputs(n), compressed(n), outputs(n);
+    vector<const char*> compressed_ptrs(n);
+    vector<size_t> compressed_lengths(n);
+    vector<char*> output_ptrs(n);
+    bool valid[12];
+    for (int i = 0; i < n; ++i) {
+      inputs[i] = RandomCompressibleString(&rnd, rnd.Skewed(15));
+      snappy::Compress(inputs[i].data(), inputs[i].size(), &compressed[i]);
+      // Corrupt every fifth message, which must not affect the others.
+      if (i % 5 == 4 && compressed[i].size() > 2) {
+        compressed[i][compressed[i].size() / 2] ^= 0x55;
+      }
+      outputs[i].resize(inputs[i].size() + 1);
+      compressed_ptrs[i] = compressed[i].data();
+      compressed_lengths[i] = compressed[i].size();
+      output_ptrs[i] = string_as_array(&outputs[i]);
+    }
+
+    bool all_valid = snappy::RawUncompressBatch(
+        n == 0 ? NULL : &compressed_ptrs[0],
+        n == 0 ? NULL : &compressed_lengths[0],
+        n,
+        n == 0 ? NULL : &output_ptrs[0],
+        valid);
+    bool expected_all_valid = true;
+    for (int i = 0; i < n; ++i) {
+      string expected;
+      bool ok = snappy::Uncompress(compressed[i].data(), compressed[i].size(),
+                                   &expected);
+      CHECK_EQ(ok, valid[i]);
+      expected_all_valid &= ok;
+      if (ok) {
+        CHECK_EQ(0, memcmp(outputs[i].data(), expected.data(),
+                           expected.size()));
+        if (i % 5 != 4) {
+          CHECK_EQ(inputs[i], expected);
+        }
+      }
+    }
+    CHECK_EQ(expected_all_valid, all_valid);
   }
 
-  string compressed;
-  Varint::Append32(&compressed, 22);
+  // A truncated header only fails its own message.
+  const char* bad = "\xf0";
+  string good_input = "xyzzy xyzzy xyzzy xyzzy";
+  string good;
+  snappy::Compress(good_input.data(), good_input.size(), &good);
+  const char* ptrs[] = { bad, good.data() };
+  size_t lengths[] = { 1, good.size() };
+  char out[64];
+  char* out_ptrs[] = { out, out };
+  bool v[2];
+  CHECK(!snappy::RawUncompressBatch(ptrs, lengths, 2, out_ptrs, v));
+  CHECK(!v[0]);
+  CHECK(v[1]);
+  CHECK_EQ(good_input, string(out, good_input.size()));
+}
 
-  // A literal whose output crosses three blocks.
-  // [ab] [c] [123 ] [        ] [        ]
-  AppendLiteral(&compressed, "abc123");
+// Decompresses "compressed" in place from the tail of a buffer of
+// "buf_size" bytes. Returns true iff that succeeded; if so, checks that the
+// result is "input".
+static bool UncompressInPlaceAtTail(const string& input,
+                                    const string& compressed,
+                                    size_t buf_size) {
+  string buf(buf_size, '\xaa');
+  const size_t offset = buf_size - compressed.size();
+  memcpy(string_as_array(&buf) + offset, compressed.data(), compressed.size());
+  if (!snappy::RawUncompressInPlace(string_as_array(&buf), buf_size, offset,
+                                    compressed.size())) {
+    return false;
+  }
+  CHECK_EQ(input, string(buf.data(), input.size()));
+  return true;
+}
 
-  // A copy whose output crosses two blocks (source and destination
-  // segments marked).
-  // [ab] [c] [1231] [23      ] [        ]
-  //           ^--^   --
-  AppendCopy(&compressed, 3, 3);
+TEST(Snappy, UncompressInPlace) {
+  ACMRandom rnd(FLAGS_test_random_seed);
 
-  // A copy where the input is, at first, in the block before the output:
-  //
-  // [ab] [c] [1231] [231231  ] [        ]
-  //           ^---     ^---
-  // Then during the copy, the pointers move such that the input and
-  // output pointers are in the same block:
-  //
-  // [ab] [c] [1231] [23123123] [        ]
-  //                  ^-    ^-
-  // And then they move again, so that the output pointer is no longer
-  // in the same block as the input pointer:
-  // [ab] [c] [1231] [23123123] [123     ]
-  //                    ^--      ^--
-  AppendCopy(&compressed, 6, 9);
+  for (int trial = 0; trial < 200; ++trial) {
+    string input;
+    if (rnd.OneIn(10)) {
+      // Several blocks.
+      input = RandomCompressibleString(&rnd, 2 * snappy::kBlockSize +
+                                       rnd.Uniform(1000));
+    } else if (rnd.OneIn(3)) {
+      // Incompressible; needs nearly all of the margin.
+      for (int len = rnd.Skewed(16); len > 0; --len) {
+        input += static_cast<char>(rnd.Rand8());
+      }
+    } else {
+      input = RandomCompressibleString(&rnd, rnd.Skewed(16));
+      // Incompressible runs between copies make for long literals.
+      for (int i = 0; i < 3; ++i) {
+        const size_t pos = rnd.Uniform(input.size() + 1);
+        string noise;
+        for (int len = rnd.Skewed(9); len > 0; --len) {
+          noise += static_cast<char>(rnd.Rand8());
+        }
+        input.insert(pos, noise);
+      }
+    }
+    string compressed;
+    snappy::Compress(input.data(), input.size(), &compressed);
+
+    // The advertised margin is always enough.
+    const size_t max_size =
+        input.size() + snappy::MaxInPlaceMargin(input.size());
+    CHECK_GE(max_size, compressed.size());
+    CHECK(UncompressInPlaceAtTail(input, compressed, max_size));
+
+    // Smaller buffers must either work or fail cleanly, but never produce
+    // wrong output. Find the smallest one that works.
+    size_t lo = max<size_t>(input.size(), compressed.size());
+    size_t hi = max_size;
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (UncompressInPlaceAtTail(input, compressed, mid)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    for (size_t size = max<size_t>(input.size(), compressed.size());
+         size < lo && size < input.size() + 64; ++size) {
+      UncompressInPlaceAtTail(input, compressed, size);
+    }
 
-  // Finally, a copy where the input is from several blocks back,
-  // and it also crosses three blocks:
-  //
-  // [ab] [c] [1231] [23123123] [123b    ]
-  //   ^                            ^
-  // [ab] [c] [1231] [23123123] [123bc   ]
-  //       ^                         ^
-  // [ab] [c] [1231] [23123123] [123bc12 ]
-  //           ^-                     ^-
-  AppendCopy(&compressed, 17, 4);
+    // Corrupted input must not crash.
+    if (!compressed.empty()) {
+      string corrupted = compressed;
+      corrupted[rnd.Uniform(corrupted.size())] ^= 1 << rnd.Uniform(8);
+      string buf(max_size, '\0');
+      memcpy(string_as_array(&buf) + max_size - corrupted.size(),
+             corrupted.data(), corrupted.size());
+      snappy::RawUncompressInPlace(string_as_array(&buf), max_size,
+                                   max_size - corrupted.size(),
+                                   corrupted.size());
+    }
+  }
 
-  CHECK(snappy::RawUncompressToIOVec(
-      compressed.data(), compressed.size(), iov, ARRAYSIZE(iov)));
-  CHECK_EQ(0, memcmp(iov[0].iov_base, "ab", 2));
-  CHECK_EQ(0, memcmp(iov[1].iov_base, "c", 1));
-  CHECK_EQ(0, memcmp(iov[2].iov_base, "1231", 4));
-  CHECK_EQ(0, memcmp(iov[3].iov_base, "23123123", 8));
-  CHECK_EQ(0, memcmp(iov[4].iov_base, "123bc12", 7));
+  // Bad placements are rejected.
+  string compressed;
+  snappy::Compress("xyzzy", 5, &compressed);
+  char buf[16];
+  CHECK(!snappy::RawUncompressInPlace(buf, sizeof(buf), sizeof(buf),
+                                      compressed.size()));
+  CHECK(!snappy::RawUncompressInPlace(buf, 4, 0, 4));
+
+  // Output that would overtake the input fails rather than corrupting it.
+  string zeros(10000, '\0');
+  snappy::Compress(zeros.data(), zeros.size(), &compressed);
+  string zbuf(zeros.size(), '\xaa');
+  memcpy(string_as_array(&zbuf), compressed.data(), compressed.size());
+  CHECK(!snappy::RawUncompressInPlace(string_as_array(&zbuf), zbuf.size(), 0,
+                                      compressed.size()));
+  CHECK(UncompressInPlaceAtTail(zeros, compressed, zeros.size()));
+}
 
-  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
-    delete[] reinterpret_cast<char *>(iov[i].iov_base);
+TEST(Snappy, UniformInput) {
+  // Uniform fragments bypass CompressFragment(), but must compress to
+  // exactly what it would have produced.
+  snappy::internal::WorkingMemory wmem;
+  for (int len = 0; len < 300; ++len) {
+    for (int c = 0; c < 256; c += 85) {
+      const string input(len, static_cast<char>(c));
+      string compressed;
+      snappy::Compress(input.data(), input.size(), &compressed);
+
+      string expected(snappy::MaxCompressedLength(len), '\0');
+      char* dest = string_as_array(&expected);
+      char* p = snappy::Varint::Encode32(dest, len);
+      int table_size;
+      uint16* table = wmem.GetHashTable(len, &table_size);
+      char* end = snappy::internal::CompressFragment(input.data(), len, p,
+                                                     table, table_size);
+      expected.resize(end - dest);
+      CHECK_EQ(expected, compressed);
+    }
+  }
+
+  // A zeroed page spanning several blocks, with and without a single
+  // non-zero byte somewhere in it.
+  ACMRandom rnd(FLAGS_test_random_seed);
+  for (int i = 0; i < 10; ++i) {
+    string page(3 * snappy::kBlockSize + rnd.Uniform(100), '\0');
+    Verify(page);
+    page[rnd.Uniform(page.size())] = 1 + rnd.Uniform(255);
+    Verify(page);
   }
 }
 
-TEST(Snappy, IOVecLiteralOverflow) {
-  static const int kLengths[] = { 3, 4 };
+TEST(Snappy, ConcatenateCompressed) {
+  ACMRandom rnd(FLAGS_test_random_seed);
 
-  struct iovec iov[ARRAYSIZE(kLengths)];
-  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
-    iov[i].iov_base = new char[kLengths[i]];
-    iov[i].iov_len = kLengths[i];
+  for (int trial = 0; trial < 20; ++trial) {
+    const int n = rnd.Uniform(6);
+    vector<string> compressed(n);
+    vector<const char*> ptrs(n);
+    vector<size_t> lengths(n);
+    string expected;
+    for (int i = 0; i < n; ++i) {
+      const string input = RandomCompressibleString(&rnd, rnd.Skewed(18));
+      expected += input;
+      snappy::Compress(input.data(), input.size(), &compressed[i]);
+      ptrs[i] = compressed[i].data();
+      lengths[i] = compressed[i].size();
+    }
+    string output = "junk";
+    CHECK(snappy::ConcatenateCompressed(n == 0 ? NULL : &ptrs[0],
+                                        n == 0 ? NULL : &lengths[0],
+                                        n, &output));
+    string uncompressed;
+    CHECK(snappy::Uncompress(output.data(), output.size(), &uncompressed));
+    CHECK_EQ(expected, uncompressed);
   }
 
-  string compressed;
-  Varint::Append32(&compressed, 8);
+  // A malformed header is rejected.
+  const char* bad = "\xff\xff";
+  size_t bad_length = 2;
+  string output;
+  CHECK(!snappy::ConcatenateCompressed(&bad, &bad_length, 1, &output));
+}
 
-  AppendLiteral(&compressed, "12345678");
+TEST(Snappy, SplitCompressed) {
+  ACMRandom rnd(FLAGS_test_random_seed);
 
-  CHECK(!snappy::RawUncompressToIOVec(
-      compressed.data(), compressed.size(), iov, ARRAYSIZE(iov)));
+  for (int trial = 0; trial < 10; ++trial) {
+    const string input = RandomCompressibleString(
+        &rnd, rnd.Uniform(5 * snappy::kBlockSize));
+    string compressed;
+    snappy::Compress(input.data(), input.size(), &compressed);
+
+    const size_t min_part_length =
+        rnd.OneIn(2) ? snappy::kBlockSize : rnd.Uniform(3 * snappy::kBlockSize);
+    vector<string> parts;
+    CHECK(snappy::SplitCompressed(compressed.data(), compressed.size(),
+                                  min_part_length, &parts));
+    CHECK(!parts.empty());
+
+    // Compress() output can be cut at every block boundary.
+    const size_t num_blocks =
+        (input.size() + snappy::kBlockSize - 1) / snappy::kBlockSize;
+    if (min_part_length == snappy::kBlockSize) {
+      CHECK_EQ(max<size_t>(num_blocks, 1), parts.size());
+    }
 
-  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
-    delete[] reinterpret_cast<char *>(iov[i].iov_base);
+    string joined;
+    vector<const char*> ptrs;
+    vector<size_t> lengths;
+    for (size_t i = 0; i < parts.size(); ++i) {
+      string uncompressed;
+      CHECK(snappy::Uncompress(parts[i].data(), parts[i].size(),
+                               &uncompressed));
+      if (i + 1 < parts.size()) {
+        CHECK_EQ(0, uncompressed.size() % snappy::kBlockSize);
+        CHECK_GE(uncompressed.size(), min_part_length);
+      }
+      joined += uncompressed;
+      ptrs.push_back(parts[i].data());
+      lengths.push_back(parts[i].size());
+    }
+    CHECK_EQ(input, joined);
+
+    // Putting the parts back together gives the original buffer.
+    string rejoined;
+    CHECK(snappy::ConcatenateCompressed(&ptrs[0], &lengths[0], parts.size(),
+                                        &rejoined));
+    CHECK_EQ(compressed, rejoined);
   }
+
+  // A copy that reaches back across a block boundary prevents a cut there.
+  string stream;
+  snappy::Varint::Append32(&stream, snappy::kBlockSize + 8);
+  string literal(snappy::kBlockSize, 'x');
+  literal[snappy::kBlockSize - 1] = 'y';
+  AppendLiteral(&stream, literal);
+  AppendCopy(&stream, 4, 8);
+  vector<string> parts;
+  CHECK(snappy::SplitCompressed(stream.data(), stream.size(), 0, &parts));
+  CHECK_EQ(1, parts.size());
+  CHECK_EQ(stream, parts[0]);
+
+  // Corrupted input is rejected.
+  stream.resize(stream.size() - 1);
+  CHECK(!snappy::SplitCompressed(stream.data(), stream.size(), 0, &parts));
 }
 
-TEST(Snappy, IOVecCopyOverflow) {
-  static const int kLengths[] = { 3, 4 };
+static vector<size_t> FindAllNaive(const string& haystack,
+                                   const string& needle) {
+  vector<size_t> result;
+  if (needle.empty()) {
+    return result;
+  }
+  for (size_t pos = haystack.find(needle); pos != string::npos;
+       pos = haystack.find(needle, pos + 1)) {
+    result.push_back(pos);
+  }
+  return result;
+}
 
-  struct iovec iov[ARRAYSIZE(kLengths)];
-  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
-    iov[i].iov_base = new char[kLengths[i]];
-    iov[i].iov_len = kLengths[i];
+TEST(Snappy, FindInCompressed) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+
+  for (int trial = 0; trial < 100; ++trial) {
+    const string input = RandomCompressibleString(
+        &rnd, rnd.OneIn(10) ? rnd.Uniform(3 * snappy::kBlockSize)
+                            : rnd.Skewed(14));
+    string compressed;
+    snappy::Compress(input.data(), input.size(), &compressed);
+
+    for (int i = 0; i < 5; ++i) {
+      string pattern;
+      if (!input.empty() && !rnd.OneIn(5)) {
+        const size_t len = 1 + rnd.Skewed(7);
+        const size_t pos = rnd.Uniform(input.size());
+        pattern = input.substr(pos, len);
+      } else {
+        pattern = RandomCompressibleString(&rnd, rnd.Uniform(5));
+      }
+      vector<size_t> offsets;
+      CHECK(snappy::FindInCompressed(compressed.data(), compressed.size(),
+                                     pattern.data(), pattern.size(),
+                                     &offsets));
+      CHECK(FindAllNaive(input, pattern) == offsets);
+    }
   }
 
-  string compressed;
-  Varint::Append32(&compressed, 8);
+  // A copy from further back than the window falls back to decompressing.
+  string far_input = RandomCompressibleString(&rnd, 70000);
+  string stream;
+  snappy::Varint::Append32(&stream, far_input.size() + 20);
+  AppendLiteral(&stream, far_input);
+  AppendCopy(&stream, 69000, 20);
+  string uncompressed;
+  CHECK(snappy::Uncompress(stream.data(), stream.size(), &uncompressed));
+  const string pattern = uncompressed.substr(far_input.size() - 3, 6);
+  vector<size_t> offsets;
+  CHECK(snappy::FindInCompressed(stream.data(), stream.size(),
+                                 pattern.data(), pattern.size(), &offsets));
+  CHECK(FindAllNaive(uncompressed, pattern) == offsets);
+
+  // Corrupted input is rejected.
+  stream.resize(stream.size() - 1);
+  CHECK(!snappy::FindInCompressed(stream.data(), stream.size(),
+                                  pattern.data(), pattern.size(), &offsets));
+
+  // A copy whose source is held before the window slides to make room for
+  // it, but not after.
+  string literals;
+  for (int i = 0; i < 2 * 65536; ++i) {
+    literals.push_back(rnd.Rand8());
+  }
+  stream.clear();
+  snappy::Varint::Append32(&stream, literals.size() + 64);
+  AppendLiteral(&stream, literals.substr(0, 65536));
+  AppendLiteral(&stream, literals.substr(65536));
+  AppendCopy(&stream, 131000, 64);
+  CHECK(snappy::IsValidCompressedBuffer(stream.data(), stream.size()));
+  CHECK(snappy::Uncompress(stream.data(), stream.size(), &uncompressed));
+  const string copied = uncompressed.substr(literals.size() + 10, 6);
+  CHECK(snappy::FindInCompressed(stream.data(), stream.size(),
+                                 copied.data(), copied.size(), &offsets));
+  CHECK(FindAllNaive(uncompressed, copied) == offsets);
+  CHECK_GE(offsets.size(), 2);
+}
 
-  AppendLiteral(&compressed, "123");
-  AppendCopy(&compressed, 3, 5);
+TEST(Snappy, Crc32c) {
+  // Test vectors from RFC 3720, section B.4.
+  char buf[32];
+  memset(buf, 0, sizeof(buf));
+  CHECK_EQ(0x8a9136aa, snappy::crc32c::Value(buf, sizeof(buf)));
+  memset(buf, 0xff, sizeof(buf));
+  CHECK_EQ(0x62a8ab43, snappy::crc32c::Value(buf, sizeof(buf)));
+  for (int i = 0; i < 32; ++i) {
+    buf[i] = i;
+  }
+  CHECK_EQ(0x46dd794e, snappy::crc32c::Value(buf, sizeof(buf)));
+  for (int i = 0; i < 32; ++i) {
+    buf[i] = 31 - i;
+  }
+  CHECK_EQ(0x113fdb5c, snappy::crc32c::Value(buf, sizeof(buf)));
+  CHECK_EQ(0xe3069283, snappy::crc32c::Value("123456789", 9));
 
-  CHECK(!snappy::RawUncompressToIOVec(
-      compressed.data(), compressed.size(), iov, ARRAYSIZE(iov)));
+  // Extending at any split point gives the checksum of the whole.
+  ACMRandom rnd(FLAGS_test_random_seed);
+  const string data = RandomCompressibleString(&rnd, 1000);
+  const uint32 crc = snappy::crc32c::Value(data.data(), data.size());
+  for (size_t split = 0; split <= data.size(); split += 7) {
+    const uint32 head = snappy::crc32c::Value(data.data(), split);
+    CHECK_EQ(crc, snappy::crc32c::Extend(head, data.data() + split,
+                                         data.size() - split));
+  }
 
-  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
-    delete[] reinterpret_cast<char *>(iov[i].iov_base);
+  for (size_t split = 0; split <= data.size(); split += 7) {
+    const uint32 head = snappy::crc32c::Value(data.data(), split);
+    const uint32 tail = snappy::crc32c::Value(data.data() + split,
+                                              data.size() - split);
+    CHECK_EQ(crc, snappy::crc32c::Combine(head, tail, data.size() - split));
   }
+
+  CHECK_NE(crc, snappy::crc32c::Mask(crc));
+  CHECK_EQ(crc, snappy::crc32c::Unmask(snappy::crc32c::Mask(crc)));
 }
 
+TEST(Snappy, UncompressAndChecksum) {
+  ACMRandom rnd(FLAGS_test_random_seed);
 
-static bool CheckUncompressedLength(const string& compressed,
-                                    size_t* ulength) {
-  const bool result1 = snappy::GetUncompressedLength(compressed.data(),
-                                                     compressed.size(),
-                                                     ulength);
+  for (int trial = 0; trial < 50; ++trial) {
+    const string input = RandomCompressibleString(
+        &rnd, rnd.OneIn(5) ? rnd.Uniform(5 * snappy::kBlockSize)
+                           : rnd.Skewed(16));
+    string compressed;
+    snappy::Compress(input.data(), input.size(), &compressed);
+
+    string uncompressed;
+    uint32 crc = 0;
+    CHECK(snappy::UncompressAndChecksum(compressed.data(), compressed.size(),
+                                        &uncompressed, &crc));
+    CHECK_EQ(input, uncompressed);
+    CHECK_EQ(snappy::crc32c::Value(input.data(), input.size()), crc);
+  }
 
-  snappy::ByteArraySource source(compressed.data(), compressed.size());
-  uint32 length;
-  const bool result2 = snappy::GetUncompressedLength(&source, &length);
-  CHECK_EQ(result1, result2);
-  return result1;
+  string input = RandomCompressibleString(&rnd, 100000);
+  string compressed;
+  snappy::Compress(input.data(), input.size(), &compressed);
+  compressed.resize(compressed.size() - 1);
+  string uncompressed;
+  uint32 crc = 0;
+  CHECK(!snappy::UncompressAndChecksum(compressed.data(), compressed.size(),
+                                       &uncompressed, &crc));
+  CHECK_EQ(0, crc);
 }
 
-TEST(SnappyCorruption, TruncatedVarint) {
-  string compressed, uncompressed;
-  size_t ulength;
-  compressed.push_back('\xf0');
-  CHECK(!CheckUncompressedLength(compressed, &ulength));
-  CHECK(!snappy::IsValidCompressedBuffer(compressed.data(), compressed.size()));
-  CHECK(!snappy::Uncompress(compressed.data(), compressed.size(),
-                            &uncompressed));
+TEST(Snappy, CompressAndChecksum) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+
+  for (int trial = 0; trial < 50; ++trial) {
+    const string input = RandomCompressibleString(
+        &rnd, rnd.OneIn(5) ? rnd.Uniform(5 * snappy::kBlockSize)
+                           : rnd.Skewed(16));
+    string expected;
+    snappy::Compress(input.data(), input.size(), &expected);
+
+    string compressed(snappy::MaxCompressedLength(input.size()), '\0');
+    size_t compressed_length;
+    vector<uint32> block_crcs;
+    uint32 stream_crc;
+    snappy::RawCompressAndChecksum(input.data(), input.size(),
+                                   string_as_array(&compressed),
+                                   &compressed_length,
+                                   &block_crcs, &stream_crc);
+    compressed.resize(compressed_length);
+    CHECK_EQ(expected, compressed);
+
+    CHECK_EQ(snappy::crc32c::Value(input.data(), input.size()), stream_crc);
+    CHECK_EQ((input.size() + snappy::kBlockSize - 1) / snappy::kBlockSize,
+             block_crcs.size());
+    for (size_t i = 0; i < block_crcs.size(); ++i) {
+      const size_t start = i * snappy::kBlockSize;
+      const size_t len = min(snappy::kBlockSize, input.size() - start);
+      CHECK_EQ(snappy::crc32c::Value(input.data() + start, len),
+               block_crcs[i]);
+    }
+
+    // Either output may be omitted.
+    uint32 stream_crc_only;
+    snappy::RawCompressAndChecksum(input.data(), input.size(),
+                                   string_as_array(&compressed),
+                                   &compressed_length,
+                                   NULL, &stream_crc_only);
+    CHECK_EQ(stream_crc, stream_crc_only);
+  }
 }
 
-TEST(SnappyCorruption, UnterminatedVarint) {
-  string compressed, uncompressed;
-  size_t ulength;
-  compressed.push_back(128);
-  compressed.push_back(128);
-  compressed.push_back(128);
-  compressed.push_back(128);
-  compressed.push_back(128);
-  compressed.push_back(10);
-  CHECK(!CheckUncompressedLength(compressed, &ulength));
-  CHECK(!snappy::IsValidCompressedBuffer(compressed.data(), compressed.size()));
+TEST(Snappy, Session) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  snappy::SessionCompressor compressor;
+  snappy::SessionUncompressor uncompressor;
+
+  // Messages that share most of their content with earlier ones, but not
+  // with themselves.
+  string base;
+  for (int i = 0; i < 2000; ++i) {
+    base += static_cast<char>(rnd.Rand8());
+  }
+  size_t session_bytes = 0;
+  size_t single_bytes = 0;
+  for (int i = 0; i < 500; ++i) {
+    string message;
+    if (rnd.OneIn(50)) {
+      // Bigger than the history and the session buffers.
+      message = RandomCompressibleString(&rnd, 300000 + rnd.Uniform(10000));
+    } else if (!rnd.OneIn(20)) {
+      message = base.substr(rnd.Uniform(base.size()), rnd.Skewed(11));
+      message += StringPrintf("%d", i);
+    }
+
+    string compressed;
+    const size_t compressed_length =
+        compressor.Compress(message.data(), message.size(), &compressed);
+    CHECK_EQ(compressed_length, compressed.size());
+    string uncompressed;
+    CHECK(uncompressor.Uncompress(compressed.data(), compressed.size(),
+                                  &uncompressed));
+    CHECK_EQ(message, uncompressed);
+
+    if (message.size() < 10000) {
+      string single;
+      session_bytes += compressed.size();
+      single_bytes += snappy::Compress(message.data(), message.size(),
+                                       &single);
+    }
+
+    if (rnd.OneIn(100)) {
+      // A new session starts with an ordinary compressed buffer.
+      compressor.Reset();
+      uncompressor.Reset();
+      compressor.Compress(message.data(), message.size(), &compressed);
+      CHECK(snappy::Uncompress(compressed.data(), compressed.size(),
+                               &uncompressed));
+      CHECK_EQ(message, uncompressed);
+      CHECK(uncompressor.Uncompress(compressed.data(), compressed.size(),
+                                    &uncompressed));
+    }
+  }
+  CHECK_LT(session_bytes * 2, single_bytes);
+
+  // A message that needs the history fails without it, and a corrupted
+  // message leaves the history alone.
+  compressor.Reset();
+  uncompressor.Reset();
+  string compressed;
+  string uncompressed;
+  compressor.Compress(base.data(), base.size(), &compressed);
+  compressor.Compress(base.data(), base.size(), &compressed);
   CHECK(!snappy::Uncompress(compressed.data(), compressed.size(),
                             &uncompressed));
+  string first;
+  snappy::Compress(base.data(), base.size(), &first);
+  CHECK(uncompressor.Uncompress(first.data(), first.size(), &uncompressed));
+  CHECK(!uncompressor.Uncompress(compressed.data(), compressed.size() - 1,
+                                 &uncompressed));
+  CHECK(uncompressor.Uncompress(compressed.data(), compressed.size(),
+                                &uncompressed));
+  CHECK_EQ(base, uncompressed);
 }
 
-TEST(Snappy, ReadPastEndOfBuffer) {
-  // Check that we do not read past end of input
+TEST(Snappy, DeltaCompress) {
+  ACMRandom rnd(FLAGS_test_random_seed);
 
-  // Make a compressed string that ends with a single-byte literal
-  string compressed;
-  Varint::Append32(&compressed, 1);
-  AppendLiteral(&compressed, "x");
+  for (int trial = 0; trial < 20; ++trial) {
+    // An incompressible reference, and a new version with a few edits.
+    string reference;
+    const size_t reference_length =
+        rnd.OneIn(5) ? rnd.Uniform(100) : rnd.Uniform(1 << 20);
+    for (size_t i = 0; i < reference_length; ++i) {
+      reference += static_cast<char>(rnd.Rand8());
+    }
+    string input = reference;
+    for (int edit = rnd.Uniform(20); edit > 0 && !input.empty(); --edit) {
+      const size_t pos = rnd.Uniform(input.size());
+      const size_t len = min<size_t>(input.size() - pos, rnd.Skewed(10));
+      switch (rnd.Uniform(3)) {
+        case 0:
+          input.erase(pos, len);
+          break;
+        case 1:
+          input.insert(pos, RandomCompressibleString(&rnd, len));
+          break;
+        default:
+          input.replace(pos, len, RandomCompressibleString(&rnd, len));
+          break;
+      }
+    }
 
+    string delta;
+    CHECK(snappy::DeltaCompress(reference.data(), reference.size(),
+                                input.data(), input.size(), &delta));
+    CHECK_LE(delta.size(), snappy::MaxCompressedLength(input.size()));
+    string uncompressed;
+    CHECK(snappy::DeltaUncompress(reference.data(), reference.size(),
+                                  delta.data(), delta.size(),
+                                  &uncompressed));
+    CHECK_EQ(input, uncompressed);
+    if (input.size() > 10000) {
+      // A far copy costs five bytes per 64 bytes copied, so about 8%.
+      CHECK_LT(delta.size() * 10, input.size());
+
+      // The reference is required.
+      CHECK(!snappy::Uncompress(delta.data(), delta.size(), &uncompressed));
+      CHECK(!snappy::DeltaUncompress(reference.data(), reference.size() / 2,
+                                     delta.data(), delta.size(),
+                                     &uncompressed));
+    }
+  }
+
+  // Without a reference, this is ordinary compression.
+  const string input = RandomCompressibleString(&rnd, 100000);
+  string delta;
+  CHECK(snappy::DeltaCompress(NULL, 0, input.data(), input.size(), &delta));
   string uncompressed;
-  DataEndingAtUnreadablePage c(compressed);
-  CHECK(snappy::Uncompress(c.data(), c.size(), &uncompressed));
-  CHECK_EQ(uncompressed, string("x"));
+  CHECK(snappy::Uncompress(delta.data(), delta.size(), &uncompressed));
+  CHECK_EQ(input, uncompressed);
+  CHECK(snappy::DeltaUncompress(NULL, 0, delta.data(), delta.size(),
+                                &uncompressed));
+  CHECK_EQ(input, uncompressed);
+  CHECK(!snappy::DeltaUncompress(NULL, 0, delta.data(), delta.size() - 1,
+                                 &uncompressed));
 }
 
-// Check for an infinite loop caused by a copy with offset==0
-TEST(Snappy, ZeroOffsetCopy) {
-  const char* compressed = "\x40\x12\x00\x00";
-  //  \x40              Length (must be > kMaxIncrementCopyOverflow)
-  //  \x12\x00\x00      Copy with offset==0, length==5
-  char uncompressed[100];
-  EXPECT_FALSE(snappy::RawUncompress(compressed, 4, uncompressed));
-}
+// A Source that yields "data" in pieces of random sizes.
+class FragmentedSource : public snappy::Source {
+ public:
+  FragmentedSource(const string& data, ACMRandom* rnd)
+      : data_(data), pos_(0), rnd_(rnd) {
+    NextFragment();
+  }
+  virtual ~FragmentedSource() { }
 
-TEST(Snappy, ZeroOffsetCopyValidation) {
-  const char* compressed = "\x05\x12\x00\x00";
-  //  \x05              Length
-  //  \x12\x00\x00      Copy with offset==0, length==5
-  EXPECT_FALSE(snappy::IsValidCompressedBuffer(compressed, 4));
-}
+  virtual size_t Available() const { return data_.size() - pos_; }
 
+  virtual const char* Peek(size_t* len) {
+    *len = fragment_size_;
+    return data_.data() + pos_;
+  }
 
-namespace {
+  virtual void Skip(size_t n) {
+    CHECK_LE(n, Available());
+    pos_ += n;
+    fragment_size_ = n <= fragment_size_ ? fragment_size_ - n : 0;
+    if (fragment_size_ == 0) {
+      NextFragment();
+    }
+  }
 
-int TestFindMatchLength(const char* s1, const char *s2, unsigned length) {
-  return snappy::internal::FindMatchLength(s1, s2, s2 + length);
-}
+ private:
+  void NextFragment() {
+    fragment_size_ = min<size_t>(Available(), 1 + rnd_->Skewed(20));
+  }
 
-}  // namespace
+  const string& data_;
+  size_t pos_;
+  size_t fragment_size_;
+  ACMRandom* rnd_;
+};
 
-TEST(Snappy, FindMatchLength) {
-  // Exercise all different code paths through the function.
-  // 64-bit version:
+// A Sink that appends to a string.
+class AppendingSink : public snappy::Sink {
+ public:
+  explicit AppendingSink(string* dest) : dest_(dest) { }
+  virtual ~AppendingSink() { }
 
-  // Hit s1_limit in 64-bit loop, hit s1_limit in single-character loop.
-  EXPECT_EQ(6, TestFindMatchLength("012345", "012345", 6));
-  EXPECT_EQ(11, TestFindMatchLength("01234567abc", "01234567abc", 11));
+  virtual void Append(const char* bytes, size_t n) {
+    dest_->append(bytes, n);
+  }
 
-  // Hit s1_limit in 64-bit loop, find a non-match in single-character loop.
-  EXPECT_EQ(9, TestFindMatchLength("01234567abc", "01234567axc", 9));
+ private:
+  string* dest_;
+};
 
-  // Same, but edge cases.
-  EXPECT_EQ(11, TestFindMatchLength("01234567abc!", "01234567abc!", 11));
-  EXPECT_EQ(11, TestFindMatchLength("01234567abc!", "01234567abc?", 11));
+TEST(Snappy, CompressLarge) {
+  ACMRandom rnd(FLAGS_test_random_seed);
 
-  // Find non-match at once in first loop.
-  EXPECT_EQ(0, TestFindMatchLength("01234567xxxxxxxx", "?1234567xxxxxxxx", 16));
-  EXPECT_EQ(1, TestFindMatchLength("01234567xxxxxxxx", "0?234567xxxxxxxx", 16));
+  const size_t kMiB = 1 << 20;
+  const size_t sizes[] = { 0, 1, 100000, kMiB, kMiB + 1, 3 * kMiB + 12345 };
+  for (size_t i = 0; i < ARRAYSIZE(sizes); ++i) {
+    const string input = RandomCompressibleString(&rnd, sizes[i]);
+    string compressed;
+    FragmentedSource source(input, &rnd);
+    AppendingSink sink(&compressed);
+    CHECK_EQ(snappy::CompressLarge(&source, &sink), compressed.size());
+    CHECK_EQ(0, source.Available());
+
+    size_t length;
+    CHECK(snappy::GetLargeUncompressedLength(compressed.data(),
+                                             compressed.size(), &length));
+    CHECK_EQ(input.size(), length);
+
+    string uncompressed;
+    FragmentedSource compressed_source(compressed, &rnd);
+    AppendingSink uncompressed_sink(&uncompressed);
+    CHECK(snappy::UncompressLarge(&compressed_source, &uncompressed_sink));
+    CHECK_EQ(input, uncompressed);
+
+    if (!compressed.empty()) {
+      uncompressed.clear();
+      snappy::ByteArraySource truncated(compressed.data(),
+                                        compressed.size() - 1);
+      CHECK(!snappy::UncompressLarge(&truncated, &uncompressed_sink));
+    }
+  }
+
+  // The length can go beyond 32 bits.
+  string header;
+  char buf[snappy::Varint::kMax64];
+  const uint64 kFiveGiB = static_cast<uint64>(5) << 30;
+  header.assign(buf, snappy::Varint::Encode64(buf, kFiveGiB) - buf);
+  size_t length;
+  if (sizeof(size_t) > 4) {
+    CHECK(snappy::GetLargeUncompressedLength(header.data(), header.size(),
+                                             &length));
+    CHECK_EQ(kFiveGiB, length);
+  } else {
+    CHECK(!snappy::GetLargeUncompressedLength(header.data(), header.size(),
+                                              &length));
+  }
+  string uncompressed;
+  snappy::ByteArraySource source(header.data(), header.size());
+  AppendingSink sink(&uncompressed);
+  CHECK(!snappy::UncompressLarge(&source, &sink));
+}
+
+TEST(Snappy, UncompressingSource) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+
+  for (int trial = 0; trial < 50; ++trial) {
+    const string input = RandomCompressibleString(
+        &rnd, rnd.OneIn(5) ? rnd.Uniform(5 * snappy::kBlockSize)
+                           : rnd.Skewed(16));
+    string compressed;
+    snappy::Compress(input.data(), input.size(), &compressed);
+
+    // Read all of it in random steps.
+    FragmentedSource compressed_source(compressed, &rnd);
+    snappy::UncompressingSource source(&compressed_source);
+    string uncompressed;
+    while (source.Available() > 0) {
+      CHECK_EQ(input.size() - uncompressed.size(), source.Available());
+      size_t len;
+      const char* data = source.Peek(&len);
+      CHECK_GT(len, 0);
+      len = min<size_t>(len, 1 + rnd.Skewed(17));
+      uncompressed.append(data, len);
+      source.Skip(len);
+    }
+    CHECK(source.ok());
+    CHECK_EQ(input, uncompressed);
+
+    // Skipping over data does not need to look at it.
+    if (!input.empty()) {
+      snappy::ByteArraySource compressed_source2(compressed.data(),
+                                                 compressed.size());
+      snappy::UncompressingSource source2(&compressed_source2);
+      const size_t skip = rnd.Uniform(input.size());
+      source2.Skip(skip);
+      size_t len;
+      const char* data = source2.Peek(&len);
+      CHECK_EQ(input.substr(skip, len), string(data, len));
+    }
+
+    // It composes with other consumers of Sources.
+    snappy::ByteArraySource compressed_source3(compressed.data(),
+                                               compressed.size());
+    snappy::UncompressingSource source3(&compressed_source3);
+    string recompressed;
+    AppendingSink sink(&recompressed);
+    snappy::Compress(&source3, &sink);
+    CHECK_EQ(compressed, recompressed);
+  }
+
+  // Reading only the start of a big stream only decompresses the start.
+  const string input = RandomCompressibleString(&rnd, 1 << 20);
+  string compressed;
+  snappy::Compress(input.data(), input.size(), &compressed);
+  {
+    snappy::ByteArraySource compressed_source(compressed.data(),
+                                              compressed.size());
+    snappy::UncompressingSource source(&compressed_source);
+    size_t len;
+    const char* data = source.Peek(&len);
+    CHECK_EQ(input.substr(0, 10), string(data, 10));
+    CHECK_GT(compressed_source.Available(), compressed.size() / 2);
+  }
+
+  // Corrupted data ends the source early.
+  compressed[compressed.size() / 2] ^= 0x3;
+  compressed.resize(compressed.size() - 10);
+  snappy::ByteArraySource compressed_source(compressed.data(),
+                                            compressed.size());
+  snappy::UncompressingSource source(&compressed_source);
+  size_t total = 0;
+  while (source.Available() > 0) {
+    size_t len;
+    source.Peek(&len);
+    source.Skip(len);
+    total += len;
+  }
+  CHECK(!source.ok());
+  CHECK_LT(total, input.size());
+}
+
+TEST(Snappy, CompressingSource) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+
+  for (int trial = 0; trial < 50; ++trial) {
+    const string input = RandomCompressibleString(
+        &rnd, rnd.OneIn(5) ? rnd.Uniform(5 * snappy::kBlockSize)
+                           : rnd.Skewed(16));
+    string compressed;
+    snappy::Compress(input.data(), input.size(), &compressed);
+
+    // Read all of it in random steps; it is what Compress() produces.
+    FragmentedSource input_source(input, &rnd);
+    snappy::CompressingSource source(&input_source);
+    string output;
+    while (source.Available() > 0) {
+      size_t len;
+      const char* data = source.Peek(&len);
+      CHECK_EQ(source.Available(), len);
+      len = min<size_t>(len, 1 + rnd.Skewed(17));
+      output.append(data, len);
+      source.Skip(len);
+    }
+    CHECK_EQ(compressed, output);
+
+    // It composes with UncompressingSource.
+    snappy::ByteArraySource input_source2(input.data(), input.size());
+    snappy::CompressingSource source2(&input_source2);
+    snappy::UncompressingSource source3(&source2);
+    string uncompressed;
+    while (source3.Available() > 0) {
+      size_t len;
+      const char* data = source3.Peek(&len);
+      uncompressed.append(data, len);
+      source3.Skip(len);
+    }
+    CHECK(source3.ok());
+    CHECK_EQ(input, uncompressed);
+  }
+
+  // Reading only the start of the output only compresses the start.
+  const string input = RandomCompressibleString(&rnd, 1 << 20);
+  snappy::ByteArraySource input_source(input.data(), input.size());
+  snappy::CompressingSource source(&input_source);
+  size_t len;
+  source.Peek(&len);
+  source.Skip(len);
+  CHECK_EQ(input.size() - snappy::kBlockSize, input_source.Available());
+}
+
+// A Source that ends "missing" bytes before the length its Available()
+// gives, like a FileSource whose read fails.
+class ShortSource : public snappy::Source {
+ public:
+  ShortSource(snappy::Source* source, size_t missing)
+      : source_(source), missing_(missing) { }
+  virtual ~ShortSource() { }
+
+  virtual size_t Available() const {
+    return source_->Available() + missing_;
+  }
+  virtual const char* Peek(size_t* len) { return source_->Peek(len); }
+  virtual void Skip(size_t n) { source_->Skip(n); }
+
+ private:
+  snappy::Source* source_;
+  const size_t missing_;
+};
+
+TEST(Snappy, CompressShortSource) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+
+  for (int trial = 0; trial < 20; ++trial) {
+    // Also end right at a block boundary, where nothing is left to peek.
+    const size_t length = trial % 4 == 0
+        ? (1 + rnd.Uniform(4)) * snappy::kBlockSize
+        : rnd.Uniform(5 * snappy::kBlockSize);
+    const string input = RandomCompressibleString(&rnd, length);
+    const size_t missing = 1 + rnd.Uniform(2 * snappy::kBlockSize);
+
+    // Nothing is made up for the missing bytes; the output does not
+    // decompress.
+    {
+      FragmentedSource fragments(input, &rnd);
+      ShortSource source(&fragments, missing);
+      string compressed;
+      snappy::StringSink sink(&compressed);
+      CHECK_EQ(0, snappy::Compress(&source, &sink));
+      string uncompressed;
+      CHECK(!snappy::Uncompress(compressed.data(), compressed.size(),
+                                &uncompressed));
+    }
+    {
+      FragmentedSource fragments(input, &rnd);
+      ShortSource source(&fragments, missing);
+      string compressed;
+      snappy::StringSink sink(&compressed);
+      CHECK_EQ(0, snappy::CompressLarge(&source, &sink));
+    }
+    {
+      FragmentedSource fragments(input, &rnd);
+      ShortSource source(&fragments, missing);
+      snappy::CompressingSource compressing(&source);
+      string compressed;
+      while (compressing.Available() > 0) {
+        size_t len;
+        const char* data = compressing.Peek(&len);
+        compressed.append(data, len);
+        compressing.Skip(len);
+      }
+      CHECK(!compressing.ok());
+      string uncompressed;
+      CHECK(!snappy::Uncompress(compressed.data(), compressed.size(),
+                                &uncompressed));
+    }
+  }
+}
+
+// An Allocator that checks that everything it hands out is freed once,
+// with the size it was allocated with.
+class CheckingAllocator : public snappy::Allocator {
+ public:
+  CheckingAllocator() : allocations_(0), live_bytes_(0), peak_bytes_(0) { }
+  virtual ~CheckingAllocator() { CHECK(live_.empty()); }
+
+  virtual void* Allocate(size_t size) {
+    void* ptr = ::operator new(size);
+    live_[ptr] = size;
+    ++allocations_;
+    live_bytes_ += size;
+    peak_bytes_ = max(peak_bytes_, live_bytes_);
+    return ptr;
+  }
+
+  virtual void Deallocate(void* ptr, size_t size) {
+    CHECK(ptr != NULL);
+    CHECK_EQ(1, live_.count(ptr));
+    CHECK_EQ(live_[ptr], size);
+    live_.erase(ptr);
+    live_bytes_ -= size;
+    ::operator delete(ptr);
+  }
+
+  int allocations() const { return allocations_; }
+  size_t live() const { return live_.size(); }
+  // The most bytes that were allocated at the same time.
+  size_t peak_bytes() const { return peak_bytes_; }
+
+ private:
+  std::map<void*, size_t> live_;
+  int allocations_;
+  size_t live_bytes_;
+  size_t peak_bytes_;
+};
+
+// Runs most kinds of compression and decompression on "input".
+static void ExerciseAllocations(const string& input, ACMRandom* rnd) {
+  string compressed, uncompressed, output;
+  snappy::Compress(input.data(), input.size(), &compressed);
+  {
+    FragmentedSource source(input, rnd);
+    AppendingSink sink(&output);
+    snappy::Compress(&source, &sink);
+    CHECK_EQ(compressed, output);
+  }
+  {
+    snappy::SessionCompressor compressor;
+    snappy::SessionUncompressor uncompressor;
+    for (int i = 0; i < 2; ++i) {
+      compressor.Compress(input.data(), input.size(), &output);
+      CHECK(uncompressor.Uncompress(output.data(), output.size(),
+                                    &uncompressed));
+      CHECK_EQ(input, uncompressed);
+    }
+  }
+  CHECK(snappy::DeltaCompress(compressed.data(), compressed.size(),
+                              input.data(), input.size(), &output));
+  {
+    snappy::ByteArraySource source(input.data(), input.size());
+    snappy::CompressingSource compressing(&source);
+    snappy::UncompressingSource uncompressing(&compressing);
+    snappy::ByteArraySource large_source(input.data(), input.size());
+    output.clear();
+    AppendingSink sink(&output);
+    snappy::CompressLarge(&large_source, &sink);
+    CHECK_EQ(input.size(), uncompressing.Available());
+  }
+  {
+    std::vector<string> parts;
+    CHECK(snappy::SplitCompressed(compressed.data(), compressed.size(),
+                                  snappy::kBlockSize, &parts));
+    std::vector<size_t> offsets;
+    CHECK(snappy::FindInCompressed(compressed.data(), compressed.size(),
+                                   input.data() + 1000, 20, &offsets));
+    CHECK(!offsets.empty());
+    snappy::ParallelCompressLarge(input.data(), input.size(), &output, NULL);
+    CHECK(snappy::ParallelUncompressLarge(output.data(), output.size(),
+                                          &uncompressed, NULL));
+    CHECK_EQ(input, uncompressed);
+  }
+}
+
+TEST(Snappy, Allocator) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  const string input = RandomCompressibleString(&rnd, 200000);
+
+  // Everything allocated is freed, with the right size.
+  {
+    CheckingAllocator allocator;
+    CHECK(snappy::SetAllocator(&allocator) == NULL);
+    CHECK(snappy::GetAllocator() == &allocator);
+    ExerciseAllocations(input, &rnd);
+    CHECK_GT(allocator.allocations(), 10);
+    CHECK_EQ(0, allocator.live());
+
+    // Objects free through the allocator they were constructed with.
+    snappy::UncompressingSource* source;
+    {
+      snappy::ByteArraySource compressed(input.data(), 0);
+      source = new snappy::UncompressingSource(&compressed);
+    }
+    CHECK(snappy::SetAllocator(NULL) == &allocator);
+    CHECK_EQ(1, allocator.live());
+    delete source;
+    CHECK_EQ(0, allocator.live());
+  }
+
+  // An arena does not need to grow beyond what one call uses.
+  {
+    snappy::ArenaAllocator arena(1 << 16);
+    snappy::SetAllocator(&arena);
+    ExerciseAllocations(input, &rnd);
+    const size_t usage = arena.MemoryUsage();
+    CHECK_GT(usage, 0);
+    for (int i = 0; i < 5; ++i) {
+      arena.Reset();
+      ExerciseAllocations(input, &rnd);
+    }
+    CHECK_LE(arena.MemoryUsage(), usage);
+    snappy::SetAllocator(NULL);
+  }
+
+  // Empty allocations from an arena are distinct and not NULL, also
+  // before the arena has a block.
+  {
+    snappy::ArenaAllocator arena;
+    void* first = arena.Allocate(0);
+    void* second = arena.Allocate(0);
+    CHECK(first != NULL);
+    CHECK(second != NULL);
+    CHECK(first != second);
+    arena.Deallocate(second, 0);
+    arena.Deallocate(first, 0);
+  }
+
+  // The C interface.
+  {
+    CheckingAllocator allocator;
+    struct Callbacks {
+      static void* Allocate(void* opaque, size_t size) {
+        return static_cast<CheckingAllocator*>(opaque)->Allocate(size);
+      }
+      static void Deallocate(void* opaque, void* ptr, size_t size) {
+        static_cast<CheckingAllocator*>(opaque)->Deallocate(ptr, size);
+      }
+    };
+    snappy_allocator c_allocator = {
+      &Callbacks::Allocate, &Callbacks::Deallocate, &allocator
+    };
+    snappy_set_allocator(&c_allocator);
+    vector<char> compressed(snappy_max_compressed_length(input.size()));
+    size_t compressed_length = compressed.size();
+    CHECK_EQ(SNAPPY_OK, snappy_compress(input.data(), input.size(),
+                                        &compressed[0], &compressed_length));
+    snappy_set_allocator(NULL);
+    CHECK_GT(allocator.allocations(), 0);
+    CHECK_EQ(0, allocator.live());
+  }
+
+  // A C allocator that returns NULL once "budget" allocations succeeded,
+  // like a full arena, gets SNAPPY_OUT_OF_MEMORY back, and what was
+  // allocated until then is freed.
+  for (int budget = 0; budget < 3; ++budget) {
+    struct FailingAllocator {
+      CheckingAllocator allocator;
+      int budget;
+
+      static void* Allocate(void* opaque, size_t size) {
+        FailingAllocator* failing = static_cast<FailingAllocator*>(opaque);
+        if (failing->budget == 0) {
+          return NULL;
+        }
+        --failing->budget;
+        return failing->allocator.Allocate(size);
+      }
+      static void Deallocate(void* opaque, void* ptr, size_t size) {
+        static_cast<FailingAllocator*>(opaque)->allocator.Deallocate(ptr,
+                                                                     size);
+      }
+    };
+    FailingAllocator failing;
+    failing.budget = budget;
+    snappy_allocator c_allocator = {
+      &FailingAllocator::Allocate, &FailingAllocator::Deallocate, &failing
+    };
+    snappy_set_allocator(&c_allocator);
+    vector<char> compressed(snappy_max_compressed_length(input.size()));
+    size_t compressed_length = compressed.size();
+    const snappy_status status = snappy_compress(
+        input.data(), input.size(), &compressed[0], &compressed_length);
+    snappy_set_allocator(NULL);
+    CHECK_EQ(budget < 2 ? SNAPPY_OUT_OF_MEMORY : SNAPPY_OK, status);
+    CHECK_EQ(0, failing.allocator.live());
+  }
+}
+
+TEST(Snappy, HugePageAllocator) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  snappy::HugePageAllocator allocator(1 << 20);
+
+  // Small and large allocations, with the large ones aligned to huge pages
+  // where they are supported.
+  static const size_t kSizes[] = { 1, 1000, (1 << 20) - 1, 1 << 20,
+                                   (3 << 20) + 5 };
+  for (size_t i = 0; i < ARRAYSIZE(kSizes); ++i) {
+    char* ptr = static_cast<char*>(allocator.Allocate(kSizes[i]));
+    memset(ptr, 'x', kSizes[i]);
+#ifdef HAVE_SYS_MMAN_H
+    if (kSizes[i] >= (1 << 20)) {
+      CHECK_EQ(0, reinterpret_cast<uintptr_t>(ptr) & ((2 << 20) - 1));
+    }
+#endif
+    allocator.Deallocate(ptr, kSizes[i]);
+  }
+
+  // The large paths use it for their buffers.
+  const string input = RandomCompressibleString(&rnd, 3 << 20);
+  snappy::AdviseHugePages(input.data(), input.size());
+  snappy::SetAllocator(&allocator);
+  string compressed, uncompressed;
+  {
+    snappy::ByteArraySource source(input.data(), input.size());
+    AppendingSink sink(&compressed);
+    snappy::CompressLarge(&source, &sink);
+  }
+  {
+    snappy::ByteArraySource source(compressed.data(), compressed.size());
+    AppendingSink sink(&uncompressed);
+    CHECK(snappy::UncompressLarge(&source, &sink));
+  }
+  snappy::SetAllocator(NULL);
+  CHECK_EQ(input, uncompressed);
+}
+
+// Runs tasks as soon as they are submitted.
+class InlineExecutor : public snappy::Executor {
+ public:
+  virtual void Submit(Task* task) { task->Run(); }
+};
+
+// Runs tasks only when destroyed, so ParallelFor() has to manage on the
+// calling thread alone.
+class DeferredExecutor : public snappy::Executor {
+ public:
+  virtual ~DeferredExecutor() {
+    for (size_t i = 0; i < tasks_.size(); ++i) {
+      tasks_[i]->Run();
+    }
+  }
+  virtual void Submit(Task* task) { tasks_.push_back(task); }
+
+ private:
+  std::vector<Task*> tasks_;
+};
+
+TEST(Snappy, ParallelCompress) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  InlineExecutor inline_executor;
+  snappy::WorkStealingExecutor work_stealing_executor(4);
+  CHECK_EQ(4, work_stealing_executor.num_threads());
+
+  for (int trial = 0; trial < 8; ++trial) {
+    size_t length;
+    switch (trial) {
+      case 0: length = 0; break;
+      case 1: length = 1; break;
+      case 2: length = 1 << 20; break;
+      default: length = rnd.Uniform(5 << 20); break;
+    }
+    const string input = RandomCompressibleString(&rnd, length);
+    string compressed, large_compressed;
+    snappy::Compress(input.data(), input.size(), &compressed);
+    {
+      snappy::ByteArraySource source(input.data(), input.size());
+      AppendingSink sink(&large_compressed);
+      snappy::CompressLarge(&source, &sink);
+    }
+
+    DeferredExecutor deferred_executor;
+    snappy::Executor* executors[] = { &inline_executor, &deferred_executor,
+                                      &work_stealing_executor, NULL };
+    for (size_t i = 0; i < ARRAYSIZE(executors); ++i) {
+      string parallel, uncompressed;
+      CHECK_EQ(compressed.size(),
+               snappy::ParallelCompress(input.data(), input.size(),
+                                        &parallel, executors[i]));
+      CHECK_EQ(compressed, parallel);
+      CHECK_EQ(large_compressed.size(),
+               snappy::ParallelCompressLarge(input.data(), input.size(),
+                                             &parallel, executors[i]));
+      CHECK_EQ(large_compressed, parallel);
+      CHECK(snappy::ParallelUncompressLarge(parallel.data(), parallel.size(),
+                                            &uncompressed, executors[i]));
+      CHECK_EQ(input, uncompressed);
+
+      if (!input.empty()) {
+        CHECK(!snappy::ParallelUncompressLarge(parallel.data(),
+                                               parallel.size() - 1,
+                                               &uncompressed, executors[i]));
+        // Claim one byte more than there is.
+        char header[snappy::Varint::kMax64];
+        const size_t header_length =
+            snappy::Varint::Encode64(header, input.size()) - header;
+        string longer(header, snappy::Varint::Encode64(header,
+                                                       input.size() + 1));
+        longer.append(parallel, header_length, string::npos);
+        CHECK(!snappy::ParallelUncompressLarge(longer.data(), longer.size(),
+                                               &uncompressed, executors[i]));
+      }
+    }
+  }
+}
+
+// Marks the items of a loop as done.
+class MarkingLoop : public snappy::Executor::Loop {
+ public:
+  explicit MarkingLoop(std::vector<char>* marks) : marks_(marks) { }
+  virtual void Run(size_t i) { ++(*marks_)[i]; }
+
+ private:
+  std::vector<char>* marks_;
+};
+
+// Marks itself as done, after submitting its children, or running a loop
+// over them, as asked.
+class MarkingTask : public snappy::Executor::Task {
+ public:
+  MarkingTask(snappy::Executor* executor, std::vector<char>* marks,
+              size_t index, int fanout, bool parallel_for)
+      : executor_(executor), marks_(marks), index_(index), fanout_(fanout),
+        parallel_for_(parallel_for) { }
+
+  virtual void Run() {
+    const size_t first_child = index_ * fanout_ + 1;
+    if (parallel_for_) {
+      std::vector<char> loop_marks(100);
+      MarkingLoop loop(&loop_marks);
+      executor_->ParallelFor(loop_marks.size(), &loop);
+      CHECK(std::count(loop_marks.begin(), loop_marks.end(), 1) ==
+            static_cast<ptrdiff_t>(loop_marks.size()));
+    } else {
+      for (int i = 0; i < fanout_; ++i) {
+        if (first_child + i < marks_->size()) {
+          executor_->Submit(new MarkingTask(executor_, marks_,
+                                            first_child + i, fanout_, false));
+        }
+      }
+    }
+    ++(*marks_)[index_];
+    delete this;
+  }
+
+ private:
+  snappy::Executor* executor_;
+  std::vector<char>* marks_;
+  size_t index_;
+  int fanout_;
+  bool parallel_for_;
+};
+
+TEST(Snappy, WorkStealingExecutor) {
+  // A tree of tasks, each submitting its children from within the pool.
+  std::vector<char> tree_marks(2000);
+  // Tasks that each run a loop of their own.
+  std::vector<char> loop_marks(50);
+  {
+    snappy::WorkStealingExecutor executor(3);
+    executor.Submit(new MarkingTask(&executor, &tree_marks, 0, 3, false));
+    for (size_t i = 0; i < loop_marks.size(); ++i) {
+      executor.Submit(new MarkingTask(&executor, &loop_marks, i, 0, true));
+    }
+    // The destructor runs whatever is still queued.
+  }
+  CHECK(std::count(tree_marks.begin(), tree_marks.end(), 1) ==
+        static_cast<ptrdiff_t>(tree_marks.size()));
+  CHECK(std::count(loop_marks.begin(), loop_marks.end(), 1) ==
+        static_cast<ptrdiff_t>(loop_marks.size()));
+
+  // A loop started from outside the pool.
+  std::vector<char> marks(1000);
+  MarkingLoop loop(&marks);
+  snappy::DefaultExecutor()->ParallelFor(marks.size(), &loop);
+  CHECK(std::count(marks.begin(), marks.end(), 1) ==
+        static_cast<ptrdiff_t>(marks.size()));
+}
+
+#ifdef __cpp_impl_coroutine
+
+// Queues tasks until the test runs them, like an event loop.
+class LoopExecutor : public snappy::Executor {
+ public:
+  virtual void Submit(Task* task) { tasks_.push_back(task); }
+
+  // Runs the oldest task. Returns false if there was none.
+  bool RunOne() {
+    if (tasks_.empty()) {
+      return false;
+    }
+    Task* task = tasks_.front();
+    tasks_.pop_front();
+    task->Run();
+    return true;
+  }
+
+ private:
+  std::deque<Task*> tasks_;
+};
+
+// A coroutine that starts right away and is never awaited.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return Detached(); }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() { }
+    void unhandled_exception() { abort(); }
+  };
+};
+
+// Awaits "operation", then stores its result in "*status" and sets "*done".
+static Detached AwaitStatus(snappy::Async<snappy::AsyncStatus> operation,
+                            snappy::AsyncStatus* status, bool* done) {
+  *status = co_await operation;
+  *done = true;
+}
+
+TEST(Snappy, CompressAsync) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  const string input = RandomCompressibleString(&rnd, (1 << 20) + 12345);
+  string expected;
+  snappy::Compress(input.data(), input.size(), &expected);
+  snappy::AsyncStatus status;
+  bool done;
+
+  // Without an executor, it all happens in the first resumption.
+  {
+    string compressed, uncompressed;
+    snappy::ByteArraySource source(input.data(), input.size());
+    AppendingSink sink(&compressed);
+    done = false;
+    AwaitStatus(snappy::CompressAsync(&source, &sink, NULL), &status, &done);
+    CHECK(done);
+    CHECK(status == snappy::AsyncStatus::kOk);
+    CHECK_EQ(expected, compressed);
+
+    snappy::ByteArraySource compressed_source(compressed.data(),
+                                              compressed.size());
+    AppendingSink uncompressed_sink(&uncompressed);
+    done = false;
+    AwaitStatus(snappy::UncompressAsync(&compressed_source,
+                                        &uncompressed_sink, NULL),
+                &status, &done);
+    CHECK(done);
+    CHECK(status == snappy::AsyncStatus::kOk);
+    CHECK_EQ(input, uncompressed);
+  }
+
+  // On an event loop, it yields every few blocks.
+  {
+    LoopExecutor loop;
+    string compressed, uncompressed;
+    snappy::ByteArraySource source(input.data(), input.size());
+    AppendingSink sink(&compressed);
+    done = false;
+    AwaitStatus(snappy::CompressAsync(&source, &sink, &loop), &status, &done);
+    CHECK(!done);
+    int slices = 0;
+    while (loop.RunOne()) {
+      ++slices;
+    }
+    CHECK(done);
+    CHECK(status == snappy::AsyncStatus::kOk);
+    CHECK_EQ(expected, compressed);
+    CHECK_GE(slices, 17 / snappy::kAsyncBlocksPerSlice);
+
+    snappy::ByteArraySource compressed_source(compressed.data(),
+                                              compressed.size());
+    AppendingSink uncompressed_sink(&uncompressed);
+    done = false;
+    AwaitStatus(snappy::UncompressAsync(&compressed_source,
+                                        &uncompressed_sink, &loop),
+                &status, &done);
+    slices = 0;
+    while (loop.RunOne()) {
+      ++slices;
+    }
+    CHECK(done);
+    CHECK(status == snappy::AsyncStatus::kOk);
+    CHECK_EQ(input, uncompressed);
+    CHECK_GE(slices, 17 / snappy::kAsyncBlocksPerSlice);
+  }
+
+  // Cancelled after the first slice, and given corrupted data.
+  {
+    LoopExecutor loop;
+    snappy::CancellationFlag cancel;
+    string compressed, uncompressed;
+    snappy::ByteArraySource source(input.data(), input.size());
+    AppendingSink sink(&compressed);
+    done = false;
+    AwaitStatus(snappy::CompressAsync(&source, &sink, &loop, &cancel),
+                &status, &done);
+    CHECK(loop.RunOne());
+    cancel.Cancel();
+    while (loop.RunOne()) {
+    }
+    CHECK(done);
+    CHECK(status == snappy::AsyncStatus::kCancelled);
+    CHECK_LT(compressed.size(), expected.size());
+
+    snappy::ByteArraySource truncated(expected.data(), expected.size() / 2);
+    AppendingSink uncompressed_sink(&uncompressed);
+    done = false;
+    AwaitStatus(snappy::UncompressAsync(&truncated, &uncompressed_sink,
+                                        &loop),
+                &status, &done);
+    while (loop.RunOne()) {
+    }
+    CHECK(done);
+    CHECK(status == snappy::AsyncStatus::kCorrupted);
+
+    // Trailing bytes are rejected, as by Uncompress().
+    const string trailing = expected + "x";
+    CHECK(!snappy::Uncompress(trailing.data(), trailing.size(),
+                              &uncompressed));
+    snappy::ByteArraySource trailing_source(trailing.data(), trailing.size());
+    uncompressed.clear();
+    done = false;
+    AwaitStatus(snappy::UncompressAsync(&trailing_source, &uncompressed_sink,
+                                        &loop),
+                &status, &done);
+    while (loop.RunOne()) {
+    }
+    CHECK(done);
+    CHECK(status == snappy::AsyncStatus::kCorrupted);
+    CHECK_EQ(input, uncompressed);
+  }
+
+  // On a thread pool. Destroying it waits for the last slice.
+  {
+    string compressed;
+    snappy::ByteArraySource source(input.data(), input.size());
+    AppendingSink sink(&compressed);
+    done = false;
+    {
+      snappy::WorkStealingExecutor pool(2);
+      AwaitStatus(snappy::CompressAsync(&source, &sink, &pool), &status,
+                  &done);
+    }
+    CHECK(done);
+    CHECK(status == snappy::AsyncStatus::kOk);
+    CHECK_EQ(expected, compressed);
+  }
+}
+
+#endif  // __cpp_impl_coroutine
+
+// A budget that runs out after a given number of blocks.
+class BlockBudget : public snappy::CompressionBudget {
+ public:
+  explicit BlockBudget(int blocks) : blocks_(blocks), calls_(0) { }
+
+  virtual bool Exhausted() { return calls_++ >= blocks_; }
+  int calls() const { return calls_; }
+
+ private:
+  int blocks_;
+  int calls_;
+};
+
+TEST(Snappy, CompressWithBudget) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  const string input = RandomCompressibleString(&rnd,
+                                                10 * snappy::kBlockSize + 123);
+  const int num_blocks = 11;
+  string expected, compressed, uncompressed;
+  snappy::Compress(input.data(), input.size(), &expected);
+
+  // A budget that lasts gives the usual output, and is checked per block.
+  BlockBudget unlimited(num_blocks);
+  snappy::CompressWithBudget(input.data(), input.size(), &compressed,
+                             &unlimited);
+  CHECK_EQ(expected, compressed);
+  CHECK_EQ(num_blocks, unlimited.calls());
+  snappy::Deadline far_deadline(1000000000);
+  snappy::CompressWithBudget(input.data(), input.size(), &compressed,
+                             &far_deadline);
+  CHECK_EQ(expected, compressed);
+  snappy::CpuBudget large_cpu_budget(1000000000);
+  CHECK_EQ(expected.size(),
+           snappy::CompressWithBudget(input.data(), input.size(),
+                                      &compressed, &large_cpu_budget));
+  CHECK_EQ(expected, compressed);
+
+  // Once it runs out, the rest is stored as literals, with a tag of at most
+  // three bytes per block.
+  for (int blocks = 0; blocks <= num_blocks; ++blocks) {
+    BlockBudget budget(blocks);
+    string streamed;
+    snappy::ByteArraySource source(input.data(), input.size());
+    AppendingSink sink(&streamed);
+    const size_t written =
+        snappy::CompressWithBudget(&source, &sink, &budget);
+    CHECK_EQ(streamed.size(), written);
+    CHECK_EQ(min(blocks + 1, num_blocks), budget.calls());
+    CHECK(snappy::Uncompress(streamed.data(), streamed.size(),
+                             &uncompressed));
+    CHECK_EQ(input, uncompressed);
+    if (blocks == 0) {
+      CHECK_LE(streamed.size(), 4 + input.size() + 3 * num_blocks);
+    }
+    if (blocks < num_blocks) {
+      CHECK_GT(streamed.size(), expected.size());
+    } else {
+      CHECK_EQ(expected, streamed);
+    }
+  }
+
+  snappy::Deadline past_deadline(0);
+  snappy::CompressWithBudget(input.data(), input.size(), &compressed,
+                             &past_deadline);
+  CHECK_LE(compressed.size(), 4 + input.size() + 3 * num_blocks);
+  CHECK(snappy::Uncompress(compressed.data(), compressed.size(),
+                           &uncompressed));
+  CHECK_EQ(input, uncompressed);
+  snappy::CpuBudget no_cpu_budget(0);
+  snappy::CompressWithBudget(input.data(), input.size(), &compressed,
+                             &no_cpu_budget);
+  CHECK_LE(compressed.size(), 4 + input.size() + 3 * num_blocks);
+
+  // A CpuBudget counts from its first use, not from construction, so CPU
+  // time spent in between (possibly on another thread) is not charged.
+  const string block = input.substr(0, snappy::kBlockSize);
+  string block_expected;
+  snappy::Compress(block.data(), block.size(), &block_expected);
+  snappy::CpuBudget later_cpu_budget(1);
+  for (int i = 0; i < 5; ++i) {
+    snappy::Compress(input.data(), input.size(), &compressed);
+  }
+  snappy::CompressWithBudget(block.data(), block.size(), &compressed,
+                             &later_cpu_budget);
+  CHECK_EQ(block_expected, compressed);
+}
+
+TEST(Snappy, CompressIfSmallerThan) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  static const char kGuard = '\xa5';
+  for (int trial = 0; trial < 30; ++trial) {
+    string input;
+    switch (trial % 3) {
+      case 0:
+        input = RandomCompressibleString(&rnd, rnd.Uniform(300000));
+        break;
+      case 1:
+        input = string(rnd.Uniform(300000), 'x');
+        break;
+      default:
+        for (int n = rnd.Uniform(300000); n > 0; --n) {
+          input.push_back(rnd.Rand8());
+        }
+        break;
+    }
+    string expected;
+    snappy::Compress(input.data(), input.size(), &expected);
+
+    // Limits at, just below and well below the compressed length.
+    const size_t limits[] = { snappy::MaxCompressedLength(input.size()),
+                              expected.size(), expected.size() - 1,
+                              expected.size() / 2, 0 };
+    for (size_t i = 0; i < ARRAYSIZE(limits); ++i) {
+      // Nothing may be written past the limit.
+      string buffer(limits[i] + 64, kGuard);
+      size_t compressed_length;
+      const bool fits = snappy::CompressIfSmallerThan(
+          input.data(), input.size(), limits[i], string_as_array(&buffer),
+          &compressed_length);
+      CHECK_EQ(expected.size() <= limits[i], fits);
+      if (fits) {
+        CHECK_EQ(expected, buffer.substr(0, compressed_length));
+      }
+      CHECK_EQ(string(64, kGuard), buffer.substr(limits[i]));
+    }
+  }
+}
+
+TEST(Snappy, AutoTuningCompressor) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  static const size_t kSampleLength = 4 * snappy::kBlockSize;
+  snappy::CostObjective size_only(0, 1);
+  snappy::CostObjective time_only(1, 0);
+  snappy::CostObjective balanced(1, 1e-9);
+  snappy::TuningObjective* objectives[] = { &size_only, &time_only,
+                                            &balanced };
+
+  for (int trial = 0; trial < 6; ++trial) {
+    string input;
+    if (trial % 2 == 0) {
+      input = RandomCompressibleString(&rnd, 3 * kSampleLength);
+    } else {
+      for (size_t i = 0; i < 3 * kSampleLength; ++i) {
+        input.push_back(rnd.Rand8());
+      }
+    }
+    snappy::TuningObjective* objective = objectives[trial / 2];
+
+    // Compress the stream in three parts; the first is the sample.
+    snappy::AutoTuningCompressor compressor(objective, kSampleLength);
+    CHECK(!compressor.tuned());
+    for (int part = 0; part < 3; ++part) {
+      const string piece = input.substr(part * kSampleLength, kSampleLength);
+      string compressed, uncompressed;
+      compressor.Compress(piece.data(), piece.size(), &compressed);
+      CHECK(compressor.tuned());
+      CHECK(snappy::Uncompress(compressed.data(), compressed.size(),
+                               &uncompressed));
+      CHECK_EQ(piece, uncompressed);
+      if (part == 0 && objective == &size_only) {
+        // Each sampled block is stored by the candidate that compressed it
+        // best, including the settings of Compress().
+        string expected;
+        snappy::Compress(piece.data(), piece.size(), &expected);
+        CHECK_LE(compressed.size(), expected.size());
+      }
+    }
+    const snappy::CompressionOptions& options = compressor.options();
+    CHECK_GE(options.hash_table_bits, 8);
+    CHECK_LE(options.hash_table_bits, snappy::kMaxHashTableBits);
+    CHECK_GE(options.skip_shift, 4);
+    CHECK_LE(options.skip_shift, 7);
+    CHECK_GE(options.block_size, 256);
+    CHECK_LE(options.block_size, snappy::kBlockSize);
+  }
+
+  // Without samples, it does what Compress() does.
+  const string input = RandomCompressibleString(&rnd, 300000);
+  snappy::AutoTuningCompressor untuned(&balanced, 0);
+  CHECK(untuned.tuned());
+  string expected, compressed;
+  snappy::Compress(input.data(), input.size(), &expected);
+  snappy::ByteArraySource source(input.data(), input.size());
+  AppendingSink sink(&compressed);
+  untuned.Compress(&source, &sink);
+  CHECK_EQ(expected, compressed);
+  CHECK_EQ(snappy::kMaxHashTableBits, untuned.options().hash_table_bits);
+  CHECK_EQ(5, untuned.options().skip_shift);
+  CHECK_EQ(snappy::kBlockSize, untuned.options().block_size);
+}
+
+// Writes "input" as a framed stream, appending in random pieces, some of
+// them through GetAppendBuffer().
+static string FrameRandomly(const string& input,
+                            const snappy::FramingOptions& options,
+                            ACMRandom* rnd) {
+  string framed;
+  AppendingSink sink(&framed);
+  snappy::FramingSink framing(&sink, options);
+  char scratch[4096];
+  for (size_t pos = 0; pos < input.size(); ) {
+    const size_t n = min<size_t>(input.size() - pos,
+                                 rnd->OneIn(10) ? 1 + rnd->Uniform(200000)
+                                                : 1 + rnd->Skewed(12));
+    if (n <= sizeof(scratch) && rnd->OneIn(2)) {
+      char* dest = framing.GetAppendBuffer(n, scratch);
+      memcpy(dest, input.data() + pos, n);
+      framing.Append(dest, n);
+    } else {
+      framing.Append(input.data() + pos, n);
+    }
+    pos += n;
+    if (rnd->OneIn(50)) {
+      framing.Flush();
+    }
+  }
+  framing.Flush();
+  return framed;
+}
+
+static string FrameRandomly(const string& input, size_t sync_interval,
+                            ACMRandom* rnd) {
+  snappy::FramingOptions options;
+  options.sync_interval = sync_interval;
+  return FrameRandomly(input, options, rnd);
+}
+
+// Writes "input" as a framed stream in one piece.
+static string Frame(const string& input,
+                    const snappy::FramingOptions& options) {
+  string framed;
+  AppendingSink sink(&framed);
+  snappy::FramingSink framing(&sink, options);
+  framing.Append(input.data(), input.size());
+  framing.Flush();
+  return framed;
+}
+
+// Reads a framed stream through a FramedSource, in random pieces.
+static bool ReadFramed(const string& framed, string* output, ACMRandom* rnd,
+                       size_t dedup_window = 0) {
+  output->clear();
+  FragmentedSource fragmented(framed, rnd);
+  snappy::FramedSource source(&fragmented, dedup_window);
+  while (source.Available() > 0) {
+    size_t n;
+    const char* data = source.Peek(&n);
+    CHECK_GT(n, 0);
+    n = min<size_t>(n, 1 + rnd->Skewed(17));
+    output->append(data, n);
+    source.Skip(n);
+  }
+  return source.ok();
+}
+
+// Decodes a framed stream in random byte ranges, the way parallel readers
+// would, and concatenates the results.
+static bool ReadFramedSplits(const string& framed, string* output,
+                             ACMRandom* rnd) {
+  output->clear();
+  AppendingSink sink(output);
+  for (size_t begin = 0; begin < framed.size(); ) {
+    const size_t end = min<size_t>(framed.size(),
+                                   begin + 1 + rnd->Skewed(18));
+    if (!snappy::UncompressFramedSplit(framed.data(), framed.size(),
+                                       begin, end, &sink)) {
+      return false;
+    }
+    begin = end;
+  }
+  return true;
+}
+
+// Returns the offsets of the chunks of "framed", and its size.
+static vector<size_t> FramedChunkOffsets(const string& framed) {
+  vector<size_t> offsets;
+  size_t pos = 0;
+  while (pos + 4 <= framed.size()) {
+    offsets.push_back(pos);
+    pos += 4 + (static_cast<uint8>(framed[pos + 1]) |
+                static_cast<uint8>(framed[pos + 2]) << 8 |
+                static_cast<uint8>(framed[pos + 3]) << 16);
+  }
+  CHECK_EQ(framed.size(), pos);
+  offsets.push_back(pos);
+  return offsets;
+}
+
+// Counts the stream identifiers at chunk boundaries in "framed".
+static int CountFramedIdentifiers(const string& framed) {
+  const vector<size_t> offsets = FramedChunkOffsets(framed);
+  int count = 0;
+  for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+    if (framed.compare(offsets[i], snappy::kFramedStreamIdentifierLength,
+                       snappy::kFramedStreamIdentifier,
+                       snappy::kFramedStreamIdentifierLength) == 0) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+TEST(Snappy, FramedStream) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  const size_t sync_intervals[] = { 0, 1, 100000 };
+  for (int trial = 0; trial < 12; ++trial) {
+    string input;
+    switch (trial % 4) {
+      case 0:
+        break;
+      case 1:
+        input = RandomCompressibleString(&rnd, 1 + rnd.Uniform(1000));
+        break;
+      case 2:
+        input = RandomCompressibleString(&rnd, 500000);
+        break;
+      default:
+        for (int i = 0; i < 300000; ++i) {
+          input.push_back(rnd.Rand8());
+        }
+        break;
+    }
+    const size_t sync_interval = sync_intervals[trial / 4];
+    const string framed = FrameRandomly(input, sync_interval, &rnd);
+    CHECK_EQ(0, framed.compare(0, snappy::kFramedStreamIdentifierLength,
+                               snappy::kFramedStreamIdentifier,
+                               snappy::kFramedStreamIdentifierLength));
+    const int identifiers = CountFramedIdentifiers(framed);
+    if (sync_interval == 0) {
+      CHECK_EQ(1, identifiers);
+    } else if (input.size() > sync_interval + snappy::kBlockSize) {
+      CHECK_GT(identifiers, 1);
+    }
+    if (trial % 4 == 3) {
+      // Incompressible data is stored.
+      CHECK_GT(framed.size(), input.size());
+    }
+
+    string output;
+    CHECK(ReadFramed(framed, &output, &rnd));
+    CHECK_EQ(input, output);
+    CHECK(ReadFramedSplits(framed, &output, &rnd));
+    CHECK_EQ(input, output);
+    CHECK_EQ(0, snappy::NextFramedSyncPoint(framed.data(), framed.size(), 0));
+  }
+
+  // Padding and reserved skippable chunks are skipped.
+  const string input = RandomCompressibleString(&rnd, 200000);
+  string framed = FrameRandomly(input, 0, &rnd);
+  framed.insert(snappy::kFramedStreamIdentifierLength,
+                string("\xfe\x02\x00\x00\x00\x00\x81\x03\x00\x00" "abc", 13));
+  string output;
+  CHECK(ReadFramed(framed, &output, &rnd));
+  CHECK_EQ(input, output);
+  CHECK(ReadFramedSplits(framed, &output, &rnd));
+  CHECK_EQ(input, output);
+}
+
+TEST(Snappy, FramedStreamCorruption) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  const string input = RandomCompressibleString(&rnd, 300000);
+  const size_t sync_intervals[] = { 0, 100000 };
+  for (size_t i = 0; i < ARRAYSIZE(sync_intervals); ++i) {
+    const string framed = FrameRandomly(input, sync_intervals[i], &rnd);
+    const vector<size_t> offsets = FramedChunkOffsets(framed);
+    string output;
+    AppendingSink sink(&output);
+    for (int trial = 0; trial < 20; ++trial) {
+      // Changes to the checksum of a chunk are detected. Changes to its
+      // data are detected unless they happen to decode to the same data.
+      const size_t chunk = 1 + rnd.Uniform(offsets.size() - 2);
+      const size_t begin = offsets[chunk];
+      const size_t end = offsets[chunk + 1];
+      if (framed[begin] == '\xff') {
+        continue;  // A sync marker
+      }
+      string corrupted = framed;
+      corrupted[begin + 4 + rnd.Uniform(4)] ^= 1 + rnd.Uniform(255);
+      CHECK(!ReadFramed(corrupted, &output, &rnd));
+      CHECK(!snappy::UncompressFramedSplit(corrupted.data(), corrupted.size(),
+                                           0, corrupted.size(), &sink));
+      CHECK(!ReadFramedSplits(corrupted, &output, &rnd));
+
+      corrupted = framed;
+      corrupted[begin + 8 + rnd.Uniform(end - begin - 8)] ^=
+          1 + rnd.Uniform(255);
+      CHECK(!ReadFramed(corrupted, &output, &rnd) || output == input);
+      CHECK(!ReadFramedSplits(corrupted, &output, &rnd) || output == input);
+
+      // So is truncation in the middle of a chunk.
+      const string truncated(framed, 0,
+                             begin + 1 + rnd.Uniform(end - begin - 1));
+      CHECK(!ReadFramed(truncated, &output, &rnd));
+      CHECK(!snappy::UncompressFramedSplit(truncated.data(), truncated.size(),
+                                           0, truncated.size(), &sink));
+    }
+
+    // A stream must start with the identifier.
+    CHECK(!ReadFramed(framed.substr(1), &output, &rnd));
+    CHECK(!ReadFramedSplits(framed.substr(1), &output, &rnd));
+  }
+}
+
+TEST(Snappy, FramedStreamFakeSyncPoints) {
+  // Incompressible data (stored as is) full of would-be identifiers, even
+  // ones followed by valid-looking chunk headers.
+  ACMRandom rnd(FLAGS_test_random_seed);
+  string input;
+  while (input.size() < 400000) {
+    for (int i = 0; i < 1000; ++i) {
+      input.push_back(rnd.Rand8());
+    }
+    input.append(snappy::kFramedStreamIdentifier,
+                 snappy::kFramedStreamIdentifierLength);
+    input.append("\x01\x08\x00\x00", 4);
+  }
+  const string framed = FrameRandomly(input, 30000, &rnd);
+  string output;
+  for (int trial = 0; trial < 10; ++trial) {
+    CHECK(ReadFramedSplits(framed, &output, &rnd));
+    CHECK_EQ(input, output);
+  }
+
+  // Every sync point found is at a chunk boundary.
+  const int identifiers = CountFramedIdentifiers(framed);
+  int sync_points = 0;
+  for (size_t pos = 0; pos < framed.size(); ++pos) {
+    pos = snappy::NextFramedSyncPoint(framed.data(), framed.size(), pos);
+    if (pos < framed.size()) {
+      ++sync_points;
+    }
+  }
+  CHECK_EQ(identifiers, sync_points);
+}
+
+TEST(Snappy, FramedStreamNested) {
+  // A framed stream stored in another one. Its identifiers are followed by
+  // valid chunks, but are not at chunk boundaries of the outer stream.
+  ACMRandom rnd(FLAGS_test_random_seed);
+  string payload;
+  for (int i = 0; i < (1 << 20); ++i) {
+    payload.push_back(rnd.Rand8());
+  }
+  // Small chunks, so that some lie entirely inside a chunk of the outer
+  // stream.
+  string inner;
+  {
+    AppendingSink sink(&inner);
+    snappy::FramingSink framing(&sink, 4096);
+    for (size_t pos = 0; pos < payload.size(); pos += 3000) {
+      framing.Append(payload.data() + pos,
+                     min<size_t>(3000, payload.size() - pos));
+      framing.Flush();
+    }
+  }
+
+  for (int outer_sync = 0; outer_sync < 2; ++outer_sync) {
+    snappy::FramingOptions outer_options;
+    outer_options.sync_interval = outer_sync ? 100000 : 0;
+    const string outer = outer_sync ? FrameRandomly(inner, outer_options, &rnd)
+                                    : Frame(inner, outer_options);
+
+    // Every sync point found is at a chunk boundary.
+    const int identifiers = CountFramedIdentifiers(outer);
+    int sync_points = 0;
+    for (size_t pos = 0; pos < outer.size(); ++pos) {
+      pos = snappy::NextFramedSyncPoint(outer.data(), outer.size(), pos);
+      if (pos < outer.size()) {
+        ++sync_points;
+      }
+    }
+    CHECK_EQ(identifiers, sync_points);
+
+    // So ranges of any size decode the outer stream exactly once.
+    for (int trial = 0; trial < 8; ++trial) {
+      const size_t split = trial < 4 ? (64 << 10) << trial
+                                     : 1 + rnd.Uniform(1 << 20);
+      string output;
+      AppendingSink sink(&output);
+      for (size_t begin = 0; begin < outer.size(); begin += split) {
+        const size_t end = min(outer.size(), begin + split);
+        CHECK(snappy::UncompressFramedSplit(outer.data(), outer.size(),
+                                            begin, end, &sink));
+      }
+      CHECK_EQ(inner, output);
+    }
+  }
+}
+
+TEST(Snappy, FramedStreamCraftedHeaders) {
+  // Before each stream identifier, every fourth byte starts what looks
+  // like the header of an uncompressed chunk of 64 KiB that the identifier
+  // is inside of. Checking all of them would take about a gigabyte of
+  // CRC-32C per identifier; past a bound they are not sync points.
+  ACMRandom rnd(FLAGS_test_random_seed);
+  string payload;
+  for (int i = 0; i < 100000; ++i) {
+    payload.push_back(rnd.Rand8());
+  }
+  const string stream = Frame(payload, snappy::FramingOptions());
+  string crafted;
+  for (int i = 0; i < 8; ++i) {
+    for (int j = 0; j < (20 << 10); ++j) {
+      crafted.append("\x01\x00\x00\x01", 4);
+    }
+    crafted += stream;
+  }
+  CHECK_EQ(crafted.size(),
+           snappy::NextFramedSyncPoint(crafted.data(), crafted.size(), 0));
+
+  // Without the crafted bytes, the identifiers are sync points.
+  const string streams = stream + stream;
+  CHECK_EQ(stream.size(),
+           snappy::NextFramedSyncPoint(streams.data(), streams.size(), 1));
+}
+
+// Returns "input" with a few bytes inserted, deleted or changed, about
+// every "spacing" bytes.
+static string EditRandomly(const string& input, size_t spacing,
+                           ACMRandom* rnd) {
+  string edited;
+  for (size_t pos = 0; pos < input.size(); ) {
+    const size_t n = min<size_t>(input.size() - pos,
+                                 rnd->Uniform(2 * spacing));
+    edited.append(input, pos, n);
+    pos += n;
+    switch (rnd->Uniform(3)) {
+      case 0:
+        edited.append(1 + rnd->Uniform(20), 'x');
+        break;
+      case 1:
+        pos += min<size_t>(input.size() - pos, 1 + rnd->Uniform(20));
+        break;
+      default:
+        edited.push_back(rnd->Rand8());
+        ++pos;
+        break;
+    }
+  }
+  return edited;
+}
+
+TEST(Snappy, FramedStreamContentDefinedChunks) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  string input;
+  for (int i = 0; i < 1000000; ++i) {
+    input.push_back(rnd.Rand8());
+  }
+
+  // Content-defined chunks of incompressible data are stored, so their
+  // lengths show where they end.
+  snappy::FramingOptions options;
+  options.content_defined_chunks = true;
+  string framed = Frame(input, options);
+  vector<size_t> offsets = FramedChunkOffsets(framed);
+  CHECK_GT(offsets.size(), 1000000 / snappy::kBlockSize + 2);
+  for (size_t i = 1; i + 1 < offsets.size(); ++i) {
+    CHECK_EQ(1, framed[offsets[i]]);
+    const size_t data_length = offsets[i + 1] - offsets[i] - 8;
+    CHECK_LE(data_length, snappy::kBlockSize);
+    CHECK(data_length >= 16384 || i + 2 == offsets.size());
+  }
+  string output;
+  CHECK(ReadFramed(framed, &output, &rnd));
+  CHECK_EQ(input, output);
+
+  // After an insertion, the chunks cut the same way again.
+  string shifted = "inserted" + input;
+  vector<size_t> shifted_offsets =
+      FramedChunkOffsets(Frame(shifted, options));
+  CHECK_EQ(offsets.size(), shifted_offsets.size());
+  for (size_t i = 2; i < offsets.size(); ++i) {
+    CHECK_EQ(offsets[i] + 8, shifted_offsets[i]);
+  }
+
+  // Any way of appending gives the same stream, unless it flushes.
+  for (int i = 0; i < 3; ++i) {
+    string pieces;
+    AppendingSink sink(&pieces);
+    snappy::FramingSink framing(&sink, options);
+    char scratch[4096];
+    for (size_t pos = 0; pos < input.size(); ) {
+      const size_t n = min<size_t>(input.size() - pos,
+                                   1 + rnd.Skewed(i == 0 ? 4 : 17));
+      if (n <= sizeof(scratch)) {
+        char* dest = framing.GetAppendBuffer(n, scratch);
+        memcpy(dest, input.data() + pos, n);
+        framing.Append(dest, n);
+      } else {
+        framing.Append(input.data() + pos, n);
+      }
+      pos += n;
+    }
+    framing.Flush();
+    CHECK_EQ(framed, pieces);
+  }
+}
+
+TEST(Snappy, FramedStreamDeduplication) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+
+  // Two "backups" of slowly changing data.
+  string data = RandomCompressibleString(&rnd, 500000);
+  for (int i = 0; i < 500000; ++i) {
+    data.push_back(rnd.Rand8());
+  }
+  const string input = data + EditRandomly(data, 200000, &rnd);
+
+  snappy::FramingOptions options;
+  options.dedup_window = 4 << 20;
+  const string fixed = Frame(input, options);
+  options.content_defined_chunks = true;
+  const string framed = Frame(input, options);
+  options.dedup_window = 0;
+  const string undeduplicated = Frame(input, options);
+  CHECK_LT(framed.size(), undeduplicated.size() * 7 / 10);
+  CHECK_LT(framed.size(), fixed.size() * 8 / 10);
+
+  // Windows beyond what a reference can reach are limited to that.
+  snappy::FramingOptions unlimited;
+  unlimited.dedup_window = static_cast<size_t>(-1);
+  CHECK_EQ(fixed, Frame(input, unlimited));
+
+  string output;
+  CHECK(ReadFramed(framed, &output, &rnd, 4 << 20));
+  CHECK_EQ(input, output);
+  CHECK(ReadFramedSplits(framed, &output, &rnd));
+  CHECK_EQ(input, output);
+  CHECK(ReadFramed(fixed, &output, &rnd, 4 << 20));
+  CHECK_EQ(input, output);
+
+  // A reader needs a window at least as large as the writer's.
+  CHECK(!ReadFramed(framed, &output, &rnd));
+  CHECK(!ReadFramed(framed, &output, &rnd, 100000));
+
+  // References only reach back as far as the window, and are resolved
+  // with sync markers and any way of appending.
+  for (int trial = 0; trial < 6; ++trial) {
+    options.sync_interval = trial % 2 == 0 ? 0 : 1 + rnd.Uniform(300000);
+    options.content_defined_chunks = trial % 3 != 0;
+    options.dedup_window = 1 + rnd.Uniform(1500000);
+    const string windowed = FrameRandomly(input, options, &rnd);
+    CHECK(ReadFramed(windowed, &output, &rnd, options.dedup_window));
+    CHECK_EQ(input, output);
+    CHECK(ReadFramedSplits(windowed, &output, &rnd));
+    CHECK_EQ(input, output);
+  }
+
+  // A reference that does not match the chunk it refers to is corrupted.
+  const vector<size_t> offsets = FramedChunkOffsets(framed);
+  int references = 0;
+  for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+    if (framed[offsets[i]] != '\x80') {
+      continue;
+    }
+    ++references;
+    if (references % 5 != 0) {
+      continue;
+    }
+    string corrupted = framed;
+    const size_t pos = offsets[i] + 4 + rnd.Uniform(offsets[i + 1] -
+                                                    offsets[i] - 4);
+    corrupted[pos] ^= 1 + rnd.Uniform(255);
+    CHECK(!ReadFramed(corrupted, &output, &rnd, 4 << 20));
+    CHECK(!ReadFramedSplits(corrupted, &output, &rnd));
+  }
+  CHECK_GT(references, 10);
+
+  // However long the stream, a reader only keeps the window (and a few
+  // chunks besides) in memory.
+  string unique;
+  for (int i = 0; i < (8 << 20); ++i) {
+    unique.push_back(rnd.Rand8());
+  }
+  options = snappy::FramingOptions();
+  options.dedup_window = 256 << 10;
+  const string unique_framed = Frame(unique, options);
+  CheckingAllocator allocator;
+  snappy::SetAllocator(&allocator);
+  CHECK(ReadFramed(unique_framed, &output, &rnd, options.dedup_window));
+  snappy::SetAllocator(NULL);
+  CHECK_EQ(unique, output);
+  CHECK_LT(allocator.peak_bytes(), options.dedup_window + (512 << 10));
+}
+
+TEST(Snappy, CheckedByteArraySinkAndStringSink) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+
+  for (int trial = 0; trial < 50; ++trial) {
+    const string input = RandomCompressibleString(
+        &rnd, rnd.OneIn(5) ? rnd.Uniform(5 * snappy::kBlockSize)
+                           : rnd.Skewed(16));
+    string compressed;
+    snappy::Compress(input.data(), input.size(), &compressed);
+
+    // Appends to what is in the string already.
+    const string prefix(rnd.Uniform(100), 'x');
+    string output = prefix;
+    {
+      FragmentedSource source(input, &rnd);
+      snappy::StringSink sink(&output);
+      snappy::Compress(&source, &sink);
+    }
+    CHECK_EQ(prefix + compressed, output);
+
+    // An array of the exact size is enough ...
+    vector<char> array(compressed.size() + 1, 'y');
+    {
+      snappy::ByteArraySource source(input.data(), input.size());
+      snappy::CheckedByteArraySink sink(&array[0], compressed.size());
+      snappy::Compress(&source, &sink);
+      CHECK(!sink.overflowed());
+      CHECK_EQ(compressed.size(), sink.NumberOfBytesWritten());
+      CHECK_EQ(compressed, string(&array[0], compressed.size()));
+      CHECK_EQ('y', array[compressed.size()]);
+    }
+
+    // ... and one byte less is not.
+    {
+      snappy::ByteArraySource source(input.data(), input.size());
+      snappy::CheckedByteArraySink sink(&array[0], compressed.size() - 1);
+      snappy::Compress(&source, &sink);
+      CHECK(sink.overflowed());
+      CHECK_EQ(compressed.size() - 1, sink.NumberOfBytesWritten());
+      CHECK_EQ('y', array[compressed.size()]);
+    }
+  }
+}
+
+#ifdef HAVE_UNISTD_H
+
+// Reads all of "*source" into a string, in random steps.
+static string ReadSource(snappy::Source* source, ACMRandom* rnd) {
+  string result;
+  while (source->Available() > 0) {
+    size_t len;
+    const char* data = source->Peek(&len);
+    if (len == 0) {
+      break;  // Ended early.
+    }
+    len = min<size_t>(len, 1 + rnd->Skewed(18));
+    result.append(data, len);
+    source->Skip(len);
+  }
+  return result;
+}
+
+TEST(Snappy, FileSourceAndSink) {
+  ACMRandom rnd(FLAGS_test_random_seed);
+  const string input = RandomCompressibleString(&rnd, 300000);
+  string compressed;
+  snappy::Compress(input.data(), input.size(), &compressed);
+
+  const char* tmpdir = getenv("TMPDIR");
+  const string pattern = string(tmpdir != NULL ? tmpdir : "/tmp") +
+                         "/snappy_unittest.XXXXXX";
+
+  for (int trial = 0; trial < 4; ++trial) {
+    snappy::FileOptions options;
+    if (trial >= 1) {
+      options.buffer_size = 1 + rnd.Uniform(20000);
+    }
+    if (trial == 2) {
+      options.direct = true;
+    }
+    if (trial == 3) {
+      options.alignment = 1;
+    }
+    int fds[2];
+    for (int i = 0; i < 2; ++i) {
+      vector<char> path(pattern.begin(), pattern.end());
+      path.push_back('\0');
+      fds[i] = mkstemp(&path[0]);
+      CHECK_GE(fds[i], 0);
+      unlink(&path[0]);
+    }
+
+    // Write the input in random pieces, some larger than the buffer.
+    {
+      snappy::FileSink sink(fds[0], options);
+      for (size_t pos = 0; pos < input.size(); ) {
+        const size_t len = min<size_t>(input.size() - pos,
+                                       1 + rnd.Skewed(18));
+        sink.Append(input.data() + pos, len);
+        pos += len;
+      }
+      CHECK(sink.Flush());
+    }
+    CHECK_EQ(0, lseek(fds[0], 0, SEEK_SET));
+    {
+      snappy::FileSource source(fds[0], options);
+      CHECK_EQ(input.size(), source.Available());
+      CHECK_EQ(input, ReadSource(&source, &rnd));
+      CHECK_EQ(0, source.error());
+    }
+
+    // Compress from one file to the other.
+    CHECK_EQ(0, lseek(fds[0], 0, SEEK_SET));
+    {
+      snappy::FileSource source(fds[0], options);
+      snappy::FileSink sink(fds[1], options);
+      snappy::Compress(&source, &sink);
+      CHECK(sink.Flush());
+      CHECK_EQ(0, source.error());
+    }
+    CHECK_EQ(0, lseek(fds[1], 0, SEEK_SET));
+    {
+      snappy::FileSource source(fds[1], options);
+      CHECK_EQ(compressed, ReadSource(&source, &rnd));
+      CHECK_EQ(0, source.error());
+    }
+
+    // Reading past the end reports an error.
+    CHECK_EQ(0, lseek(fds[1], 0, SEEK_SET));
+    {
+      snappy::FileSource source(fds[1], compressed.size() + 1, options);
+      CHECK_EQ(compressed, ReadSource(&source, &rnd));
+      CHECK_EQ(EIO, source.error());
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  // Sockets, through a socketpair with room for everything.
+  const string small_input = input.substr(0, 20000);
+  string small_compressed;
+  snappy::Compress(small_input.data(), small_input.size(),
+                   &small_compressed);
+  int fds[2];
+  CHECK_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  snappy::FileOptions options;
+  options.buffer_size = 4096;
+  {
+    snappy::SocketSink sink(fds[0], options);
+    snappy::ByteArraySource source(small_input.data(), small_input.size());
+    snappy::Compress(&source, &sink);
+    sink.Append("next", 4);
+    CHECK(sink.Flush());
+  }
+  {
+    // Only the given length is read, leaving the rest on the socket.
+    snappy::SocketSource source(fds[1], small_compressed.size(), options);
+    snappy::UncompressingSource uncompressed(&source);
+    CHECK_EQ(small_input, ReadSource(&uncompressed, &rnd));
+    CHECK(uncompressed.ok());
+    char next[4];
+    CHECK_EQ(4, read(fds[1], next, 4));
+    CHECK_EQ("next", string(next, 4));
+  }
+  close(fds[0]);
+  {
+    snappy::SocketSource source(fds[1], 10, options);
+    CHECK_EQ("", ReadSource(&source, &rnd));
+    CHECK_EQ(EIO, source.error());
+  }
+  {
+    snappy::SocketSink sink(fds[1], options);
+    sink.Append(small_input.data(), small_input.size());
+    CHECK(!sink.Flush());
+    CHECK_EQ(EPIPE, sink.error());
+  }
+  close(fds[1]);
+}
+
+#endif  // HAVE_UNISTD_H
+
+TEST(Snappy, IOVecEdgeCases) {
+  // Test some tricky edge cases in the iovec output that are not necessarily
+  // exercised by random tests.
+
+  // Our output blocks look like this initially (the last iovec is bigger
+  // than depicted):
+  // [  ] [ ] [    ] [        ] [        ]
+  static const int kLengths[] = { 2, 1, 4, 8, 128 };
+
+  struct iovec iov[ARRAYSIZE(kLengths)];
+  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
+    iov[i].iov_base = new char[kLengths[i]];
+    iov[i].iov_len = kLengths[i];
+  }
+
+  string compressed;
+  Varint::Append32(&compressed, 22);
+
+  // A literal whose output crosses three blocks.
+  // [ab] [c] [123 ] [        ] [        ]
+  AppendLiteral(&compressed, "abc123");
+
+  // A copy whose output crosses two blocks (source and destination
+  // segments marked).
+  // [ab] [c] [1231] [23      ] [        ]
+  //           ^--^   --
+  AppendCopy(&compressed, 3, 3);
+
+  // A copy where the input is, at first, in the block before the output:
+  //
+  // [ab] [c] [1231] [231231  ] [        ]
+  //           ^---     ^---
+  // Then during the copy, the pointers move such that the input and
+  // output pointers are in the same block:
+  //
+  // [ab] [c] [1231] [23123123] [        ]
+  //                  ^-    ^-
+  // And then they move again, so that the output pointer is no longer
+  // in the same block as the input pointer:
+  // [ab] [c] [1231] [23123123] [123     ]
+  //                    ^--      ^--
+  AppendCopy(&compressed, 6, 9);
+
+  // Finally, a copy where the input is from several blocks back,
+  // and it also crosses three blocks:
+  //
+  // [ab] [c] [1231] [23123123] [123b    ]
+  //   ^                            ^
+  // [ab] [c] [1231] [23123123] [123bc   ]
+  //       ^                         ^
+  // [ab] [c] [1231] [23123123] [123bc12 ]
+  //           ^-                     ^-
+  AppendCopy(&compressed, 17, 4);
+
+  CHECK(snappy::RawUncompressToIOVec(
+      compressed.data(), compressed.size(), iov, ARRAYSIZE(iov)));
+  CHECK_EQ(0, memcmp(iov[0].iov_base, "ab", 2));
+  CHECK_EQ(0, memcmp(iov[1].iov_base, "c", 1));
+  CHECK_EQ(0, memcmp(iov[2].iov_base, "1231", 4));
+  CHECK_EQ(0, memcmp(iov[3].iov_base, "23123123", 8));
+  CHECK_EQ(0, memcmp(iov[4].iov_base, "123bc12", 7));
+
+  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
+    delete[] reinterpret_cast<char *>(iov[i].iov_base);
+  }
+}
+
+TEST(Snappy, IOVecLiteralOverflow) {
+  static const int kLengths[] = { 3, 4 };
+
+  struct iovec iov[ARRAYSIZE(kLengths)];
+  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
+    iov[i].iov_base = new char[kLengths[i]];
+    iov[i].iov_len = kLengths[i];
+  }
+
+  string compressed;
+  Varint::Append32(&compressed, 8);
+
+  AppendLiteral(&compressed, "12345678");
+
+  CHECK(!snappy::RawUncompressToIOVec(
+      compressed.data(), compressed.size(), iov, ARRAYSIZE(iov)));
+
+  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
+    delete[] reinterpret_cast<char *>(iov[i].iov_base);
+  }
+}
+
+TEST(Snappy, IOVecCopyOverflow) {
+  static const int kLengths[] = { 3, 4 };
+
+  struct iovec iov[ARRAYSIZE(kLengths)];
+  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
+    iov[i].iov_base = new char[kLengths[i]];
+    iov[i].iov_len = kLengths[i];
+  }
+
+  string compressed;
+  Varint::Append32(&compressed, 8);
+
+  AppendLiteral(&compressed, "123");
+  AppendCopy(&compressed, 3, 5);
+
+  CHECK(!snappy::RawUncompressToIOVec(
+      compressed.data(), compressed.size(), iov, ARRAYSIZE(iov)));
+
+  for (int i = 0; i < ARRAYSIZE(kLengths); ++i) {
+    delete[] reinterpret_cast<char *>(iov[i].iov_base);
+  }
+}
+
+
+static bool CheckUncompressedLength(const string& compressed,
+                                    size_t* ulength) {
+  const bool result1 = snappy::GetUncompressedLength(compressed.data(),
+                                                     compressed.size(),
+                                                     ulength);
+
+  snappy::ByteArraySource source(compressed.data(), compressed.size());
+  uint32 length;
+  const bool result2 = snappy::GetUncompressedLength(&source, &length);
+  CHECK_EQ(result1, result2);
+  return result1;
+}
+
+TEST(SnappyCorruption, TruncatedVarint) {
+  string compressed, uncompressed;
+  size_t ulength;
+  compressed.push_back('\xf0');
+  CHECK(!CheckUncompressedLength(compressed, &ulength));
+  CHECK(!snappy::IsValidCompressedBuffer(compressed.data(), compressed.size()));
+  CHECK(!snappy::Uncompress(compressed.data(), compressed.size(),
+                            &uncompressed));
+}
+
+TEST(SnappyCorruption, UnterminatedVarint) {
+  string compressed, uncompressed;
+  size_t ulength;
+  compressed.push_back(128);
+  compressed.push_back(128);
+  compressed.push_back(128);
+  compressed.push_back(128);
+  compressed.push_back(128);
+  compressed.push_back(10);
+  CHECK(!CheckUncompressedLength(compressed, &ulength));
+  CHECK(!snappy::IsValidCompressedBuffer(compressed.data(), compressed.size()));
+  CHECK(!snappy::Uncompress(compressed.data(), compressed.size(),
+                            &uncompressed));
+}
+
+TEST(SnappyCorruption, OverlongVarint) {
+  // Lengths over 32 bits, or over five bytes, are rejected by all readers.
+  for (int i = 0; i < 2; ++i) {
+    string compressed;
+    compressed.push_back(129);
+    compressed.push_back(128);
+    compressed.push_back(128);
+    compressed.push_back(128);
+    if (i == 0) {
+      compressed.push_back(16);   // 2^32 + 1
+    } else {
+      compressed.push_back(128);
+      compressed.push_back(0);    // 1, in six bytes
+    }
+    compressed.push_back(0);      // A one-byte literal
+    compressed.push_back('x');
+    size_t ulength;
+    string uncompressed;
+    CHECK(!CheckUncompressedLength(compressed, &ulength));
+    CHECK(!snappy::Uncompress(compressed.data(), compressed.size(),
+                              &uncompressed));
+    snappy::ByteArraySource source(compressed.data(), compressed.size());
+    snappy::UncompressingSource uncompressing(&source);
+    CHECK(!uncompressing.ok());
+    CHECK_EQ(0, uncompressing.Available());
+  }
+}
+
+TEST(Snappy, ReadPastEndOfBuffer) {
+  // Check that we do not read past end of input
+
+  // Make a compressed string that ends with a single-byte literal
+  string compressed;
+  Varint::Append32(&compressed, 1);
+  AppendLiteral(&compressed, "x");
+
+  string uncompressed;
+  DataEndingAtUnreadablePage c(compressed);
+  CHECK(snappy::Uncompress(c.data(), c.size(), &uncompressed));
+  CHECK_EQ(uncompressed, string("x"));
+}
+
+// Check for an infinite loop caused by a copy with offset==0
+TEST(Snappy, ZeroOffsetCopy) {
+  const char* compressed = "\x40\x12\x00\x00";
+  //  \x40              Length (must be > kMaxIncrementCopyOverflow)
+  //  \x12\x00\x00      Copy with offset==0, length==5
+  char uncompressed[100];
+  EXPECT_FALSE(snappy::RawUncompress(compressed, 4, uncompressed));
+}
+
+TEST(Snappy, ZeroOffsetCopyValidation) {
+  const char* compressed = "\x05\x12\x00\x00";
+  //  \x05              Length
+  //  \x12\x00\x00      Copy with offset==0, length==5
+  EXPECT_FALSE(snappy::IsValidCompressedBuffer(compressed, 4));
+}
+
+
+namespace {
+
+int TestFindMatchLength(const char* s1, const char *s2, unsigned length) {
+  return snappy::internal::FindMatchLength(s1, s2, s2 + length);
+}
+
+}  // namespace
+
+TEST(Snappy, FindMatchLength) {
+  // Exercise all different code paths through the function.
+  // 64-bit version:
+
+  // Hit s1_limit in 64-bit loop, hit s1_limit in single-character loop.
+  EXPECT_EQ(6, TestFindMatchLength("012345", "012345", 6));
+  EXPECT_EQ(11, TestFindMatchLength("01234567abc", "01234567abc", 11));
+
+  // Hit s1_limit in 64-bit loop, find a non-match in single-character loop.
+  EXPECT_EQ(9, TestFindMatchLength("01234567abc", "01234567axc", 9));
+
+  // Same, but edge cases.
+  EXPECT_EQ(11, TestFindMatchLength("01234567abc!", "01234567abc!", 11));
+  EXPECT_EQ(11, TestFindMatchLength("01234567abc!", "01234567abc?", 11));
+
+  // Find non-match at once in first loop.
+  EXPECT_EQ(0, TestFindMatchLength("01234567xxxxxxxx", "?1234567xxxxxxxx", 16));
+  EXPECT_EQ(1, TestFindMatchLength("01234567xxxxxxxx", "0?234567xxxxxxxx", 16));
   EXPECT_EQ(4, TestFindMatchLength("01234567xxxxxxxx", "01237654xxxxxxxx", 16));
   EXPECT_EQ(7, TestFindMatchLength("01234567xxxxxxxx", "0123456?xxxxxxxx", 16));
 
@@ -1229,6 +3644,105 @@ static void BM_UFlat(int iters, int arg) {
 }
 BENCHMARK(BM_UFlat)->DenseRange(0, ARRAYSIZE(files) - 1);
 
+static void BM_UFlatPadded(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  // Pick file to process based on "arg"
+  CHECK_GE(arg, 0);
+  CHECK_LT(arg, static_cast<int>(ARRAYSIZE(files)));
+  string contents = ReadTestDataFile(files[arg].filename,
+                                     files[arg].size_limit);
+
+  string zcontents;
+  snappy::Compress(contents.data(), contents.size(), &zcontents);
+  const size_t zsize = zcontents.size();
+  zcontents.resize(zsize + snappy::kInputPaddingBytes);
+  char* dst = new char[contents.size()];
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(contents.size()));
+  SetBenchmarkLabel(files[arg].label);
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    CHECK(snappy::RawUncompressPadded(zcontents.data(), zsize, dst));
+  }
+  StopBenchmarkTiming();
+
+  delete[] dst;
+}
+BENCHMARK(BM_UFlatPadded)->DenseRange(0, ARRAYSIZE(files) - 1);
+
+// Decompresses and computes the CRC-32C of the output: odd args with
+// RawUncompressAndChecksum(), even args in two passes. Arg / 2 selects
+// the file.
+static void BM_UFlatChecksum(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  CHECK_GE(arg, 0);
+  CHECK_LT(arg / 2, static_cast<int>(ARRAYSIZE(files)));
+  string contents = ReadTestDataFile(files[arg / 2].filename,
+                                     files[arg / 2].size_limit);
+  const bool fused = (arg % 2) == 1;
+
+  string zcontents;
+  snappy::Compress(contents.data(), contents.size(), &zcontents);
+  char* dst = new char[contents.size()];
+  uint32 crc = 0;
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(contents.size()));
+  SetBenchmarkLabel(string(files[arg / 2].label) +
+                    (fused ? " (fused)" : " (two passes)"));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    if (fused) {
+      CHECK(snappy::RawUncompressAndChecksum(zcontents.data(),
+                                             zcontents.size(), dst, &crc));
+    } else {
+      CHECK(snappy::RawUncompress(zcontents.data(), zcontents.size(), dst));
+      crc = snappy::crc32c::Value(dst, contents.size());
+    }
+  }
+  StopBenchmarkTiming();
+  CHECK_EQ(snappy::crc32c::Value(contents.data(), contents.size()), crc);
+
+  delete[] dst;
+}
+BENCHMARK(BM_UFlatChecksum)->DenseRange(0, 11);
+
+// Searches for a rare string in the html file: odd args with
+// FindInCompressed(), even args by decompressing and scanning.
+static void BM_FindInCompressed(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  string contents = ReadTestDataFile("html");
+  string zcontents;
+  snappy::Compress(contents.data(), contents.size(), &zcontents);
+  const string pattern = "NOT-IN-THE-FILE";
+  const bool in_compressed = (arg % 2) == 1;
+  vector<size_t> offsets;
+  string uncompressed;
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(contents.size()));
+  SetBenchmarkLabel(in_compressed ? "compressed" : "uncompress+find");
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    if (in_compressed) {
+      CHECK(snappy::FindInCompressed(zcontents.data(), zcontents.size(),
+                                     pattern.data(), pattern.size(),
+                                     &offsets));
+    } else {
+      CHECK(snappy::Uncompress(zcontents.data(), zcontents.size(),
+                               &uncompressed));
+      offsets = FindAllNaive(uncompressed, pattern);
+    }
+  }
+  StopBenchmarkTiming();
+  CHECK(offsets.empty());
+}
+BENCHMARK(BM_FindInCompressed)->DenseRange(0, 1);
+
 static void BM_UValidate(int iters, int arg) {
   StopBenchmarkTiming();
 
@@ -1298,6 +3812,99 @@ static void BM_UIOVec(int iters, int arg) {
 }
 BENCHMARK(BM_UIOVec)->DenseRange(0, 4);
 
+static void BM_USource(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  // Pick file to process based on "arg"
+  CHECK_GE(arg, 0);
+  CHECK_LT(arg, static_cast<int>(ARRAYSIZE(files)));
+  string contents = ReadTestDataFile(files[arg].filename,
+                                     files[arg].size_limit);
+
+  string zcontents;
+  snappy::Compress(contents.data(), contents.size(), &zcontents);
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(contents.size()));
+  SetBenchmarkLabel(files[arg].label);
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    snappy::ByteArraySource compressed(zcontents.data(), zcontents.size());
+    snappy::UncompressingSource source(&compressed);
+    while (source.Available() > 0) {
+      size_t len;
+      source.Peek(&len);
+      source.Skip(len);
+    }
+    CHECK(source.ok());
+  }
+  StopBenchmarkTiming();
+}
+BENCHMARK(BM_USource)->DenseRange(0, 4);
+
+// Splits a mix of the test files into messages of "message_size" bytes
+// each, for the batch benchmarks.
+static void MakeBenchmarkMessages(size_t message_size,
+                                  vector<string>* messages) {
+  static const char* kFiles[] = { "html", "geo.protodata", "paper-100k.pdf" };
+  messages->clear();
+  for (size_t f = 0; f < ARRAYSIZE(kFiles); ++f) {
+    string contents = ReadTestDataFile(kFiles[f]);
+    for (size_t pos = 0; pos + message_size <= contents.size();
+         pos += message_size) {
+      messages->push_back(contents.substr(pos, message_size));
+    }
+  }
+}
+
+// Even args decompress the messages one at a time, odd args use
+// RawUncompressBatch(); the message size doubles every two args from 1 KB.
+static void BM_UFlatBatch(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  const size_t message_size = 1024 << (arg / 2);
+  const bool batch = (arg % 2) == 1;
+  vector<string> messages;
+  MakeBenchmarkMessages(message_size, &messages);
+
+  const size_t n = messages.size();
+  vector<string> compressed(n);
+  vector<const char*> compressed_ptrs(n);
+  vector<size_t> compressed_lengths(n);
+  vector<char*> dst(n);
+  int64 total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    snappy::Compress(messages[i].data(), messages[i].size(), &compressed[i]);
+    compressed_ptrs[i] = compressed[i].data();
+    compressed_lengths[i] = compressed[i].size();
+    dst[i] = new char[message_size];
+    total += message_size;
+  }
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) * total);
+  SetBenchmarkLabel(StringPrintf("%dk %s", static_cast<int>(message_size >> 10),
+                                 batch ? "batch" : "serial"));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    if (batch) {
+      CHECK(snappy::RawUncompressBatch(&compressed_ptrs[0],
+                                       &compressed_lengths[0], n, &dst[0],
+                                       NULL));
+    } else {
+      for (size_t i = 0; i < n; ++i) {
+        CHECK(snappy::RawUncompress(compressed_ptrs[i], compressed_lengths[i],
+                                    dst[i]));
+      }
+    }
+  }
+  StopBenchmarkTiming();
+
+  for (size_t i = 0; i < n; ++i) {
+    delete[] dst[i];
+  }
+}
+BENCHMARK(BM_UFlatBatch)->DenseRange(0, 9);
+
 
 static void BM_ZFlat(int iters, int arg) {
   StopBenchmarkTiming();
@@ -1329,6 +3936,369 @@ static void BM_ZFlat(int iters, int arg) {
 }
 BENCHMARK(BM_ZFlat)->DenseRange(0, ARRAYSIZE(files) - 1);
 
+// Compresses and computes the CRC-32C of each block of the input: odd args
+// with RawCompressAndChecksum(), even args in two passes. Arg / 2 selects
+// the file.
+static void BM_ZFlatChecksum(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  CHECK_GE(arg, 0);
+  CHECK_LT(arg / 2, static_cast<int>(ARRAYSIZE(files)));
+  string contents = ReadTestDataFile(files[arg / 2].filename,
+                                     files[arg / 2].size_limit);
+  const bool fused = (arg % 2) == 1;
+
+  char* dst = new char[snappy::MaxCompressedLength(contents.size())];
+  vector<uint32> block_crcs;
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(contents.size()));
+  SetBenchmarkLabel(string(files[arg / 2].label) +
+                    (fused ? " (fused)" : " (two passes)"));
+  StartBenchmarkTiming();
+
+  size_t zsize = 0;
+  while (iters-- > 0) {
+    block_crcs.clear();
+    if (fused) {
+      snappy::RawCompressAndChecksum(contents.data(), contents.size(), dst,
+                                     &zsize, &block_crcs, NULL);
+    } else {
+      for (size_t pos = 0; pos < contents.size(); pos += snappy::kBlockSize) {
+        const size_t len = min(snappy::kBlockSize, contents.size() - pos);
+        block_crcs.push_back(snappy::crc32c::Value(contents.data() + pos,
+                                                   len));
+      }
+      snappy::RawCompress(contents.data(), contents.size(), dst, &zsize);
+    }
+  }
+  StopBenchmarkTiming();
+  delete[] dst;
+}
+BENCHMARK(BM_ZFlatChecksum)->DenseRange(0, 11);
+
+// Compresses the messages of BM_UFlatBatch with a SessionCompressor (odd
+// args) or one at a time (even args); the message size doubles every two
+// args from 256 bytes.
+static void BM_ZFlatSession(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  const size_t message_size = 256 << (arg / 2);
+  const bool session = (arg % 2) == 1;
+  vector<string> messages;
+  MakeBenchmarkMessages(message_size, &messages);
+
+  snappy::SessionCompressor compressor;
+  string compressed;
+  size_t total_bytes = 0;
+  size_t compressed_bytes = 0;
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(messages.size()) *
+                             static_cast<int64>(message_size));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    compressor.Reset();
+    total_bytes = 0;
+    compressed_bytes = 0;
+    for (size_t i = 0; i < messages.size(); ++i) {
+      if (session) {
+        compressor.Compress(messages[i].data(), messages[i].size(),
+                            &compressed);
+      } else {
+        snappy::Compress(messages[i].data(), messages[i].size(), &compressed);
+      }
+      total_bytes += messages[i].size();
+      compressed_bytes += compressed.size();
+    }
+  }
+  StopBenchmarkTiming();
+  SetBenchmarkLabel(StringPrintf(
+      "%s (%.2f %%)", session ? "session" : "single",
+      100.0 * compressed_bytes / std::max<size_t>(1, total_bytes)));
+}
+BENCHMARK(BM_ZFlatSession)->DenseRange(0, 7);
+
+// Compresses the messages of BM_UFlatBatch one at a time, allocating
+// through the default allocator (even args) or an ArenaAllocator that is
+// reset after each message (odd args); the message size doubles every two
+// args from 1 KB.
+static void BM_ZFlatAllocator(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  const size_t message_size = 1024 << (arg / 2);
+  const bool arena = (arg % 2) == 1;
+  vector<string> messages;
+  MakeBenchmarkMessages(message_size, &messages);
+
+  snappy::ArenaAllocator allocator;
+  if (arena) {
+    snappy::SetAllocator(&allocator);
+  }
+  string compressed;
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(messages.size()) *
+                             static_cast<int64>(message_size));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    for (size_t i = 0; i < messages.size(); ++i) {
+      snappy::Compress(messages[i].data(), messages[i].size(), &compressed);
+      allocator.Reset();
+    }
+  }
+  StopBenchmarkTiming();
+  snappy::SetAllocator(NULL);
+  SetBenchmarkLabel(arena ? "arena" : "default");
+}
+BENCHMARK(BM_ZFlatAllocator)->DenseRange(0, 5);
+
+// Compresses 32 MB of the test files with CompressLarge(), with the input,
+// output and internal buffers in ordinary memory (arg 0) or huge pages
+// (arg 1). That is several times what the TLB covers with 4 KiB pages.
+// Only run with --run_large_benchmarks.
+static void BM_ZLargeHugePages(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  static const size_t kInputSize = 32 << 20;
+  const bool huge_pages = (arg == 1);
+  snappy::HugePageAllocator huge_page_allocator;
+  snappy::Allocator* allocator =
+      huge_pages ? &huge_page_allocator : snappy::GetAllocator();
+  const size_t output_size = snappy::MaxCompressedLength(kInputSize) +
+                             kInputSize / 1000;
+  char* input = static_cast<char*>(allocator->Allocate(kInputSize));
+  char* output = static_cast<char*>(allocator->Allocate(output_size));
+  string contents;
+  for (size_t i = 0; i < ARRAYSIZE(files); ++i) {
+    contents += ReadTestDataFile(files[i].filename, files[i].size_limit);
+  }
+  for (size_t filled = 0; filled < kInputSize; filled += contents.size()) {
+    memcpy(input + filled, contents.data(),
+           min(contents.size(), kInputSize - filled));
+  }
+  memset(output, 0, output_size);
+  if (huge_pages) {
+    snappy::SetAllocator(&huge_page_allocator);
+  }
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(kInputSize));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    snappy::ByteArraySource source(input, kInputSize);
+    snappy::UncheckedByteArraySink sink(output);
+    snappy::CompressLarge(&source, &sink);
+  }
+  StopBenchmarkTiming();
+
+  snappy::SetAllocator(NULL);
+  allocator->Deallocate(input, kInputSize);
+  allocator->Deallocate(output, output_size);
+  SetBenchmarkLabel(huge_pages ? "huge pages" : "4 KiB pages");
+}
+BENCHMARK(BM_ZLargeHugePages)->DenseRange(0, 1);
+
+// Compresses 64 MB of the test files with Compress() (arg 0), and with
+// ParallelCompress() on the default executor (arg 1). Only run with
+// --run_large_benchmarks.
+static void BM_ZFlatParallel(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  static const size_t kInputSize = 64 << 20;
+  string contents, input;
+  for (size_t i = 0; i < ARRAYSIZE(files); ++i) {
+    contents += ReadTestDataFile(files[i].filename, files[i].size_limit);
+  }
+  while (input.size() < kInputSize) {
+    input.append(contents, 0, kInputSize - input.size());
+  }
+  string compressed;
+  // Start the threads before timing.
+  snappy::DefaultExecutor();
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(kInputSize));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    if (arg == 0) {
+      snappy::Compress(input.data(), input.size(), &compressed);
+    } else {
+      snappy::ParallelCompress(input.data(), input.size(), &compressed,
+                               NULL);
+    }
+  }
+  StopBenchmarkTiming();
+
+  SetBenchmarkLabel(arg == 0 ? "serial" : "parallel");
+}
+BENCHMARK(BM_ZFlatParallel)->DenseRange(0, 1);
+
+// Compresses the test files with no time limit (arg 0), and with a budget
+// that is exhausted from the start (arg 1), which stores them as literals.
+static void BM_ZFlatBudget(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  string contents;
+  for (size_t i = 0; i < ARRAYSIZE(files); ++i) {
+    contents += ReadTestDataFile(files[i].filename, files[i].size_limit);
+  }
+  string compressed;
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(contents.size()));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    snappy::Deadline deadline(arg == 0 ? 1000000000 : 0);
+    snappy::CompressWithBudget(contents.data(), contents.size(), &compressed,
+                               &deadline);
+  }
+  StopBenchmarkTiming();
+
+  SetBenchmarkLabel(StringPrintf("%s, %d%%",
+                                 arg == 0 ? "unlimited" : "exhausted",
+                                 static_cast<int>(100.0 * compressed.size() /
+                                                  contents.size())));
+}
+BENCHMARK(BM_ZFlatBudget)->DenseRange(0, 1);
+
+// Compresses the test files only if that saves 10%, either by compressing
+// them with RawCompress() and comparing (even args) or with
+// CompressIfSmallerThan() (odd args); args 0 and 1 are the JPEG, which does
+// not compress, 2 and 3 the HTML, which does.
+static void BM_ZFlatIfSmaller(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  const int file_index = arg < 2 ? 2 : 0;
+  const string contents = ReadTestDataFile(files[file_index].filename,
+                                           files[file_index].size_limit);
+  const size_t max_compressed_length = contents.size() / 10 * 9;
+  char* dst = new char[snappy::MaxCompressedLength(contents.size())];
+  bool compressed = false;
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(contents.size()));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    size_t compressed_length;
+    if (arg % 2 == 0) {
+      snappy::RawCompress(contents.data(), contents.size(), dst,
+                          &compressed_length);
+      compressed = compressed_length <= max_compressed_length;
+    } else {
+      compressed = snappy::CompressIfSmallerThan(
+          contents.data(), contents.size(), max_compressed_length, dst,
+          &compressed_length);
+    }
+  }
+  StopBenchmarkTiming();
+
+  delete[] dst;
+  SetBenchmarkLabel(StringPrintf("%s, %s", files[file_index].label,
+                                 compressed ? "compressed" : "stored"));
+}
+BENCHMARK(BM_ZFlatIfSmaller)->DenseRange(0, 3);
+
+// Compresses 4 MB of each test file with an AutoTuningCompressor that
+// weighs a nanosecond of compression like a byte of output, after it was
+// tuned on the first 256 KiB.
+static void BM_ZFlatAutoTuned(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  static const size_t kInputSize = 4 << 20;
+  const string contents = ReadTestDataFile(files[arg].filename,
+                                           files[arg].size_limit);
+  string input;
+  while (input.size() < kInputSize) {
+    input.append(contents, 0, kInputSize - input.size());
+  }
+  snappy::CostObjective objective(1, 1e-9);
+  snappy::AutoTuningCompressor compressor(&objective);
+  string compressed;
+  compressor.Compress(input.data(), input.size(), &compressed);
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(kInputSize));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    compressor.Compress(input.data(), input.size(), &compressed);
+  }
+  StopBenchmarkTiming();
+
+  const snappy::CompressionOptions& options = compressor.options();
+  SetBenchmarkLabel(StringPrintf("%s (%.2f %%) bits %d skip %d block %d",
+                                 files[arg].label,
+                                 100.0 * compressed.size() / input.size(),
+                                 options.hash_table_bits, options.skip_shift,
+                                 static_cast<int>(options.block_size)));
+}
+BENCHMARK(BM_ZFlatAutoTuned)->DenseRange(0, ARRAYSIZE(files) - 1);
+
+static void BM_ZFramed(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  // arg = 0: no sync markers; arg = 1: a sync marker every MiB;
+  // arg = 2: content-defined chunks; arg = 3: same, deduplicated
+  static const size_t kInputSize = 4 << 20;
+  const string contents = ReadTestDataFile(files[0].filename,
+                                           files[0].size_limit);
+  string input;
+  while (input.size() < kInputSize) {
+    input.append(contents, 0, kInputSize - input.size());
+  }
+  snappy::FramingOptions options;
+  options.sync_interval = arg == 1 ? 1 << 20 : 0;
+  options.content_defined_chunks = arg >= 2;
+  options.dedup_window = arg == 3 ? 64 << 20 : 0;
+  string framed;
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(kInputSize));
+  StartBenchmarkTiming();
+  while (iters-- > 0) {
+    framed.clear();
+    AppendingSink sink(&framed);
+    snappy::FramingSink framing(&sink, options);
+    framing.Append(input.data(), input.size());
+  }
+  StopBenchmarkTiming();
+
+  SetBenchmarkLabel(StringPrintf("%s (%.2f %%)", files[0].label,
+                                 100.0 * framed.size() / input.size()));
+}
+BENCHMARK(BM_ZFramed)->DenseRange(0, 3);
+
+// Compresses a zeroed buffer (arg 0) or a buffer of long runs of random
+// bytes (arg 1).
+static void BM_ZFlatUniform(int iters, int arg) {
+  StopBenchmarkTiming();
+
+  const size_t kSize = 1 << 20;
+  string contents(kSize, '\0');
+  if (arg == 1) {
+    ACMRandom rnd(301);
+    for (size_t pos = 0; pos < kSize; ) {
+      const size_t run = min<size_t>(kSize - pos, 1 + rnd.Uniform(4096));
+      memset(string_as_array(&contents) + pos, rnd.Rand8(), run);
+      pos += run;
+    }
+  }
+  char* dst = new char[snappy::MaxCompressedLength(contents.size())];
+
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) *
+                             static_cast<int64>(contents.size()));
+  SetBenchmarkLabel(arg == 0 ? "zeros" : "runs");
+  StartBenchmarkTiming();
+
+  size_t zsize = 0;
+  while (iters-- > 0) {
+    snappy::RawCompress(contents.data(), contents.size(), dst, &zsize);
+  }
+  StopBenchmarkTiming();
+  delete[] dst;
+}
+BENCHMARK(BM_ZFlatUniform)->DenseRange(0, 1);
+
 
 }  // namespace snappy
 